@@ -11,7 +11,51 @@
 * Press the a key to increase global ambient lighting.
 * Press the A key to decrease global ambient lighting.
 * Press the arrow keys to move around (↑ forward, ↓ backward, ← turn left, → turn right).
+* Press the p key to toggle the profiler and its on-screen overlay.
 * Press ESC to exit the program.
+
+* Command line:
+* --headless            render offscreen (EGL pbuffer, e.g. Mesa llvmpipe) without a window
+* --frames N            number of benchmark frames in headless mode (default 300)
+* --size WxH            headless render resolution (default 800x600)
+* --out FILE            write the headless benchmark JSON to FILE instead of stdout
+* --profile             start with the phase profiler enabled
+* --trace FILE          enable the profiler and write a Chrome trace (chrome://tracing) on exit
+* --bubbles N           number of bubble particles (default 30)
+* --bench-particles     headless: time particle update and draw for 1k..1M particles
+* --bench-collision     time sliding moves against 100..100k obstacles, grid vs brute force
+* --bench-transforms    time transform hierarchy updates for 1k..100k nodes, scalar vs SIMD
+*                       and full vs dirty-only
+* --bench-animation     time keyframe evaluation for 1k..100k animated channels, scalar vs SIMD
+* --sparkles N          sparkles per slipper (default 10)
+* --sparkle-hz F        sparkle pattern changes per second of animation (default 60)
+* --seed N              seed for the scene's random effects (default 1)
+* --no-lod              draw curved shapes at full tessellation regardless of size
+* --no-cull             draw every object even when it is outside the view frustum
+* --no-portal           skip the doorway visibility test between the room and outdoors
+* --frame-dt S          headless: simulated seconds per frame (default one 0.016 s tick);
+*                       smaller values exercise interpolation, larger ones catch-up
+* --scene FILE          scene to load (default Scenes/oz.txt); a .txt is converted to the
+*                       .ozb beside it when that is missing, older or from another version
+* --convert-scene IN OUT  convert a text scene to the binary format and exit
+* --fixed-function      light with GL_LIGHTn even where the GLSL 3.3 lighting path is available
+* --no-shadow-cache     redraw every shadow map in full each frame instead of only what moved
+* --no-damage           draw every frame, even when nothing on screen has changed
+* --still               headless: leave the camera and the scene alone for the whole run
+* --record FILE         log this session's keys, with the seed, to FILE on exit
+* --replay FILE         play a recorded session back at one tick per frame and exit;
+*                       headless, this replaces the scripted fly-through (and --frames)
+* --check [DIR]         headless: render the reference poses and scene states and compare
+*                       pictures, frame time and GL call counts with DIR; non-zero exit on failure.
+*                       DIR defaults to checks/glsl or checks/fixed-function, whichever lighting
+*                       path the run gets; those hold references recorded with llvmpipe
+* --check-record [DIR]  headless: render them and store the results in DIR as the references
+* --threads N           threads building draw commands, main thread included (default: one per core)
+* --bench-commands      headless: time draw command building for 1..4096 copies of the scene
+*                       on 1..N threads
+* --lights N            add N small random lights around the room (GLSL path only)
+* --bench-lights        headless: time clustered light binning and frames for 0..4096 lights
+* Linux build: g++ -O2 wizardofox.cpp -lglut -lGLU -lGL -lEGL -lpthread
 * reference: https://stackoverflow.com/questions/63358101/how-to-visualize-a-spot-light-in-opengl
 * reference: https://learnopengl.com/Lighting/Light-casters
 *******************************************/
@@ -20,737 +64,5031 @@
 #include <fstream>
 #include <string>
 #include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <map>
+#include <unordered_map>
+#include <sstream>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__SSE__) || defined(_M_X64)
+#  include <xmmintrin.h>
+#elif defined(__ARM_NEON)
+#  include <arm_neon.h>
+#endif
 #ifdef __APPLE__
 #  include <GLUT/glut.h>
+#  include <dlfcn.h>
 #else
+#  define GL_GLEXT_PROTOTYPES
 #  include <GL/glut.h>
+#  ifdef FREEGLUT
+#    include <GL/freeglut_ext.h>
+#  endif
+#  include <EGL/egl.h>
+#  include <EGL/eglext.h>
 #endif
 using namespace std;
 
 // globals
 GLuint texture[1]; // [0]=grass
+bool headlessMode = false;
+int viewportHeight = 600; // set by reshape()
+float viewAspect = 800.0f / 600.0f;
 float camX = 0.0f, camY = 2.0f, camZ = 15.0f;
 float angle = 0.0f;
 float moveSpeed = 0.5f;
 float turnSpeed = 0.1f;
-float doorOffset = 0.0f;
-const float maxDoorSlide = 2.0f;
-bool doorOpening = false;
-bool doorClosing = false;
+float doorOffset = 0.0f; // set by the scene's animation channels, like the heel and broom
+const float doorWidth = 2.0f, doorHeight = 3.0f; // doorway centred in the front wall
 
 // Room boundary
 float roomX1 = -5.0f, roomX2 = 5.0f;
 float roomZ1 = -10.0f, roomZ2 = 0.0f;
+float roomHeight = 5.0f;
 
 //Lighting
 bool ceilingLightOn = true;
 float globalAmbientLevel = 0.3f;
 bool heelClicking = false;
 float heelOffset = 0.0f;
-float heelDir = 1.0f;
-bool broomFlying = false;
 float broomOffsetY = 0.0f;
-float broomDir = 1.0f;
+const float TICK_SECONDS = 0.016f;
+double simTime = 0.0; // seconds of animation simulated so far
+
+// Simulation state at the last two ticks. Frames draw a blend of the two,
+// so the globals above belong to the simulation and draw code reads view.
+struct SimState {
+    double time;
+    float doorOffset, heelOffset, broomOffsetY;
+};
+SimState simStates[2]; // [0] previous tick, [1] latest tick
+SimState view;         // what the current frame draws
+float renderAlpha = 1.0f; // position of this frame between the two ticks
 
-// Table bounds
-float tableMinX = -1.0f, tableMaxX =1.0f;
-float tableMinZ = -6.5f, tableMaxZ = -5.5f;
+SimState captureSimState() {
+    SimState st = {simTime, doorOffset, heelOffset, broomOffsetY};
+    return st;
+}
 
-// Broom bounds
-float broomMinX = -4.5f, broomMaxX = -3.6f;
-float broomMinZ = -9.0f, broomMaxZ = -9.1f;
+SimState lerpSimState(const SimState &a, const SimState &b, float t) {
+    SimState st;
+    st.time = a.time + (b.time - a.time) * t;
+    st.doorOffset = a.doorOffset + (b.doorOffset - a.doorOffset) * t;
+    st.heelOffset = a.heelOffset + (b.heelOffset - a.heelOffset) * t;
+    st.broomOffsetY = a.broomOffsetY + (b.broomOffsetY - a.broomOffsetY) * t;
+    return st;
+}
 
-// Spotlight
-GLUquadric* spotlightCone = gluNewQuadric();
+// sparkles on the ruby slippers
+int sparklesPerShoe = 10;
+float sparkleHz = 60.0f;   // how often the sparkle pattern changes
+uint64_t sceneSeed = 1;
 
 // g key toggle
 bool whiteGlowOn = true;
 bool greenMode = false;
+bool greenLightOn = true; // on with the scene, then follows greenMode
 
 // r key toggled, bubble floating
-const int NUM_BUBBLES = 30;
-float bubbleX[NUM_BUBBLES];
-float bubbleY[NUM_BUBBLES];
-float bubbleZ[NUM_BUBBLES];
-float bubbleSpeed[NUM_BUBBLES];
+int numBubbles = 30;
 bool bubblesActive = false;
 
+// damage tracking
+// A frame is only drawn when something it shows may have changed. Input,
+// light switches, reshape and a texture arriving mark the scene dirty, and
+// so does every tick that moves or animates something. Each mark buys two
+// frames: the doorway's occlusion query answers one frame late.
+bool damageTracking = true; // --no-damage draws every frame
+int dirtyFrames = 2;
+long framesDrawn = 0, framesSkipped = 0;
+double drawnCpuMs = 0.0;    // process CPU time spent in drawn frames
+bool sparklesShown = false; // the last frame drew sparkles, which change with time
 
-// texture
-struct BitMapFile {
-   int sizeX;
-   int sizeY;
-   unsigned char *data;
-};
-
-BitMapFile *getBMPData(string filename) {
-   BitMapFile *bmp = new BitMapFile;
-   unsigned int size, offset, headerSize;
-   ifstream infile(filename.c_str(), ios::binary);
-   infile.seekg(10); infile.read((char*)&offset, 4);
-   infile.read((char*)&headerSize, 4);
-   infile.seekg(18);
-   infile.read((char*)&bmp->sizeX, 4);
-   infile.read((char*)&bmp->sizeY, 4);
-   size = bmp->sizeX * bmp->sizeY * 3;
-   bmp->data = new unsigned char[size];
-   infile.seekg(offset);
-   infile.read((char*)bmp->data, size);
-   for (int i = 0; i < size; i += 3) {
-      unsigned char temp = bmp->data[i];
-      bmp->data[i] = bmp->data[i + 2];
-      bmp->data[i + 2] = temp;
-   }
-   return bmp;
-}
-
-// texture
-void loadGrassTexture() {
-   BitMapFile *image = getBMPData("Textures/grass.bmp");
-   glBindTexture(GL_TEXTURE_2D, texture[0]);
-   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-   glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, image->sizeX, image->sizeY, 0, GL_RGB, GL_UNSIGNED_BYTE, image->data);
-}
-
-// draw outdoor
-void drawOutdoorScene() {
-       glDisable(GL_LIGHTING);
-       glEnable(GL_TEXTURE_2D);
-       // Only draw grass
-       glBindTexture(GL_TEXTURE_2D, texture[0]);
-       glBegin(GL_QUADS);
-       glTexCoord2f(0, 0); glVertex3f(-50, 0, -50);
-       glTexCoord2f(5, 0); glVertex3f(50, 0, -50);
-       glTexCoord2f(5, 5); glVertex3f(50, 0, 50);
-       glTexCoord2f(0, 5); glVertex3f(-50, 0, 50);
-       glEnd();
-       glDisable(GL_TEXTURE_2D);
-       glEnable(GL_LIGHTING);
-    }
-
-// lighting
-void updateLighting() {
-   GLfloat ambient[] = {globalAmbientLevel, globalAmbientLevel, globalAmbientLevel, 1.0f};
-   glLightModelfv(GL_LIGHT_MODEL_AMBIENT, ambient);
-   if (ceilingLightOn) glEnable(GL_LIGHT1);
-   else glDisable(GL_LIGHT1);
+void markDirty() {
+    dirtyFrames = 2;
 }
 
-void drawTable() {
-    GLfloat woodAmbient[] = {0.4f, 0.2f, 0.0f, 1.0f};
-    GLfloat woodDiffuse[] = {0.8f, 0.5f, 0.2f, 1.0f};
-    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, woodAmbient);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, woodDiffuse);
-    // Table top
-    glPushMatrix();
-    glTranslatef(0.0f, 2.5f, -5.0f);
-    glScalef(4.0f, 0.2f, 3.0f);
-    glutSolidCube(1.0f);
-    glPopMatrix();
-    // Legs
-    float legX[] = {-1.8f, 1.8f};
-    float legZ[] = {-1.3f, 1.3f};
-    for (int i = 0; i < 2; i++) {
-        for (int j = 0; j < 2; j++) {
-            glPushMatrix();
-            glTranslatef(legX[i], 1.25f, -5.0f + legZ[j]);
-            glScalef(0.2f, 2.5f, 0.2f);
-            glutSolidCube(1.0f);
-            glPopMatrix();
-        }
-    }
+bool frameDirty() {
+    return !damageTracking || dirtyFrames > 0;
 }
 
-void drawRubySlippers() {
-    float tableTopY = 2.5f; // height of table top
-    // materials
-    GLfloat redAmbient[] = {0.4f, 0.0f, 0.0f, 1.0f};
-    GLfloat redDiffuse[] = {1.0f, 0.0f, 0.0f, 1.0f};
-    GLfloat redSpecular[] = {1.0f, 1.0f, 1.0f, 1.0f};
-    GLfloat white[] = {1.0f, 1.0f, 1.0f, 1.0f};
-    GLfloat shininess[] = {100.0f};
-    float offset = fabs(heelOffset);
-    // left shoe
-    glPushMatrix();
-    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, redAmbient);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, redDiffuse);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, redSpecular);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_SHININESS, shininess);
-    glTranslatef(-0.4f, tableTopY + 0.2f + offset, -5.0f);
-    glRotatef(15, 1.0f, 0.0f, 0.0f);
-    glScalef(0.6f, 0.2f, 1.2f);
-    glutSolidCube(1.0f);
-    glPopMatrix();
-    // left sparkle
-    for (int i = 0; i < 10; i++) {
-        float sx = ((rand() % 100) / 500.0f) - 0.1f;
-        float sy = 0.2f + ((rand() % 100) / 500.0f);
-        float sz = ((rand() % 100) / 500.0f) - 0.1f;
-        glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, white);
-        glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, white);
-        glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, white);
-        glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, 100.0f);
-        glPushMatrix();
-        glTranslatef(-0.4f + sx, tableTopY + sy + offset, -5.0f + sz);
-        glutSolidSphere(0.02f, 8, 8);
-        glPopMatrix();
-    }
-    
-    glPushMatrix();
-    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, redAmbient);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, redDiffuse);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, redSpecular);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_SHININESS, shininess);
-    glTranslatef(-0.4f, tableTopY + 0.1f, -5.6f);
-    glScalef(0.2f, 0.4f, 0.2f);
-    glutSolidCube(1.0f);
-    glPopMatrix();
-    // right shoe
-    glPushMatrix();
-    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, redAmbient);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, redDiffuse);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, redSpecular);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_SHININESS, shininess);
-    glTranslatef(0.4f, tableTopY + 0.2f + offset, -5.0f);
-    glRotatef(15, 1.0f, 0.0f, 0.0f);
-    glScalef(0.6f, 0.2f, 1.2f);
-    glutSolidCube(1.0f);
-    glPopMatrix();
-    // right sparkle
-    for (int i = 0; i < 10; i++) {
-        float sx = ((rand() % 100) / 500.0f) - 0.1f;
-        float sy = 0.2f + ((rand() % 100) / 500.0f);
-        float sz = ((rand() % 100) / 500.0f) - 0.1f;
-        glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, white);
-        glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, white);
-        glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, white);
-        glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, 100.0f);
-        glPushMatrix();
-        glTranslatef(0.4f + sx, tableTopY + sy + offset, -5.0f + sz);
-        glutSolidSphere(0.02f, 8, 8);
-        glPopMatrix();
-    }
-    // right heel
-    glPushMatrix();
-    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, redAmbient);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, redDiffuse);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, redSpecular);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_SHININESS, shininess);
-    glTranslatef(0.4f, tableTopY + 0.1f, -5.6f);
-    glScalef(0.2f, 0.4f, 0.2f);
-    glutSolidCube(1.0f);
-    glPopMatrix();
+double cpuMsNow() {
+    return 1000.0 * clock() / CLOCKS_PER_SEC;
 }
 
-void drawLampOnTable() {
-    float tableTopY = 2.5f;
-    float baseX = -0.8f;  // left side of table
-    float lampZ = -5.0f;
-    float verticalHeight = 0.8f;
-    float horizontalLength = 0.8f;
-
-    GLfloat darkGray[] = {0.2f, 0.2f, 0.2f, 1.0f};
-    GLfloat bulbColor[] = {1.0f, 0.9f, 0.6f, 1.0f};
+// input queue
+// GLUT callbacks only queue what arrived, stamped with the time; the queue
+// is drained just before the simulation advances, on the main thread, so no
+// input callback touches GL state. Each drained event is then followed to
+// the tick it lands in, the start of the first frame drawn after it and
+// that frame's present (glutSwapBuffers returning; headless, glFinish), and
+// its latency from arrival to each point goes into a histogram.
+enum InputKind { INPUT_KEY, INPUT_ARROW };
 
-    GLUquadric* quad = gluNewQuadric();
+struct QueuedInput {
+    InputKind kind;
+    int key; // ASCII, or GLUT_KEY_* for arrows
+    chrono::steady_clock::time_point arrived;
+};
 
-    // base
-    glPushMatrix();
-    glTranslatef(baseX, tableTopY + 0.025f, lampZ);
-    glRotatef(-90.0f, 1.0f, 0.0f, 0.0f); // flat on table
-    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE, darkGray);
-    gluDisk(quad, 0.0f, 0.2f, 32, 1);
-    glPopMatrix();
+enum LatencyStage { LATENCY_DRAINED, LATENCY_SIMULATED, LATENCY_RENDERED, LATENCY_PRESENTED, LATENCY_STAGE_COUNT };
+const char* latencyStageNames[LATENCY_STAGE_COUNT] = {"drained", "simulated", "render_start", "presented"};
 
-    // Vertical Arm
-    glPushMatrix();
-    glTranslatef(baseX, tableTopY + verticalHeight / 2.0f, lampZ);
-    glScalef(0.05f, verticalHeight, 0.05f);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE, darkGray);
-    glutSolidCube(1.0f);
-    glPopMatrix();
+// upper bucket edges; the last bucket takes everything above
+const double latencyBucketMs[] = {0.25, 0.5, 1.0, 2.0, 4.0, 8.0, 16.0, 33.0, 66.0, 133.0};
+const int NUM_LATENCY_BUCKETS = sizeof(latencyBucketMs) / sizeof(latencyBucketMs[0]) + 1;
 
-    // Horizontal Arm
-    glPushMatrix();
-    glTranslatef(baseX + horizontalLength / 2.0f, tableTopY + verticalHeight, lampZ);
-    glScalef(horizontalLength, 0.05f, 0.05f);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE, darkGray);
-    glutSolidCube(1.0f);
-    glPopMatrix();
+struct LatencyHistogram {
+    long counts[NUM_LATENCY_BUCKETS] = {};
+    vector<double> samples; // for percentiles
+};
 
-    //  Cone Lampshade
-    float lampHeadX = baseX + horizontalLength;
-    float lampHeadY = tableTopY + verticalHeight - 0.1f;
-    glPushMatrix();
-    glTranslatef(lampHeadX, lampHeadY, lampZ);
-    glRotatef(-90.0f, 1.0f, 0.0f, 0.0f);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE, bulbColor);
-    gluCylinder(quad, 0.15f, 0.0f, 0.25f, 20, 4);
-    glPopMatrix();
+// an event between being drained and its frame being presented
+struct InputTrace {
+    chrono::steady_clock::time_point arrived;
+    int stages; // stages stamped so far
+};
 
-    glPushMatrix();
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    glDisable(GL_LIGHTING);
-    glColor4f(1.0f, 1.0f, 1.0f, 0.15f);
+vector<QueuedInput> inputQueue;
+vector<InputTrace> inputInFlight;
+LatencyHistogram inputLatency[LATENCY_STAGE_COUNT];
 
-    float coneBase = 1.0f;
-    float coneTip = 0.05f;
-    float coneHeight = lampHeadY - 2.5f;
+void queueInput(InputKind kind, int key) {
+    QueuedInput e = {kind, key, chrono::steady_clock::now()};
+    inputQueue.push_back(e);
+}
 
-    glTranslatef(lampHeadX, lampHeadY, lampZ);
-    glRotatef(-90.0f, -1.0f, 0.0f, 0.0f);
-    gluCylinder(quad, coneTip, coneBase, coneHeight, 16, 1);
+double percentile(const vector<double> &sorted, double p) {
+    size_t idx = (size_t)ceil(p * sorted.size());
+    if (idx > 0) idx--;
+    return sorted[min(idx, sorted.size() - 1)];
+}
 
-    glEnable(GL_LIGHTING);
-    glDisable(GL_BLEND);
-    glPopMatrix();
+void addLatency(LatencyHistogram &h, double ms) {
+    int b = 0;
+    while (b < NUM_LATENCY_BUCKETS - 1 && ms > latencyBucketMs[b]) b++;
+    h.counts[b]++;
+    h.samples.push_back(ms);
+}
 
-    gluDeleteQuadric(quad);
+// events in flight that have not yet reached stage do so now
+void stampInput(LatencyStage stage) {
+    if (inputInFlight.empty()) return;
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    for (size_t i = 0; i < inputInFlight.size(); i++) {
+        InputTrace &t = inputInFlight[i];
+        if (t.stages != stage) continue;
+        addLatency(inputLatency[stage], chrono::duration<double, milli>(now - t.arrived).count());
+        t.stages++;
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < inputInFlight.size(); i++)
+        if (inputInFlight[i].stages < LATENCY_STAGE_COUNT) inputInFlight[kept++] = inputInFlight[i];
+    inputInFlight.resize(kept);
 }
 
-void drawLeaningBroom() {
-    float baseX = -4.6f;
-    float baseZ = -9.6f;
-    float baseY = 0.3f + broomOffsetY;
-    float handleLength = 2.0f;
-    GLfloat handleColor[] = {0.4f, 0.2f, 0.1f, 1.0f};
-    GLfloat bristleColor[] = {0.9f, 0.8f, 0.3f, 1.0f};
-    GLUquadric* quad = gluNewQuadric();
-    // bristle
-    glPushMatrix();
-    glTranslated(0.0f, -0.5f, 0.0f);
-    glPushMatrix();
-    glTranslatef(baseX+0.5f, baseY+0.3f, baseZ);
-    glRotatef(-70.0f, 1.0f, 0.0f, 0.0f); // Lean backward
-    glRotatef(-15.0f, 0.0f, 1.0f, 0.0f); // Side tilt
-    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE, bristleColor);
-    gluCylinder(quad, 0.15f, 0.05f, 0.3f, 16, 3);
-    glPopMatrix();
-    glPopMatrix();
-    // handle
-    glPushMatrix();
-    glTranslated(0.0f, -0.5f, 0.0f);
-    glPushMatrix();
-    glTranslatef(baseX+0.5f, baseY+0.3f, baseZ);
-    glRotatef(-70.0f, 1.0f, 0.0f, 0.0f);
-    glRotatef(-15.0f, 0.0f, 1.0f, 0.0f);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE, handleColor);
-    gluCylinder(quad, 0.05f, 0.05f, handleLength, 12, 3);
-    glPopMatrix();
-    glPopMatrix();
-    gluDeleteQuadric(quad);
+void resetInputLatency() {
+    for (int s = 0; s < LATENCY_STAGE_COUNT; s++) inputLatency[s] = LatencyHistogram();
 }
 
-void drawCeilingLightFixture() {
-    float centerX = 0.0f;
-    float centerY = 4.8f; // near the ceiling
-    float centerZ = -5.0f;
-    float radius = 0.2f;
 
-    // Material properties
-    GLfloat whiteAmbientGlow[]  = {0.8f, 0.8f, 0.8f, 1.0f};
-    GLfloat whiteAmbientDull[]  = {0.2f, 0.2f, 0.2f, 1.0f};
+// mapped files
+// Read-only mappings of data that is used in place.
+struct MappedFile {
+    const unsigned char *data = NULL;
+    size_t size = 0;
+};
 
-    GLfloat whiteDiffuseGlow[]  = {1.0f, 1.0f, 1.0f, 1.0f};
-    GLfloat whiteDiffuseDull[]  = {0.5f, 0.5f, 0.5f, 1.0f};
+bool mapFile(const string &path, MappedFile &f) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return false;
+    f.data = (const unsigned char*)data;
+    f.size = st.st_size;
+    return true;
+}
 
-    GLfloat whiteEmissionGlow[] = {0.7f, 0.7f, 0.7f, 1.0f};
-    GLfloat whiteEmissionDull[] = {0.0f, 0.0f, 0.0f, 1.0f};
+void unmapFile(MappedFile &f) {
+    if (f.data) munmap((void*)f.data, f.size);
+    f = MappedFile();
+}
 
-    GLfloat* whiteAmbient  = whiteGlowOn ? whiteAmbientGlow  : whiteAmbientDull;
-    GLfloat* whiteDiffuse  = whiteGlowOn ? whiteDiffuseGlow  : whiteDiffuseDull;
-    GLfloat* whiteEmission = whiteGlowOn ? whiteEmissionGlow : whiteEmissionDull;
+// write beside the target and rename, so a reader never maps half a file
+bool writeFileAtomically(const string &path, const void *data, size_t size) {
+    string tmpPath = path + ".tmp";
+    FILE *out = fopen(tmpPath.c_str(), "wb");
+    bool ok = out && fwrite(data, 1, size, out) == size;
+    if (out && fclose(out) != 0) ok = false;
+    if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0) {
+        remove(tmpPath.c_str());
+        return false;
+    }
+    return true;
+}
 
-    // Green sphere
-    GLfloat greenAmbientGlow[]   = {0.0f, 0.3f, 0.0f, 1.0f};
-    GLfloat greenAmbientDark[]   = {0.0f, 0.2f, 0.0f, 1.0f};
+// textures
+// Decoding runs on a worker thread. It maps the BMP, builds a box-filtered
+// mip chain from the BGR rows as they are (GL takes GL_BGR, so nothing is
+// swizzled) and saves the chain beside the BMP as .mip; later starts map
+// that and decode nothing. Once it is done the main thread maps a pixel
+// buffer object, a second worker pass copies the chain into it, and a later
+// frame unmaps it and uploads every level from it, so no frame copies the
+// pixels. Until then the grass is drawn in its plain colour.
+const uint32_t MIP_MAGIC = 0x58545a4f; // "OZTX"
+const uint32_t MIP_VERSION = 1;
+const int MAX_MIP_LEVELS = 16;
 
-    GLfloat greenDiffuseGlow[]   = {0.2f, 0.8f, 0.2f, 1.0f};
-    GLfloat greenDiffuseDark[]   = {0.0f, 0.4f, 0.0f, 1.0f};
+#ifndef GL_MAP_WRITE_BIT
+#  define GL_MAP_WRITE_BIT 0x0002
+#  define GL_MAP_INVALIDATE_BUFFER_BIT 0x0008
+#endif
 
-    GLfloat greenEmissionGlow[]  = {0.0f, 0.6f, 0.0f, 1.0f};
-    GLfloat greenEmissionDark[]  = {0.0f, 0.0f, 0.0f, 1.0f};
-    
-    GLfloat* greenAmbient  = heelClicking ? greenAmbientDark  : greenAmbientGlow;
-    GLfloat* greenDiffuse  = heelClicking ? greenDiffuseDark  : greenDiffuseGlow;
-    GLfloat* greenEmission = heelClicking ? greenEmissionDark : greenEmissionGlow;
+void* glProc(const char* name);
+typedef void* (*MapBufferRangeProc)(GLenum target, GLintptr offset, GLsizeiptr length, GLbitfield access);
 
-    GLfloat noEmission[] = {0.0f, 0.0f, 0.0f, 1.0f};
+struct MipHeader {
+    uint32_t magic, version;
+    uint32_t levels, dataSize;
+    int64_t sourceSize, sourceMtime; // the BMP it was built from
+    uint32_t width[MAX_MIP_LEVELS], height[MAX_MIP_LEVELS];
+    uint32_t offset[MAX_MIP_LEVELS]; // from the end of the header
+};
 
-    // Draw string
-    glDisable(GL_LIGHTING);
-    glColor3f(0.2f, 0.2f, 0.2f);
-    glBegin(GL_LINES);
-    glVertex3f(centerX, centerY + radius + 0.1f, centerZ);
-    glVertex3f(centerX, centerY, centerZ);
-    glEnd();
-    glEnable(GL_LIGHTING);
+struct TextureLoad {
+    string path, cachePath;
+    GLuint texture = 0;
+    thread worker;
+    atomic<bool> done{false};
+    bool uploaded = false;
+    GLuint pbo = 0;
+    unsigned char *mapped = NULL; // the pixel buffer, while the worker fills it
+    atomic<bool> filled{false};
+    // filled in by the worker
+    MipHeader mips = MipHeader();
+    MappedFile cache;              // a valid .mip, used in place
+    vector<unsigned char> pixels;  // or a chain built from the BMP
+    const char *source = "missing"; // "cache", "bmp" or "missing"
+    double decodeMs = 0.0, uploadMs = 0.0; // worker and main thread
+};
 
-    // Top white glowing sphere
-    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, whiteAmbient);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, whiteDiffuse);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, whiteEmission);
-    glPushMatrix();
-    glTranslatef(centerX, centerY, centerZ);
-    glutSolidSphere(radius, 20, 20);
-    glPopMatrix();
+TextureLoad grassLoad;
 
-    // Bottom green glowing sphere
-    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, greenAmbient);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, greenDiffuse);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, greenEmission);
-    glPushMatrix();
-    glTranslatef(centerX, centerY - radius * 2.0f, centerZ);
-    glutSolidSphere(radius, 20, 20);
-    glPopMatrix();
+// GL_UNPACK_ALIGNMENT is 4, which is also how BMP pads its rows
+size_t mipStride(int width) {
+    return ((size_t)width * 3 + 3) & ~(size_t)3;
+}
 
-    // Bottom green sphere (Oz head)
-    if (heelClicking) {
-        GLfloat darkGreenAmbient[] = {0.0f, 0.2f, 0.0f, 1.0f};
-        GLfloat darkGreenDiffuse[] = {0.0f, 0.5f, 0.0f, 1.0f};
-        GLfloat noEmission[] = {0.0f, 0.0f, 0.0f, 1.0f};
+uint32_t readLE32(const unsigned char *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
 
-        glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, darkGreenAmbient);
-        glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, darkGreenDiffuse);
-        glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, noEmission);
-    } else {
-        // Glowing green
-        GLfloat greenAmbient[] = {0.0f, 0.3f, 0.0f, 1.0f};
-        GLfloat greenDiffuse[] = {0.2f, 0.8f, 0.2f, 1.0f};
-        GLfloat greenEmission[] = {0.0f, 0.6f, 0.0f, 1.0f};
+// uncompressed 24-bit BMP; pixels points at the first stored row
+bool parseBMP(const MappedFile &f, int &width, int &height, bool &topDown, const unsigned char *&pixels) {
+    if (f.size < 54 || f.data[0] != 'B' || f.data[1] != 'M') return false;
+    uint32_t offset = readLE32(f.data + 10);
+    width = (int32_t)readLE32(f.data + 18);
+    height = (int32_t)readLE32(f.data + 22);
+    int bpp = f.data[28] | f.data[29] << 8;
+    if (readLE32(f.data + 14) < 40 || bpp != 24 || readLE32(f.data + 30) != 0) return false;
+    topDown = height < 0;
+    height = abs(height);
+    if (width <= 0 || height <= 0 || width > 16384 || height > 16384) return false;
+    if ((uint64_t)offset + mipStride(width) * height > f.size) return false;
+    pixels = f.data + offset;
+    return true;
+}
 
-        glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, greenAmbient);
-        glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, greenDiffuse);
-        glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, greenEmission);
+// 2x2 box filter of BGR rows; an odd last row or column is averaged with itself
+void halveBGR(const unsigned char *src, int sw, int sh, unsigned char *dst, int dw, int dh) {
+    size_t srcStride = mipStride(sw), dstStride = mipStride(dw);
+    for (int y = 0; y < dh; y++) {
+        const unsigned char *r0 = src + min(2 * y, sh - 1) * srcStride;
+        const unsigned char *r1 = src + min(2 * y + 1, sh - 1) * srcStride;
+        unsigned char *d = dst + y * dstStride;
+        for (int x = 0; x < dw; x++) {
+            int x0 = min(2 * x, sw - 1) * 3, x1 = min(2 * x + 1, sw - 1) * 3;
+            for (int c = 0; c < 3; c++)
+                d[x * 3 + c] = (r0[x0 + c] + r0[x1 + c] + r1[x0 + c] + r1[x1 + c] + 2) >> 2;
+        }
     }
+}
 
-    glPushMatrix();
-    glTranslatef(centerX, centerY - radius * 2.0f, centerZ);
-    glutSolidSphere(radius, 20, 20);
-    glPopMatrix();
-    
-    glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, noEmission);
-  
-    if (greenMode) {
-        glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, greenEmission);
-    } else {
-        glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, noEmission);
+void buildMipChain(TextureLoad &t, int width, int height, bool topDown, const unsigned char *rows) {
+    MipHeader &h = t.mips;
+    uint32_t size = 0;
+    int w = width, ht = height;
+    for (h.levels = 0; h.levels < (uint32_t)MAX_MIP_LEVELS; h.levels++) {
+        h.width[h.levels] = w;
+        h.height[h.levels] = ht;
+        h.offset[h.levels] = size;
+        size += mipStride(w) * ht;
+        if (w == 1 && ht == 1) {
+            h.levels++;
+            break;
+        }
+        w = max(1, w / 2);
+        ht = max(1, ht / 2);
     }
-
+    h.dataSize = size;
+    t.pixels.resize(size);
+    // GL wants the bottom row first, which is how BMP stores it unless topDown
+    size_t stride = mipStride(width);
+    for (int y = 0; y < height; y++)
+        memcpy(&t.pixels[y * stride], rows + (topDown ? height - 1 - y : y) * stride, stride);
+    for (uint32_t l = 1; l < h.levels; l++)
+        halveBGR(&t.pixels[h.offset[l - 1]], h.width[l - 1], h.height[l - 1],
+                 &t.pixels[h.offset[l]], h.width[l], h.height[l]);
 }
 
-void drawRoomBox() {
-    float w = 10.0f, h = 5.0f, d = 10.0f;
-    float x1 = -w / 2, x2 = w / 2;
-    float y1 = 0.01f, y2 = h;
-    float z1 = -d / 2 - 5, z2 = d / 2 - 5;
-    float doorW = 2.0f, doorH = 3.0f;
-    // Materials
-    GLfloat brownAmbient[]  = {0.2f, 0.1f, 0.0f, 1.0f};
-    GLfloat brownDiffuse[]  = {0.6f, 0.3f, 0.1f, 1.0f};
-    GLfloat whiteAmbient[]  = {0.2f, 0.2f, 0.2f, 1.0f};
-    GLfloat whiteDiffuse[]  = {0.9f, 0.9f, 0.9f, 1.0f};
-    GLfloat blueAmbient[]   = {0.1f, 0.1f, 0.2f, 1.0f};
-    GLfloat blueDiffuse[]   = {0.5f, 0.5f, 1.0f, 1.0f};
-    GLfloat pinkAmbient[]   = {0.2f, 0.1f, 0.1f, 1.0f};
-    GLfloat pinkDiffuse[]   = {1.0f, 0.7f, 0.6f, 1.0f};
-    GLfloat greenAmbient[]  = {0.1f, 0.2f, 0.1f, 1.0f};
-    GLfloat greenDiffuse[]  = {0.6f, 1.0f, 0.6f, 1.0f};
-    GLfloat yellowAmbient[] = {0.2f, 0.2f, 0.1f, 1.0f};
-    GLfloat yellowDiffuse[] = {1.0f, 1.0f, 0.6f, 1.0f};
-    GLfloat doorAmbient[] = {0.3f, 0.3f, 0.0f, 1.0f};
-    GLfloat doorDiffuse[] = {1.0f, 1.0f, 0.2f, 1.0f};
-    // Floor
-    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, brownAmbient);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, brownDiffuse);
-    glNormal3f(0, 1, 0);
-    glBegin(GL_QUADS);
-    glVertex3f(x1,y1,z1); glVertex3f(x2,y1,z1);
-    glVertex3f(x2,y1,z2); glVertex3f(x1,y1,z2);
-    glEnd();
-    // Ceiling
-    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, whiteAmbient);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, whiteDiffuse);
-    glNormal3f(0, 1, 0);
-    glBegin(GL_QUADS);
-    glVertex3f(x1,y2,z1); glVertex3f(x1,y2,z2);
-    glVertex3f(x2,y2,z2); glVertex3f(x2,y2,z1);
-    glEnd();
-    // Walls
-    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, blueAmbient);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, blueDiffuse);
-    glNormal3f(0, 0, 1);
-    glBegin(GL_QUADS);  // Back
-    glVertex3f(x1,y1,z1); glVertex3f(x1,y2,z1);
-    glVertex3f(x2,y2,z1); glVertex3f(x2,y1,z1);
-    glEnd();
-    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, pinkAmbient);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, pinkDiffuse);
-    glNormal3f(1, 0, 0);
-    glBegin(GL_QUADS);  // Left
-    glVertex3f(x1,y1,z1); glVertex3f(x1,y1,z2);
-    glVertex3f(x1,y2,z2); glVertex3f(x1,y2,z1);
-    glEnd();
-    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, greenAmbient);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, greenDiffuse);
-    glNormal3f(-1, 0, 0);
-    glBegin(GL_QUADS);  // Right
-    glVertex3f(x2,y1,z2); glVertex3f(x2,y1,z1);
-    glVertex3f(x2,y2,z1); glVertex3f(x2,y2,z2);
-    glEnd();
-    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, yellowAmbient);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, yellowDiffuse);
-    glNormal3f(0, 0, -1);
-    glBegin(GL_QUADS);  // Front left of door
-    glVertex3f(x1,y1,z2);
-    glVertex3f(x1 + (w - doorW)/2.0f,y1,z2);
-    glVertex3f(x1 + (w - doorW)/2.0f,y2,z2);
-    glVertex3f(x1,y2,z2);
-    glEnd();
-    glBegin(GL_QUADS);  // Front right of door
-    glVertex3f(x2,y1,z2);
-    glVertex3f(x2 - (w - doorW)/2.0f,y1,z2);
-    glVertex3f(x2 - (w - doorW)/2.0f,y2,z2);
-    glVertex3f(x2,y2,z2);
-    glEnd();
-    glBegin(GL_QUADS);  // Front above door
-    glVertex3f(x1 + (w - doorW)/2.0f, doorH, z2);
-    glVertex3f(x2 - (w - doorW)/2.0f, doorH, z2);
-    glVertex3f(x2 - (w - doorW)/2.0f, y2, z2);
-    glVertex3f(x1 + (w - doorW)/2.0f, y2, z2);
-    
-    glEnd();
-    
-    // light switch
-    float switchWidth = 0.2f;
-    float switchHeight = 0.4f;
-    float switchX = -1.8f;
-    float switchY = 2.0f;
-    float switchZ = -0.1f;
+// a .mip that was built from this exact BMP (or any .mip when the BMP is gone)
+bool validMipCache(const MappedFile &f, const struct stat *source) {
+    if (f.size < sizeof(MipHeader)) return false;
+    const MipHeader &h = *(const MipHeader*)f.data;
+    if (h.magic != MIP_MAGIC || h.version != MIP_VERSION || h.levels == 0 || h.levels > (uint32_t)MAX_MIP_LEVELS ||
+        (uint64_t)sizeof(MipHeader) + h.dataSize != f.size)
+        return false;
+    if (source && (h.sourceSize != (int64_t)source->st_size || h.sourceMtime != (int64_t)source->st_mtime))
+        return false;
+    for (uint32_t l = 0; l < h.levels; l++) {
+        if (h.width[l] == 0 || h.height[l] == 0 || h.width[l] > 16384 || h.height[l] > 16384 ||
+            (uint64_t)h.offset[l] + mipStride(h.width[l]) * h.height[l] > h.dataSize)
+            return false;
+    }
+    return true;
+}
 
-    GLfloat switchAmbient[] = {0.2f, 0.2f, 0.2f, 1.0f};
-    GLfloat switchDiffuse[] = {0.6f, 0.6f, 0.6f, 1.0f};
-    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, switchAmbient);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, switchDiffuse);
+void decodeTexture(TextureLoad *t) {
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    struct stat st;
+    bool haveSource = stat(t->path.c_str(), &st) == 0;
+    if (mapFile(t->cachePath, t->cache)) {
+        if (validMipCache(t->cache, haveSource ? &st : NULL)) {
+            t->mips = *(const MipHeader*)t->cache.data;
+            t->source = "cache";
+        }
+        else unmapFile(t->cache);
+    }
+    MappedFile bmp;
+    if (!t->cache.data && haveSource && mapFile(t->path, bmp)) {
+        int width, height;
+        bool topDown;
+        const unsigned char *rows;
+        if (parseBMP(bmp, width, height, topDown, rows)) {
+            t->mips.magic = MIP_MAGIC;
+            t->mips.version = MIP_VERSION;
+            t->mips.sourceSize = st.st_size;
+            t->mips.sourceMtime = st.st_mtime;
+            buildMipChain(*t, width, height, topDown, rows);
+            t->source = "bmp";
+            vector<unsigned char> file((const unsigned char*)&t->mips, (const unsigned char*)(&t->mips + 1));
+            file.insert(file.end(), t->pixels.begin(), t->pixels.end());
+            if (!writeFileAtomically(t->cachePath, &file[0], file.size()))
+                cerr << "warning: cannot write texture cache " << t->cachePath << "\n";
+        }
+        else cerr << "warning: " << t->path << " is not an uncompressed 24-bit BMP\n";
+        unmapFile(bmp);
+    }
+    t->decodeMs = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+    t->done = true;
+}
 
-    glPushMatrix();
-    glTranslatef(switchX, switchY, switchZ);
-    glScalef(switchWidth, switchHeight, 0.05f);
-    glutSolidCube(1.0f);
-    glPopMatrix();
-    
-    // Sliding door
-    float doorWidth =2.0f;
-    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, doorAmbient);
-    glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, doorDiffuse);
-    glNormal3f(0, 0, -1);
-    glBegin(GL_QUADS);
-    glVertex3f(-doorWidth/2.0f + doorOffset, y1, z2);
-    glVertex3f(doorWidth/2.0f + doorOffset, y1, z2);
-    glVertex3f(doorWidth/2.0f + doorOffset, doorH, z2);
-    glVertex3f(-doorWidth/2.0f + doorOffset, doorH, z2);
-    glEnd();
+void startTextureLoad(TextureLoad &t, const string &path, GLuint texture) {
+    t.path = path;
+    t.cachePath = path.substr(0, path.rfind('.')) + ".mip";
+    t.texture = texture;
+    t.worker = thread(decodeTexture, &t);
+}
 
+// second worker pass: the chain into the mapped pixel buffer
+void fillTextureBuffer(TextureLoad *t) {
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    const unsigned char *data = t->cache.data ? t->cache.data + sizeof(MipHeader) : &t->pixels[0];
+    memcpy(t->mapped, data, t->mips.dataSize);
+    t->decodeMs += chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+    t->filled = true;
 }
 
-void drawBubbles() {
-    GLfloat bubbleColor[] = {0.8f, 0.9f, 1.0f, 0.6f};
-    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE, bubbleColor);
+// a fresh pixel buffer the size of the chain, mapped for writing
+bool mapTextureBuffer(TextureLoad &t) {
+    MapBufferRangeProc mapBufferRange = (MapBufferRangeProc)glProc("glMapBufferRange");
+    if (!mapBufferRange) return false;
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    glGenBuffers(1, &t.pbo);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, t.pbo);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, t.mips.dataSize, NULL, GL_STREAM_DRAW);
+    t.mapped = (unsigned char*)mapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, t.mips.dataSize,
+                                              GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    if (!t.mapped) {
+        glDeleteBuffers(1, &t.pbo);
+        t.pbo = 0;
+    }
+    t.uploadMs += chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+    return t.mapped != NULL;
+}
 
-    for (int i = 0; i < NUM_BUBBLES; i++) {
-        glPushMatrix();
-        glTranslatef(bubbleX[i], bubbleY[i], bubbleZ[i]);
-        glutSolidSphere(0.1f, 12, 12);
-        glPopMatrix();
+// every level from the filled buffer, or from memory when none could be mapped
+void uploadTexture(TextureLoad &t) {
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    const MipHeader &h = t.mips;
+    size_t base = 0; // offsets into the bound buffer, or a client pointer
+    if (t.pbo) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, t.pbo);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        t.mapped = NULL;
     }
+    else base = (size_t)(t.cache.data ? t.cache.data + sizeof(MipHeader) : &t.pixels[0]);
+    glBindTexture(GL_TEXTURE_2D, t.texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, h.levels - 1);
+    for (uint32_t l = 0; l < h.levels; l++)
+        glTexImage2D(GL_TEXTURE_2D, l, GL_RGB, h.width[l], h.height[l], 0, GL_BGR, GL_UNSIGNED_BYTE,
+                     (const GLvoid*)(base + h.offset[l]));
+    if (t.pbo) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        glDeleteBuffers(1, &t.pbo);
+        t.pbo = 0;
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+    t.uploadMs += chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
 }
 
-void drawSun() {
-    GLfloat sunEmission[] = {1.0f, 0.85f, 0.0f, 1.0f};
-    glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, sunEmission);
-    glPushMatrix();
-    glTranslatef(20.0f, 20.0f, -20.0f);
-    glutSolidSphere(2.0f, 30, 30);
-    glPopMatrix();
+// Once the worker has decoded, map a buffer and start it filling; once that
+// is filled, on a later frame, upload. wait does both now.
+void finishTextureLoad(TextureLoad &t, bool wait) {
+    if (t.uploaded || !t.worker.joinable()) return;
+    if (!t.mapped) {
+        if (!wait && !t.done) return;
+        t.worker.join();
+        if (!t.cache.data && t.pixels.empty()) {
+            t.uploaded = true;
+            cerr << "warning: " << t.path << " not found, grass is untextured\n";
+            return;
+        }
+        if (mapTextureBuffer(t)) {
+            t.worker = thread(fillTextureBuffer, &t);
+            if (!wait) return;
+        }
+    }
+    if (t.mapped) {
+        if (!wait && !t.filled) return;
+        t.worker.join();
+    }
+    t.uploaded = true;
+    uploadTexture(t);
+    unmapFile(t.cache);
+    vector<unsigned char>().swap(t.pixels);
+}
 
-    // Reset emission so it doesn't affect other objects
-    GLfloat noEmission[] = {0.0f, 0.0f, 0.0f, 1.0f};
-    glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, noEmission);
+// the worker must not outlive the program's globals
+void joinTextureLoadsAtExit() {
+    if (grassLoad.worker.joinable()) grassLoad.worker.join();
 }
 
-void drawTeapotOnCube() {
-    // cube
-    GLfloat cubeColor[] = {0.2f, 0.4f, 0.6f, 1.0f};  // A blueish cube
-    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE, cubeColor);
-    glutSolidCube(1.0f);
+// GL entry points newer than the headers we can rely on (macOS ships GL 2.1)
+#ifndef GL_TIMESTAMP
+#  define GL_TIMESTAMP 0x8E28
+#endif
 
-    // teapot
-    GLfloat potColor[] = {0.8f, 0.2f, 0.2f, 1.0f};
-    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE, potColor);
-    glPushMatrix();
-    glTranslatef(0.0f, 0.6f, 0.0f);
-    glutSolidTeapot(0.4f);
-    glPopMatrix();
+void* glProc(const char* name) {
+#ifdef __APPLE__
+    return dlsym(RTLD_DEFAULT, name);
+#else
+#  ifdef FREEGLUT
+    if (!headlessMode) return (void*)glutGetProcAddress(name);
+#  endif
+    return (void*)eglGetProcAddress(name);
+#endif
 }
 
-void setupSunlight() {
-    glEnable(GL_LIGHT3);
-    GLfloat sunDirection[] = {-1.0f, -1.0f, 1.0f, 0.0f};
-    GLfloat sunAmbient[]   = {0.1f, 0.1f, 0.1f, 1.0f};
-    GLfloat sunDiffuse[]   = {1.0f, 0.9f, 0.5f, 1.0f};
-    GLfloat sunSpecular[]  = {1.0f, 0.9f, 0.6f, 1.0f};
+typedef void (*QueryCounterProc)(GLuint id, GLenum target);
+typedef void (*GetQueryObjectui64vProc)(GLuint id, GLenum pname, uint64_t *params);
 
-    glLightfv(GL_LIGHT3, GL_POSITION, sunDirection);
-    glLightfv(GL_LIGHT3, GL_AMBIENT, sunAmbient);
-    glLightfv(GL_LIGHT3, GL_DIFFUSE, sunDiffuse);
-    glLightfv(GL_LIGHT3, GL_SPECULAR, sunSpecular);
-}
+// profiler
+// Scoped CPU timers plus GL timestamp queries per draw/update phase. Samples
+// go into a ring of the last PROF_HISTORY frames; GPU results are read back
+// PROF_GPU_LAG frames later so the CPU never stalls on a query. When the
+// profiler is off every scope is a single branch.
+enum ProfPhase {
+    PROF_FRAME, PROF_OUTDOOR, PROF_SUN, PROF_ROOM, PROF_TEAPOT, PROF_TABLE,
+    PROF_SLIPPERS, PROF_LAMP, PROF_BROOM, PROF_FIXTURE, PROF_BUBBLES, PROF_UPDATE, PROF_SHADOWS,
+    PROF_COUNT
+};
 
-void drawScene() {
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    glLoadIdentity();
-    gluLookAt(camX, camY, camZ, camX + sin(angle), camY, camZ - cos(angle), 0.0f, 1.0f, 0.0f);
-    updateLighting();
-    //glEnable(GL_LIGHT3);
-    drawOutdoorScene();
-    drawSun();
-    //glDisable(GL_LIGHT3);
-    
-    drawRoomBox();
-    
-    glPushMatrix();
-    glTranslatef(4.0f, 0.5f, -9.0f);
-    glScalef(1.0f, 1.0f, 1.0f);
-    drawTeapotOnCube();
-    glPopMatrix();
+const char* profPhaseNames[PROF_COUNT] = {
+    "frame", "outdoor", "sun", "room", "teapot", "table", "slippers", "lamp", "broom",
+    "fixture", "bubbles", "update", "shadows"
+};
 
-    if (greenMode) {
-        GLfloat normalAmbient[] = {globalAmbientLevel, globalAmbientLevel, globalAmbientLevel, 1.0f};
-        glLightModelfv(GL_LIGHT_MODEL_AMBIENT, normalAmbient);
-    }
+const int PROF_HISTORY = 512;
+const int PROF_MAX_EVENTS = 48;
+const int PROF_GPU_LAG = 4;
 
-    glPushMatrix();
-    glTranslatef(0.0f, 0.0f, -5.0f);
-    glScalef(0.6f, 0.6f, 0.6f);
-    drawTable();
-    drawRubySlippers();
-    glPopMatrix();
+struct ProfEvent {
+    ProfPhase phase;
+    double cpuStartUs, cpuDurUs;
+    double gpuStartUs, gpuDurUs; // -1 until resolved (or no GPU timing)
+};
 
-    if (greenMode) {
-        GLfloat greenAmbient[] = {0.2f, 0.5f, 0.2f, 1.0f};
-        glLightModelfv(GL_LIGHT_MODEL_AMBIENT, greenAmbient);
-    }
-    
-    glPushMatrix();
-    glTranslatef(0.0f, 0.0f, -5.0f);
-    glScalef(0.6f, 0.6f, 0.6f);
-    drawTable();
-    drawRubySlippers();
-    glPopMatrix();
-    
-    if (greenMode) {
-        GLfloat greenAmbient[] = {0.2f, 0.5f, 0.2f, 1.0f};
-        glLightModelfv(GL_LIGHT_MODEL_AMBIENT, greenAmbient);
-    }
-    
-    glPushMatrix();
-    glTranslatef(0.0f, -0.4f, -3.5f);
-    glScalef(0.8f, 0.8f, 0.8f);
-    drawLampOnTable();
-    glPopMatrix();
+struct ProfFrame {
+    int numEvents;
+    ProfEvent events[PROF_MAX_EVENTS];
+};
 
-    glPushMatrix();
-    glTranslatef(0.0f, -0.4f, -4.0f);
-    glScalef(0.8f, 0.8f, 0.8f);
-    glPopMatrix();
-    drawLeaningBroom();
-    drawCeilingLightFixture();
-    
-    if (bubblesActive) {
-        drawBubbles();
-    }
+bool profilerEnabled = false;
+bool profilerOverlay = false;
+long frameStateIssued = 0, frameStateElided = 0; // GL state cache, last frame
+int cullTested = 0, cullRejected = 0; // frustum culling, current frame
+string traceOutPath;
+ProfFrame profRing[PROF_HISTORY];
+long profFrameCount = 0;     // frames completed
+chrono::steady_clock::time_point profEpoch = chrono::steady_clock::now();
 
-    glutSwapBuffers();
+bool profGpuTiming = false;
+QueryCounterProc pglQueryCounter = NULL;
+GetQueryObjectui64vProc pglGetQueryObjectui64v = NULL;
+GLuint profQueries[PROF_GPU_LAG][PROF_MAX_EVENTS * 2];
+long profQueryFrame[PROF_GPU_LAG]; // frame whose queries a slot holds, -1 if none
+
+double profNowUs() {
+    return chrono::duration<double, micro>(chrono::steady_clock::now() - profEpoch).count();
 }
 
-bool isColliding(float newX, float newZ) {
-    // 1. Wall collision
-    if (newZ > roomZ2 + 0.1f) return false;
-    if (newX < roomX1 || newX > roomX2 || newZ < roomZ1 || newZ > roomZ2)
-        return true;
+void initProfiler() {
+    pglQueryCounter = (QueryCounterProc)glProc("glQueryCounter");
+    pglGetQueryObjectui64v = (GetQueryObjectui64vProc)glProc("glGetQueryObjectui64v");
+    const char* ext = (const char*)glGetString(GL_EXTENSIONS);
+    const char* ver = (const char*)glGetString(GL_VERSION);
+    bool hasTimer = (ext && strstr(ext, "GL_ARB_timer_query")) || (ver && atof(ver) >= 3.3);
+    profGpuTiming = hasTimer && pglQueryCounter && pglGetQueryObjectui64v;
+    if (profGpuTiming) {
+        for (int i = 0; i < PROF_GPU_LAG; i++) {
+            glGenQueries(PROF_MAX_EVENTS * 2, profQueries[i]);
+            profQueryFrame[i] = -1;
+        }
+    }
+    profRing[0].numEvents = 0;
+}
 
-    // 2. Table collision
-    if (newX > tableMinX && newX < tableMaxX &&
-        newZ > tableMinZ && newZ < tableMaxZ)
-        return true;
+ProfFrame &profCurrent() {
+    return profRing[profFrameCount % PROF_HISTORY];
+}
 
-    // 3. Broom collision
-    if (newX > broomMinX && newX < broomMaxX &&
-        newZ > broomMinZ && newZ < broomMaxZ)
-        return true;
+// copy finished GPU timestamps of an older frame into its ring entry
+void profResolveGpu(int slot) {
+    long frame = profQueryFrame[slot];
+    profQueryFrame[slot] = -1;
+    if (frame < 0 || profFrameCount - frame >= PROF_HISTORY) return;
+    ProfFrame &f = profRing[frame % PROF_HISTORY];
+    int frameIdx = -1;
+    for (int i = 0; i < f.numEvents && frameIdx < 0; i++)
+        if (f.events[i].phase == PROF_FRAME) frameIdx = i;
+    if (frameIdx < 0) return;
+    uint64_t base;
+    pglGetQueryObjectui64v(profQueries[slot][frameIdx * 2], GL_QUERY_RESULT, &base);
+    for (int i = 0; i < f.numEvents; i++) {
+        ProfEvent &e = f.events[i];
+        if (e.phase == PROF_UPDATE || e.cpuDurUs < 0.0) continue;
+        uint64_t t0, t1;
+        pglGetQueryObjectui64v(profQueries[slot][i * 2], GL_QUERY_RESULT, &t0);
+        pglGetQueryObjectui64v(profQueries[slot][i * 2 + 1], GL_QUERY_RESULT, &t1);
+        // GPU clock has its own epoch; anchor it to the frame's CPU start
+        e.gpuStartUs = f.events[frameIdx].cpuStartUs + (double)(int64_t)(t0 - base) / 1000.0;
+        e.gpuDurUs = (double)(t1 - t0) / 1000.0;
+    }
+}
 
-    return false;
+int profBegin(ProfPhase phase) {
+    ProfFrame &f = profCurrent();
+    if (f.numEvents >= PROF_MAX_EVENTS) return -1;
+    int idx = f.numEvents++;
+    ProfEvent &e = f.events[idx];
+    e.phase = phase;
+    e.cpuDurUs = e.gpuStartUs = e.gpuDurUs = -1.0;
+    if (profGpuTiming && phase != PROF_UPDATE)
+        pglQueryCounter(profQueries[profFrameCount % PROF_GPU_LAG][idx * 2], GL_TIMESTAMP);
+    e.cpuStartUs = profNowUs();
+    return idx;
 }
 
-//movement
-void handleArrowKeys(int key, int x, int y) {
-    float newX = camX;
-    float newZ = camZ;
-    
-    if (key == GLUT_KEY_LEFT) angle -= turnSpeed;
-    if (key == GLUT_KEY_RIGHT) angle += turnSpeed;
-    if (key == GLUT_KEY_UP) {
-        newX += moveSpeed * sin(angle);
-        newZ -= moveSpeed * cos(angle);
-    }
-    if (key == GLUT_KEY_DOWN) {
-        newX -= moveSpeed * sin(angle);
-        newZ += moveSpeed * cos(angle);
-    }
-    
-    if (!isColliding(newX, newZ)) {
-        camX = newX;
-        camZ = newZ;
-    }
-    
-    glutPostRedisplay();
+void profEnd(int idx) {
+    ProfEvent &e = profCurrent().events[idx];
+    e.cpuDurUs = profNowUs() - e.cpuStartUs;
+    if (profGpuTiming && e.phase != PROF_UPDATE)
+        pglQueryCounter(profQueries[profFrameCount % PROF_GPU_LAG][idx * 2 + 1], GL_TIMESTAMP);
 }
-void mouseClick(int button, int state, int x, int y) {
 
-        }
+struct ProfScope {
+    int idx;
+    ProfScope(ProfPhase phase) : idx(profilerEnabled ? profBegin(phase) : -1) {}
+    ~ProfScope() { if (idx >= 0) profEnd(idx); }
+};
 
-void keyboard(unsigned char key, int, int) {
-    if (key == 'd') doorOpening = true;
-    if (key == 'c') doorClosing = true;
-    if (key == 'g') {
-        greenMode = !greenMode;
-        whiteGlowOn = !whiteGlowOn;
+int profFrameEvent = -1;
 
-        if (greenMode) {
-            glDisable(GL_LIGHT1);
-            glEnable(GL_LIGHT3);
-        } else {
-            glEnable(GL_LIGHT1);
-            glDisable(GL_LIGHT3);
-        }
+// The update tick runs between frames, so its events land in the frame that
+// is about to be drawn.
+void profBeginFrame() {
+    if (!profilerEnabled) return;
+    if (profGpuTiming) {
+        int slot = profFrameCount % PROF_GPU_LAG;
+        if (profQueryFrame[slot] >= 0) profResolveGpu(slot);
     }
+    profFrameEvent = profBegin(PROF_FRAME);
+}
+
+void profEndFrame() {
+    if (!profilerEnabled || profFrameEvent < 0) return;
+    profEnd(profFrameEvent);
+    profFrameEvent = -1;
+    if (profGpuTiming) profQueryFrame[profFrameCount % PROF_GPU_LAG] = profFrameCount;
+    profFrameCount++;
+    profCurrent().numEvents = 0;
+}
+
+// resolve every frame still waiting on GPU queries (end of a run)
+void profFlushGpu() {
+    if (!profilerEnabled || !profGpuTiming) return;
+    glFinish();
+    for (long fr = profFrameCount - PROF_GPU_LAG; fr < profFrameCount; fr++)
+        if (fr >= 0 && profQueryFrame[fr % PROF_GPU_LAG] == fr) profResolveGpu(fr % PROF_GPU_LAG);
+}
+
+void setProfilerEnabled(bool on) {
+    if (on == profilerEnabled) return;
+    profilerEnabled = on;
+    profCurrent().numEvents = 0;
+    profFrameEvent = -1;
+    if (profGpuTiming)
+        for (int i = 0; i < PROF_GPU_LAG; i++) profQueryFrame[i] = -1;
+}
+
+// mean CPU/GPU ms per frame for each phase over the last n completed frames
+void profAverages(int n, double cpuMs[PROF_COUNT], double gpuMs[PROF_COUNT]) {
+    for (int p = 0; p < PROF_COUNT; p++) cpuMs[p] = gpuMs[p] = 0.0;
+    long first = max(0L, profFrameCount - min(n, PROF_HISTORY));
+    int frames = 0, gpuFrames = 0;
+    for (long fr = first; fr < profFrameCount; fr++) {
+        const ProfFrame &f = profRing[fr % PROF_HISTORY];
+        bool gpuReady = false;
+        for (int i = 0; i < f.numEvents; i++)
+            if (f.events[i].phase == PROF_FRAME && f.events[i].gpuDurUs >= 0.0) gpuReady = true;
+        for (int i = 0; i < f.numEvents; i++) {
+            cpuMs[f.events[i].phase] += f.events[i].cpuDurUs / 1000.0;
+            if (gpuReady && f.events[i].gpuDurUs >= 0.0) gpuMs[f.events[i].phase] += f.events[i].gpuDurUs / 1000.0;
+        }
+        frames++;
+        if (gpuReady) gpuFrames++;
+    }
+    for (int p = 0; p < PROF_COUNT; p++) {
+        if (frames) cpuMs[p] /= frames;
+        if (gpuFrames) gpuMs[p] /= gpuFrames;
+    }
+}
+
+void stateEnable(GLenum cap);
+void stateDisable(GLenum cap);
+
+void drawProfilerOverlay() {
+    if (!profilerEnabled || !profilerOverlay || headlessMode) return;
+    double cpuMs[PROF_COUNT], gpuMs[PROF_COUNT];
+    profAverages(60, cpuMs, gpuMs);
+    GLint vp[4];
+    glGetIntegerv(GL_VIEWPORT, vp);
+    glPushAttrib(GL_ENABLE_BIT | GL_CURRENT_BIT);
+    stateDisable(GL_LIGHTING);
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_TEXTURE_2D);
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    gluOrtho2D(0, vp[2], 0, vp[3]);
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    glLoadIdentity();
+    glColor3f(0.0f, 0.0f, 0.0f);
+    for (int p = 0; p <= PROF_COUNT + 1; p++) {
+        char line[96];
+        if (p < PROF_COUNT)
+            snprintf(line, sizeof(line), "%-24s cpu %6.3f ms  gpu %6.3f ms", profPhaseNames[p], cpuMs[p], gpuMs[p]);
+        else if (p == PROF_COUNT)
+            snprintf(line, sizeof(line), "GL state calls/frame     issued %ld  elided %ld", frameStateIssued, frameStateElided);
+        else
+            snprintf(line, sizeof(line), "frustum culling          tested %d  culled %d", cullTested, cullRejected);
+        glRasterPos2i(10, vp[3] - 20 - p * 15);
+        for (const char* c = line; *c; c++) glutBitmapCharacter(GLUT_BITMAP_8_BY_13, *c);
+    }
+    glPopMatrix();
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+    glPopAttrib();
+    stateEnable(GL_LIGHTING); // lighting may be a program, which the attribute stack leaves alone
+}
+
+// Chrome trace-event JSON of everything still in the ring
+bool writeChromeTrace(const string &path) {
+    FILE *out = fopen(path.c_str(), "w");
+    if (!out) return false;
+    fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    fprintf(out, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 1, \"args\": {\"name\": \"CPU\"}},\n");
+    fprintf(out, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 2, \"args\": {\"name\": \"GPU\"}}");
+    long first = max(0L, profFrameCount - PROF_HISTORY);
+    for (long fr = first; fr < profFrameCount; fr++) {
+        const ProfFrame &f = profRing[fr % PROF_HISTORY];
+        for (int i = 0; i < f.numEvents; i++) {
+            const ProfEvent &e = f.events[i];
+            if (e.cpuDurUs < 0.0) continue;
+            fprintf(out, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"frame\": %ld}}",
+                    profPhaseNames[e.phase], e.cpuStartUs, e.cpuDurUs, fr);
+            if (e.gpuDurUs >= 0.0)
+                fprintf(out, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": 2, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"frame\": %ld}}",
+                        profPhaseNames[e.phase], e.gpuStartUs, e.gpuDurUs, fr);
+        }
+    }
+    fprintf(out, "\n]}\n");
+    fclose(out);
+    return true;
+}
+
+void writeTraceAtExit() {
+    if (traceOutPath.empty()) return;
+    if (!writeChromeTrace(traceOutPath)) cerr << "error: cannot write " << traceOutPath << "\n";
+}
+
+// frustum culling
+// Drawables carry world-space boxes that are tested against the view
+// frustum, rebuilt each frame from the same eye, direction and projection
+// parameters that gluLookAt/gluPerspective receive.
+const float FOVY = 60.0f, Z_NEAR = 1.0f, Z_FAR = 100.0f;
+
+struct Bounds {
+    float lo[3], hi[3];
+};
+
+float frustumPlanes[6][4]; // inside when n.p + d >= 0
+float cameraView[16], cameraToWorld[16]; // column-major; the first is what gluLookAt loads
+bool cullingEnabled = true;
+long cullTestedTotal = 0, cullRejectedTotal = 0, cullEmptyFrames = 0;
+
+// plane with normal n through point p
+void setPlane(float plane[4], float nx, float ny, float nz, const float p[3]) {
+    plane[0] = nx;
+    plane[1] = ny;
+    plane[2] = nz;
+    plane[3] = -(nx * p[0] + ny * p[1] + nz * p[2]);
+}
+
+// camera looks along (sin angle, 0, -cos angle) with +y up
+void buildFrustum(float eyeX, float eyeY, float eyeZ, float yaw) {
+    float eye[3] = {eyeX, eyeY, eyeZ};
+    float f[3] = {sin(yaw), 0.0f, -cos(yaw)};
+    float r[3] = {cos(yaw), 0.0f, sin(yaw)};
+    float tanY = tan(FOVY * 0.5f * M_PI / 180.0f), tanX = tanY * viewAspect;
+    float nearP[3] = {eyeX + f[0] * Z_NEAR, eyeY, eyeZ + f[2] * Z_NEAR};
+    float farP[3] = {eyeX + f[0] * Z_FAR, eyeY, eyeZ + f[2] * Z_FAR};
+    setPlane(frustumPlanes[0], f[0], f[1], f[2], nearP);
+    setPlane(frustumPlanes[1], -f[0], -f[1], -f[2], farP);
+    setPlane(frustumPlanes[2], r[0] + f[0] * tanX, 0.0f, r[2] + f[2] * tanX, eye);    // left
+    setPlane(frustumPlanes[3], -r[0] + f[0] * tanX, 0.0f, -r[2] + f[2] * tanX, eye);  // right
+    setPlane(frustumPlanes[4], f[0] * tanY, 1.0f, f[2] * tanY, eye);                  // bottom
+    setPlane(frustumPlanes[5], f[0] * tanY, -1.0f, f[2] * tanY, eye);                 // top
+    // eye axes r, up and -f; the inverse is their transpose plus the eye
+    const float axes[3][3] = {{r[0], r[1], r[2]}, {0.0f, 1.0f, 0.0f}, {-f[0], -f[1], -f[2]}};
+    for (int row = 0; row < 3; row++) {
+        for (int col = 0; col < 3; col++) {
+            cameraView[col * 4 + row] = axes[row][col];
+            cameraToWorld[row * 4 + col] = axes[row][col];
+        }
+        cameraView[12 + row] = -(axes[row][0] * eye[0] + axes[row][1] * eye[1] + axes[row][2] * eye[2]);
+        cameraToWorld[12 + row] = eye[row];
+        cameraView[row * 4 + 3] = cameraToWorld[row * 4 + 3] = 0.0f;
+    }
+    cameraView[15] = cameraToWorld[15] = 1.0f;
+    cullTested = cullRejected = 0;
+}
+
+// column-major 4x4, out = a * b
+void mat4Mul(const float a[16], const float b[16], float out[16]) {
+    float m[16];
+    for (int col = 0; col < 4; col++)
+        for (int row = 0; row < 4; row++)
+            m[col * 4 + row] = a[row] * b[col * 4] + a[4 + row] * b[col * 4 + 1] +
+                               a[8 + row] * b[col * 4 + 2] + a[12 + row] * b[col * 4 + 3];
+    memcpy(out, m, sizeof(m));
+}
+
+void mat4Apply(const float m[16], const float v[4], float out[4]) {
+    for (int row = 0; row < 4; row++)
+        out[row] = m[row] * v[0] + m[4 + row] * v[1] + m[8 + row] * v[2] + m[12 + row] * v[3];
+}
+
+// true when the box is entirely on the outside of one of the planes
+bool outsidePlanes(const float planes[][4], int count, const Bounds &b) {
+    for (int i = 0; i < count; i++) {
+        const float *pl = planes[i];
+        // corner furthest along the plane normal
+        float x = pl[0] >= 0.0f ? b.hi[0] : b.lo[0];
+        float y = pl[1] >= 0.0f ? b.hi[1] : b.lo[1];
+        float z = pl[2] >= 0.0f ? b.hi[2] : b.lo[2];
+        if (pl[0] * x + pl[1] * y + pl[2] * z + pl[3] < 0.0f) return true;
+    }
+    return false;
+}
+
+// no counters touched, so worker threads can call it
+bool frustumRejects(const Bounds &b) {
+    return cullingEnabled && outsidePlanes(frustumPlanes, 6, b);
+}
+
+bool boundsVisible(const Bounds &b) {
+    cullTested++;
+    if (frustumRejects(b)) {
+        cullRejected++;
+        return false;
+    }
+    return true;
+}
+
+Bounds makeBounds(float x1, float y1, float z1, float x2, float y2, float z2) {
+    Bounds b = {{x1, y1, z1}, {x2, y2, z2}};
+    return b;
+}
+
+Bounds sphereBounds(float x, float y, float z, float r) {
+    return makeBounds(x - r, y - r, z - r, x + r, y + r, z + r);
+}
+
+// bounds under glTranslatef(t) glScalef(s, s, s)
+Bounds placeBounds(const Bounds &b, float tx, float ty, float tz, float s) {
+    return makeBounds(tx + b.lo[0] * s, ty + b.lo[1] * s, tz + b.lo[2] * s,
+                      tx + b.hi[0] * s, ty + b.hi[1] * s, tz + b.hi[2] * s);
+}
+
+Bounds unionBounds(const Bounds &a, const Bounds &b) {
+    return makeBounds(min(a.lo[0], b.lo[0]), min(a.lo[1], b.lo[1]), min(a.lo[2], b.lo[2]),
+                      max(a.hi[0], b.hi[0]), max(a.hi[1], b.hi[1]), max(a.hi[2], b.hi[2]));
+}
+
+// portal culling
+// The room and the outdoors are two cells joined by the doorway. Whatever is
+// in the cell the camera is not in can only be seen through the open part
+// of the doorway, so it is skipped when the door is shut or the opening is
+// out of view, and otherwise tested against the narrower frustum through
+// the opening. Within Z_NEAR of the doorway the near plane clips the front
+// wall and that frustum is meaningless; there the room interior falls back
+// to an occlusion query on the room volume, read back a frame later.
+enum PortalView { PORTAL_HIDDEN, PORTAL_VISIBLE, PORTAL_UNSURE };
+
+bool portalCullingEnabled = true;
+bool cameraInRoom = true;
+PortalView portalView = PORTAL_VISIBLE;
+float portalPlanes[5][4]; // sides of the opening and the doorway plane
+GLuint roomQuery = 0;
+bool roomQueryPending = false, roomQueryVisible = true;
+long portalFrame = 0, roomQueryFrame = -1;
+long portalHiddenFrames = 0, roomQueryFrames = 0; // stats
+
+// plane through the eye and an edge of the opening, facing the inside point
+void setPortalPlane(float plane[4], const float eye[3], const float edge[3], const float dir[3], const float inside[3]) {
+    float e[3] = {edge[0] - eye[0], edge[1] - eye[1], edge[2] - eye[2]};
+    float n[3] = {e[1] * dir[2] - e[2] * dir[1], e[2] * dir[0] - e[0] * dir[2], e[0] * dir[1] - e[1] * dir[0]};
+    float side = n[0] * (inside[0] - eye[0]) + n[1] * (inside[1] - eye[1]) + n[2] * (inside[2] - eye[2]);
+    if (side < 0.0f) n[0] = -n[0], n[1] = -n[1], n[2] = -n[2];
+    setPlane(plane, n[0], n[1], n[2], eye);
+}
+
+void updatePortal(float eyeX, float eyeY, float eyeZ) {
+    portalFrame++;
+    cameraInRoom = eyeX > roomX1 && eyeX < roomX2 && eyeZ > roomZ1 && eyeZ < roomZ2 &&
+                   eyeY > 0.0f && eyeY < roomHeight;
+
+    // last frame's occlusion query, if it is back
+    if (roomQueryPending) {
+        GLuint available = 0;
+        glGetQueryObjectuiv(roomQuery, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available) {
+            GLuint samples = 0;
+            glGetQueryObjectuiv(roomQuery, GL_QUERY_RESULT, &samples);
+            roomQueryPending = false;
+            if (roomQueryFrame >= portalFrame - 2) roomQueryVisible = samples > 0;
+        }
+    }
+
+    // open part of the doorway; the door slides towards +x
+    float gapX1 = -doorWidth / 2.0f;
+    float gapX2 = min(doorWidth / 2.0f, gapX1 + view.doorOffset);
+    float dist = eyeZ - roomZ2; // > 0 in front of the doorway
+    Bounds gap = makeBounds(gapX1, 0.0f, roomZ2, gapX2, doorHeight, roomZ2);
+    if (!cameraInRoom && dist <= 0.0f) {
+        portalView = PORTAL_HIDDEN; // beside or behind the room
+    } else if (fabs(dist) < Z_NEAR) {
+        portalView = PORTAL_UNSURE; // the near plane may cut through the front wall
+    } else if (gapX2 - gapX1 < 0.01f || !boundsVisible(gap)) {
+        portalView = PORTAL_HIDDEN;
+    } else {
+        portalView = PORTAL_VISIBLE;
+        float eye[3] = {eyeX, eyeY, eyeZ};
+        float inside[3] = {(gapX1 + gapX2) / 2.0f, doorHeight / 2.0f, roomZ2 - (dist > 0.0f ? 1.0f : -1.0f)};
+        float up[3] = {0.0f, 1.0f, 0.0f}, across[3] = {1.0f, 0.0f, 0.0f};
+        float left[3] = {gapX1, 0.0f, roomZ2}, right[3] = {gapX2, 0.0f, roomZ2};
+        float top[3] = {gapX1, doorHeight, roomZ2};
+        setPortalPlane(portalPlanes[0], eye, left, up, inside);
+        setPortalPlane(portalPlanes[1], eye, right, up, inside);
+        setPortalPlane(portalPlanes[2], eye, left, across, inside);
+        setPortalPlane(portalPlanes[3], eye, top, across, inside);
+        setPlane(portalPlanes[4], 0.0f, 0.0f, dist > 0.0f ? -1.0f : 1.0f, left);
+    }
+    if (portalView != PORTAL_UNSURE) roomQueryVisible = true;
+    if (portalCullingEnabled && !cameraInRoom && portalView == PORTAL_HIDDEN) portalHiddenFrames++;
+}
+
+void solidCube(float size);
+
+// Issued after the room shell is drawn, so only samples seen past the walls
+// count. The box is inset so it never ties with the walls in depth.
+void queryRoomInterior() {
+    if (!portalCullingEnabled || cameraInRoom || portalView != PORTAL_UNSURE || roomQueryPending) return;
+    if (!roomQuery) glGenQueries(1, &roomQuery);
+    float inset = 0.05f;
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    glDepthMask(GL_FALSE);
+    glBeginQuery(GL_SAMPLES_PASSED, roomQuery);
+    glPushMatrix();
+    glTranslatef((roomX1 + roomX2) / 2.0f, roomHeight / 2.0f, (roomZ1 + roomZ2) / 2.0f);
+    glScalef(roomX2 - roomX1 - 2 * inset, roomHeight - 2 * inset, roomZ2 - roomZ1 - 2 * inset);
+    solidCube(1.0f);
+    glPopMatrix();
+    glEndQuery(GL_SAMPLES_PASSED);
+    glDepthMask(GL_TRUE);
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    roomQueryPending = true;
+    roomQueryFrame = portalFrame;
+    roomQueryFrames++;
+}
+
+// whether the doorway hides b, in the interior cell or outdoors
+bool portalHides(const Bounds &b, bool interior) {
+    if (!cullingEnabled || !portalCullingEnabled || interior == cameraInRoom) return false;
+    if (portalView == PORTAL_HIDDEN) return true;
+    if (portalView == PORTAL_VISIBLE) return outsidePlanes(portalPlanes, 5, b);
+    return interior && !roomQueryVisible;
+}
+
+// frustum test plus, for the other cell, the doorway
+bool cellVisible(const Bounds &b, bool interior) {
+    if (!boundsVisible(b)) return false;
+    bool hidden = portalHides(b, interior);
+    if (hidden) cullRejected++;
+    return !hidden;
+}
+
+// shader lighting
+// With GL 3.3 or later, lit geometry goes through a vertex program that
+// evaluates the fixed-function lighting equation per vertex: eye-space
+// lights, infinite viewer, no spot or attenuation terms, colour clamped.
+// Light colours and positions sit in one uniform buffer, written at init;
+// the enabled lights and scene ambient (ceiling light, green mode, ambient
+// level) in a second small one; the current material in a third. The GL
+// state cache writes into these copies instead of calling glLight*/
+// glMaterial*, and the dirty ones are uploaded just before the next draw.
+// The fragment stage adds the clustered practical lights on top, and takes
+// the shadowed part of up to two shadow-mapped lights back out. Instanced
+// draws put a per-instance matrix in front of the modelview; every other
+// draw sees the identity there. The scene's materials are also uploaded once
+// into a table, which batched static geometry indexes per vertex; everything
+// else reads the current material.
+// Unlit drawing (grass, sprites, the lamp's light cone) stays fixed
+// function. On GL 2.1 (macOS), or with --fixed-function, so does the rest
+// and the practical lights are off.
+#ifndef GL_UNIFORM_BUFFER
+#  define GL_UNIFORM_BUFFER 0x8A11
+#endif
+
+typedef GLuint (*GetUniformBlockIndexProc)(GLuint program, const GLchar *name);
+typedef void (*UniformBlockBindingProc)(GLuint program, GLuint index, GLuint binding);
+typedef void (*BindBufferBaseProc)(GLenum target, GLuint index, GLuint buffer);
+
+// froxel grid for the clustered lights: screen tiles by exponential depth
+// slices between Z_NEAR and Z_FAR
+const int CLUSTER_X = 16, CLUSTER_Y = 9, CLUSTER_Z = 24;
+const int CLUSTER_TILES = CLUSTER_X * CLUSTER_Y;
+const int NUM_CLUSTERS = CLUSTER_TILES * CLUSTER_Z;
+const int CLUSTER_TEXTURE_UNIT = 1; // light data, cluster ranges, light indices on units 1..3
+const int SHADOW_TEXTURE_UNIT = 4;
+const int MAX_SHADOW_LIGHTS = 2;    // tiles side by side in the shadow atlas
+const int INSTANCE_ATTRIB = 12;     // per-instance matrix columns in attributes 12..15
+const int MATERIAL_ATTRIB = 11;     // per-vertex material table slot, -1 for the current material
+const int MAX_TABLE_MATERIALS = 64;
+
+// compileShader() puts the version line and the cluster constants in front
+const char* lightingVertexShader =
+    "layout(std140) uniform Lights {\n"
+    "    vec4 lightPosition[8], lightAmbient[8], lightDiffuse[8], lightSpecular[8];\n"
+    "};\n"
+    "layout(std140) uniform LightMode {\n"
+    "    vec4 sceneAmbient;\n"
+    "    vec4 lightEnabled[2];\n"
+    "    vec4 viewportSize;\n"
+    "};\n"
+    "layout(std140) uniform Material {\n"
+    "    vec4 matAmbient, matDiffuse, matSpecular, matEmission;\n"
+    "    float matShininess;\n"
+    "};\n"
+    "struct TableMaterial {\n"
+    "    vec4 ambient, diffuse, specular, emission;\n"
+    "    float shininess;\n"
+    "};\n"
+    "layout(std140) uniform MaterialTable {\n"
+    "    TableMaterial materials[MAX_TABLE_MATERIALS];\n"
+    "};\n"
+    "// a batched draw's table entry, otherwise the current material\n"
+    "TableMaterial material(int slot) {\n"
+    "    if (slot >= 0) return materials[slot];\n"
+    "    return TableMaterial(matAmbient, matDiffuse, matSpecular, matEmission, matShininess);\n"
+    "}\n"
+    "layout(std140) uniform Shadows {\n"
+    "    mat4 eyeToShadow[MAX_SHADOW_LIGHTS];\n"
+    "    vec4 shadowTile[MAX_SHADOW_LIGHTS];\n"
+    "};\n"
+    "layout(location = INSTANCE_ATTRIB) in mat4 instanceTransform;\n"
+    "layout(location = MATERIAL_ATTRIB) in float materialIndex;\n"
+    "out vec4 color;\n"
+    "out vec3 viewPos, viewNormal;\n"
+    "flat out int materialSlot;\n"
+    "out vec4 shadowCoord[MAX_SHADOW_LIGHTS];\n"
+    "out vec3 shadowedColor[MAX_SHADOW_LIGHTS];\n"
+    "// the shadow map light i has, or -1\n"
+    "int shadowSlot(int i) {\n"
+    "    for (int k = 0; k < MAX_SHADOW_LIGHTS; k++)\n"
+    "        if (shadowTile[k].w != 0.0 && int(shadowTile[k].z) == i) return k;\n"
+    "    return -1;\n"
+    "}\n"
+    "void main() {\n"
+    "    vec4 eye = gl_ModelViewMatrix * (instanceTransform * gl_Vertex);\n"
+    "    // cofactors: the inverse transpose up to a scale, which normalize() drops\n"
+    "    vec3 c0 = instanceTransform[0].xyz, c1 = instanceTransform[1].xyz, c2 = instanceTransform[2].xyz;\n"
+    "    vec3 n = normalize(gl_NormalMatrix * (mat3(cross(c1, c2), cross(c2, c0), cross(c0, c1)) * gl_Normal));\n"
+    "    materialSlot = int(materialIndex);\n"
+    "    TableMaterial m = material(materialSlot);\n"
+    "    vec3 c = m.emission.rgb + m.ambient.rgb * sceneAmbient.rgb;\n"
+    "    for (int k = 0; k < MAX_SHADOW_LIGHTS; k++) shadowedColor[k] = vec3(0.0);\n"
+    "    for (int i = 0; i < 8; i++) {\n"
+    "        if (lightEnabled[i / 4][i % 4] == 0.0) continue;\n"
+    "        c += m.ambient.rgb * lightAmbient[i].rgb;\n"
+    "        vec4 p = lightPosition[i];\n"
+    "        vec3 l = normalize(p.w != 0.0 ? p.xyz / p.w - eye.xyz / eye.w : p.xyz);\n"
+    "        float nl = max(dot(n, l), 0.0);\n"
+    "        vec3 lit = nl * m.diffuse.rgb * lightDiffuse[i].rgb;\n"
+    "        if (nl > 0.0) {\n"
+    "            float nh = max(dot(n, normalize(l + vec3(0.0, 0.0, 1.0))), 0.0);\n"
+    "            float s = m.shininess > 0.0 ? pow(nh, m.shininess) : 1.0;\n"
+    "            lit += s * m.specular.rgb * lightSpecular[i].rgb;\n"
+    "        }\n"
+    "        int k = shadowSlot(i);\n"
+    "        if (k >= 0) shadowedColor[k] += lit;\n"
+    "        else c += lit;\n"
+    "    }\n"
+    "    color = vec4(clamp(c, 0.0, 1.0), m.diffuse.a);\n"
+    "    for (int k = 0; k < MAX_SHADOW_LIGHTS; k++) shadowCoord[k] = eyeToShadow[k] * eye;\n"
+    "    viewPos = eye.xyz / eye.w;\n"
+    "    viewNormal = n;\n"
+    "    gl_Position = gl_ProjectionMatrix * eye;\n"
+    "}\n";
+
+// Adds the clustered lights, per fragment, to the fixed-function colour.
+// Each light is three texels: view-space position and radius, colour and
+// cosine of the outer cone, direction and cosine of the inner cone (point
+// lights use cones that always pass). Shadow-mapped lights are lit per
+// vertex like the others but kept out of the vertex colour, and added here
+// scaled by what their map sees. The walls and ceiling are single faces, so
+// a face seen from behind is its own occluder: shadowed-only lights, which
+// have no fixed-function counterpart to match, leave it dark.
+const char* lightingFragmentShader =
+    "layout(std140) uniform Lights {\n"
+    "    vec4 lightPosition[8], lightAmbient[8], lightDiffuse[8], lightSpecular[8];\n"
+    "};\n"
+    "layout(std140) uniform LightMode {\n"
+    "    vec4 sceneAmbient;\n"
+    "    vec4 lightEnabled[2];\n"
+    "    vec4 viewportSize;\n"
+    "};\n"
+    "layout(std140) uniform Material {\n"
+    "    vec4 matAmbient, matDiffuse, matSpecular, matEmission;\n"
+    "    float matShininess;\n"
+    "};\n"
+    "struct TableMaterial {\n"
+    "    vec4 ambient, diffuse, specular, emission;\n"
+    "    float shininess;\n"
+    "};\n"
+    "layout(std140) uniform MaterialTable {\n"
+    "    TableMaterial materials[MAX_TABLE_MATERIALS];\n"
+    "};\n"
+    "// a batched draw's table entry, otherwise the current material\n"
+    "TableMaterial material(int slot) {\n"
+    "    if (slot >= 0) return materials[slot];\n"
+    "    return TableMaterial(matAmbient, matDiffuse, matSpecular, matEmission, matShininess);\n"
+    "}\n"
+    "layout(std140) uniform Shadows {\n"
+    "    mat4 eyeToShadow[MAX_SHADOW_LIGHTS];\n"
+    "    vec4 shadowTile[MAX_SHADOW_LIGHTS];\n"
+    "};\n"
+    "uniform samplerBuffer practicalLights;\n"
+    "uniform usamplerBuffer clusterRanges;\n"
+    "uniform usamplerBuffer clusterIndices;\n"
+    "uniform sampler2DShadow shadowAtlas;\n"
+    "in vec4 color;\n"
+    "in vec3 viewPos, viewNormal;\n"
+    "in vec4 shadowCoord[MAX_SHADOW_LIGHTS];\n"
+    "in vec3 shadowedColor[MAX_SHADOW_LIGHTS];\n"
+    "flat in int materialSlot;\n"
+    "out vec4 fragColor;\n"
+    "// 1 where map k sees the fragment; outside the map counts as lit\n"
+    "float visibility(int k) {\n"
+    "    vec4 p = shadowCoord[k];\n"
+    "    if (p.w <= 0.0) return 1.0;\n"
+    "    vec3 s = p.xyz / p.w;\n"
+    "    if (any(lessThan(s, vec3(0.0))) || any(greaterThan(s, vec3(1.0)))) return 1.0;\n"
+    "    float texel = 0.5 / float(textureSize(shadowAtlas, 0).y);\n"
+    "    s.xy = clamp(s.xy, texel, 1.0 - texel);\n"
+    "    return texture(shadowAtlas, vec3(shadowTile[k].x + s.x * shadowTile[k].y, s.y, s.z));\n"
+    "}\n"
+    "void main() {\n"
+    "    TableMaterial m = material(materialSlot);\n"
+    "    vec3 c = color.rgb;\n"
+    "    vec3 n = normalize(viewNormal);\n"
+    "    vec3 v = normalize(-viewPos);\n"
+    "    bool behind = dot(n, v) < 0.0;\n"
+    "    for (int k = 0; k < MAX_SHADOW_LIGHTS; k++) {\n"
+    "        if (shadowTile[k].w == 0.0 || shadowedColor[k] == vec3(0.0) || (behind && shadowTile[k].w > 1.0)) continue;\n"
+    "        c += visibility(k) * shadowedColor[k];\n"
+    "    }\n"
+    "    float depth = -viewPos.z;\n"
+    "    int slice = clamp(int(log(depth / Z_NEAR) / log(Z_FAR / Z_NEAR) * float(CLUSTER_Z)), 0, CLUSTER_Z - 1);\n"
+    "    ivec2 tile = clamp(ivec2(gl_FragCoord.xy / viewportSize.xy * vec2(CLUSTER_X, CLUSTER_Y)),\n"
+    "                       ivec2(0), ivec2(CLUSTER_X - 1, CLUSTER_Y - 1));\n"
+    "    uvec2 range = texelFetch(clusterRanges, (slice * CLUSTER_Y + tile.y) * CLUSTER_X + tile.x).xy;\n"
+    "    for (uint k = 0u; k < range.y; k++) {\n"
+    "        int li = int(texelFetch(clusterIndices, int(range.x + k)).x) * 3;\n"
+    "        vec4 posRadius = texelFetch(practicalLights, li);\n"
+    "        vec4 colorOuter = texelFetch(practicalLights, li + 1);\n"
+    "        vec4 dirInner = texelFetch(practicalLights, li + 2);\n"
+    "        vec3 l = posRadius.xyz - viewPos;\n"
+    "        float d = length(l);\n"
+    "        if (d >= posRadius.w) continue;\n"
+    "        l /= d;\n"
+    "        float f = 1.0 - d * d / (posRadius.w * posRadius.w);\n"
+    "        float atten = f * f * smoothstep(colorOuter.w, dirInner.w, dot(-l, dirInner.xyz));\n"
+    "        float nl = max(dot(n, l), 0.0);\n"
+    "        vec3 lit = nl * m.diffuse.rgb;\n"
+    "        if (nl > 0.0) lit += pow(max(dot(n, normalize(l + v)), 0.0), max(m.shininess, 1.0)) * m.specular.rgb;\n"
+    "        c += atten * colorOuter.rgb * lit;\n"
+    "    }\n"
+    "    fragColor = vec4(clamp(c, 0.0, 1.0), color.a);\n"
+    "}\n";
+
+// std140 layouts of the blocks above
+struct LightsBlock {
+    GLfloat position[8][4], ambient[8][4], diffuse[8][4], specular[8][4];
+};
+
+struct LightModeBlock {
+    GLfloat ambient[4];
+    GLfloat enabled[8];
+    GLfloat viewport[4]; // width, height
+};
+
+struct MaterialBlock {
+    GLfloat ambient[4], diffuse[4], specular[4], emission[4];
+    GLfloat shininess, pad[3];
+};
+
+struct ShadowBlock {
+    GLfloat eyeToShadow[MAX_SHADOW_LIGHTS][16]; // eye space to the map's [0,1] texture and depth range
+    GLfloat tile[MAX_SHADOW_LIGHTS][4];         // atlas x offset, atlas x scale, light index, active
+                                                // (2 for shadowed-only lights)
+};
+
+struct MaterialTableBlock {
+    MaterialBlock materials[MAX_TABLE_MATERIALS]; // the scene's, by index
+};
+
+enum LightingBlock { BLOCK_LIGHTS, BLOCK_LIGHT_MODE, BLOCK_MATERIAL, BLOCK_SHADOWS, BLOCK_MATERIAL_TABLE, NUM_LIGHTING_BLOCKS };
+const char* lightingBlockNames[NUM_LIGHTING_BLOCKS] = {"Lights", "LightMode", "Material", "Shadows", "MaterialTable"};
+
+bool shaderLightingAllowed = true; // --fixed-function clears it
+bool shaderLighting = false;       // lit draws use lightingProgram
+GLuint lightingProgram = 0;
+GLuint lightingUBO[NUM_LIGHTING_BLOCKS];
+bool lightingDirty[NUM_LIGHTING_BLOCKS];
+long lightingUploads = 0;
+LightsBlock lightsBlock;
+LightModeBlock lightModeBlock;
+MaterialBlock materialBlock;
+ShadowBlock shadowBlock;
+MaterialTableBlock materialTableBlock;
+
+GLuint compileShader(GLenum type, const char *source) {
+    char prelude[320];
+    snprintf(prelude, sizeof(prelude),
+             "#version 330 compatibility\n#define CLUSTER_X %d\n#define CLUSTER_Y %d\n#define CLUSTER_Z %d\n"
+             "#define Z_NEAR %.1f\n#define Z_FAR %.1f\n#define MAX_SHADOW_LIGHTS %d\n#define INSTANCE_ATTRIB %d\n"
+             "#define MATERIAL_ATTRIB %d\n#define MAX_TABLE_MATERIALS %d\n",
+             CLUSTER_X, CLUSTER_Y, CLUSTER_Z, Z_NEAR, Z_FAR, MAX_SHADOW_LIGHTS, INSTANCE_ATTRIB,
+             MATERIAL_ATTRIB, MAX_TABLE_MATERIALS);
+    const char* sources[] = {prelude, source};
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 2, sources, NULL);
+    glCompileShader(shader);
+    GLint ok = 0;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+    if (!ok) {
+        char log[1024];
+        glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+        cerr << "warning: lighting shader: " << log << "\n";
+        glDeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
+
+// GL's defaults, which is what fixed function starts from
+void resetLightingBlocks() {
+    const GLfloat black[4] = {0.0f, 0.0f, 0.0f, 1.0f}, white[4] = {1.0f, 1.0f, 1.0f, 1.0f};
+    const GLfloat grey[4] = {0.2f, 0.2f, 0.2f, 1.0f}, lightGrey[4] = {0.8f, 0.8f, 0.8f, 1.0f};
+    const GLfloat towardViewer[4] = {0.0f, 0.0f, 1.0f, 0.0f};
+    for (int i = 0; i < 8; i++) {
+        memcpy(lightsBlock.position[i], towardViewer, sizeof(towardViewer));
+        memcpy(lightsBlock.ambient[i], black, sizeof(black));
+        memcpy(lightsBlock.diffuse[i], i == 0 ? white : black, sizeof(white));
+        memcpy(lightsBlock.specular[i], i == 0 ? white : black, sizeof(white));
+        lightModeBlock.enabled[i] = 0.0f;
+    }
+    memcpy(lightModeBlock.ambient, grey, sizeof(grey));
+    lightModeBlock.viewport[0] = lightModeBlock.viewport[1] = 1.0f;
+    memset(&materialBlock, 0, sizeof(materialBlock));
+    memcpy(materialBlock.ambient, grey, sizeof(grey));
+    memcpy(materialBlock.diffuse, lightGrey, sizeof(lightGrey));
+    memcpy(materialBlock.specular, black, sizeof(black));
+    memcpy(materialBlock.emission, black, sizeof(black));
+    memset(&shadowBlock, 0, sizeof(shadowBlock));
+    for (int b = 0; b < NUM_LIGHTING_BLOCKS; b++) lightingDirty[b] = true;
+}
+
+// false leaves fixed-function lighting in charge
+bool initShaderLighting() {
+    shaderLighting = false;
+    const char* ver = (const char*)glGetString(GL_VERSION);
+    if (!shaderLightingAllowed || !ver || atof(ver) < 3.3) return false;
+    GetUniformBlockIndexProc getUniformBlockIndex = (GetUniformBlockIndexProc)glProc("glGetUniformBlockIndex");
+    UniformBlockBindingProc uniformBlockBinding = (UniformBlockBindingProc)glProc("glUniformBlockBinding");
+    BindBufferBaseProc bindBufferBase = (BindBufferBaseProc)glProc("glBindBufferBase");
+    if (!getUniformBlockIndex || !uniformBlockBinding || !bindBufferBase) return false;
+
+    GLuint vs = compileShader(GL_VERTEX_SHADER, lightingVertexShader);
+    GLuint fs = compileShader(GL_FRAGMENT_SHADER, lightingFragmentShader);
+    if (!vs || !fs) return false;
+    lightingProgram = glCreateProgram();
+    glAttachShader(lightingProgram, vs);
+    glAttachShader(lightingProgram, fs);
+    glLinkProgram(lightingProgram);
+    glDeleteShader(vs);
+    glDeleteShader(fs);
+    GLint ok = 0;
+    glGetProgramiv(lightingProgram, GL_LINK_STATUS, &ok);
+    if (!ok) {
+        cerr << "warning: lighting shader did not link, using fixed-function lighting\n";
+        glDeleteProgram(lightingProgram);
+        lightingProgram = 0;
+        return false;
+    }
+
+    const GLsizeiptr sizes[NUM_LIGHTING_BLOCKS] = {sizeof(LightsBlock), sizeof(LightModeBlock), sizeof(MaterialBlock),
+                                                   sizeof(ShadowBlock), sizeof(MaterialTableBlock)};
+    glGenBuffers(NUM_LIGHTING_BLOCKS, lightingUBO);
+    for (int b = 0; b < NUM_LIGHTING_BLOCKS; b++) {
+        uniformBlockBinding(lightingProgram, getUniformBlockIndex(lightingProgram, lightingBlockNames[b]), b);
+        glBindBuffer(GL_UNIFORM_BUFFER, lightingUBO[b]);
+        glBufferData(GL_UNIFORM_BUFFER, sizes[b], NULL, GL_DYNAMIC_DRAW);
+        bindBufferBase(GL_UNIFORM_BUFFER, b, lightingUBO[b]);
+    }
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    const char* samplers[] = {"practicalLights", "clusterRanges", "clusterIndices"};
+    glUseProgram(lightingProgram);
+    for (int i = 0; i < 3; i++)
+        glUniform1i(glGetUniformLocation(lightingProgram, samplers[i]), CLUSTER_TEXTURE_UNIT + i);
+    glUniform1i(glGetUniformLocation(lightingProgram, "shadowAtlas"), SHADOW_TEXTURE_UNIT);
+    glUseProgram(0);
+    glVertexAttrib1f(MATERIAL_ATTRIB, -1.0f); // unbatched draws read the current material
+    resetLightingBlocks();
+    // fixed-function lighting stays off; GL_LIGHTING now means the program
+    glDisable(GL_LIGHTING);
+    shaderLighting = true;
+    return true;
+}
+
+// positions are taken as eye space, like glLightfv under an identity modelview
+void shaderLight(int index, GLenum pname, const GLfloat *v) {
+    GLfloat *dst = pname == GL_POSITION ? lightsBlock.position[index] : pname == GL_AMBIENT ? lightsBlock.ambient[index] :
+                   pname == GL_DIFFUSE ? lightsBlock.diffuse[index] : pname == GL_SPECULAR ? lightsBlock.specular[index] : NULL;
+    if (!dst) return;
+    memcpy(dst, v, 4 * sizeof(GLfloat));
+    lightingDirty[BLOCK_LIGHTS] = true;
+}
+
+void shaderLightEnabled(int index, bool on) {
+    lightModeBlock.enabled[index] = on ? 1.0f : 0.0f;
+    lightingDirty[BLOCK_LIGHT_MODE] = true;
+}
+
+void shaderViewport(int width, int height) {
+    lightModeBlock.viewport[0] = width;
+    lightModeBlock.viewport[1] = height;
+    lightingDirty[BLOCK_LIGHT_MODE] = true;
+}
+
+void shaderLightModelAmbient(const GLfloat *v) {
+    memcpy(lightModeBlock.ambient, v, 4 * sizeof(GLfloat));
+    lightingDirty[BLOCK_LIGHT_MODE] = true;
+}
+
+void shaderMaterial(GLenum pname, const GLfloat *v) {
+    MaterialBlock &m = materialBlock;
+    if (pname == GL_AMBIENT || pname == GL_AMBIENT_AND_DIFFUSE) memcpy(m.ambient, v, 4 * sizeof(GLfloat));
+    if (pname == GL_DIFFUSE || pname == GL_AMBIENT_AND_DIFFUSE) memcpy(m.diffuse, v, 4 * sizeof(GLfloat));
+    if (pname == GL_SPECULAR) memcpy(m.specular, v, 4 * sizeof(GLfloat));
+    if (pname == GL_EMISSION) memcpy(m.emission, v, 4 * sizeof(GLfloat));
+    if (pname == GL_SHININESS) m.shininess = v[0];
+    lightingDirty[BLOCK_MATERIAL] = true;
+}
+
+// upload whatever changed since the last draw
+void flushShaderLighting() {
+    if (!shaderLighting) return;
+    const void *blocks[NUM_LIGHTING_BLOCKS] = {&lightsBlock, &lightModeBlock, &materialBlock, &shadowBlock,
+                                               &materialTableBlock};
+    const GLsizeiptr sizes[NUM_LIGHTING_BLOCKS] = {sizeof(LightsBlock), sizeof(LightModeBlock), sizeof(MaterialBlock),
+                                                   sizeof(ShadowBlock), sizeof(MaterialTableBlock)};
+    bool uploaded = false;
+    for (int b = 0; b < NUM_LIGHTING_BLOCKS; b++) {
+        if (!lightingDirty[b]) continue;
+        glBindBuffer(GL_UNIFORM_BUFFER, lightingUBO[b]);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizes[b], blocks[b]);
+        lightingDirty[b] = false;
+        lightingUploads++;
+        uploaded = true;
+    }
+    if (uploaded) glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+// static geometry cache
+// Everything that never moves is uploaded once into a single vertex/index
+// buffer pair and drawn by index range. Vertex layout: x,y,z, nx,ny,nz, s,t.
+struct MeshRange {
+    GLuint first;   // first index in staticIBO
+    GLsizei count;  // number of indices
+    Bounds bounds;  // object space
+};
+
+vector<GLfloat> staticVerts;
+vector<GLuint> staticIndices;
+GLuint staticVBO = 0, staticIBO = 0;
+const GLsizei STATIC_STRIDE = 8 * sizeof(GLfloat);
+
+MeshRange grassMesh, floorMesh, ceilingMesh;
+MeshRange backWallMesh, leftWallMesh, rightWallMesh, frontWallMesh;
+MeshRange switchMesh, doorMesh, tableMesh;
+
+void addStaticVertex(float x, float y, float z, float nx, float ny, float nz, float s = 0.0f, float t = 0.0f) {
+    GLfloat v[] = {x, y, z, nx, ny, nz, s, t};
+    staticVerts.insert(staticVerts.end(), v, v + 8);
+}
+
+// quad given in the same winding the old glBegin(GL_QUADS) code used
+void addStaticQuad(const float p[4][3], float nx, float ny, float nz, const float uv[4][2] = NULL) {
+    GLuint base = staticVerts.size() / 8;
+    for (int i = 0; i < 4; i++) {
+        addStaticVertex(p[i][0], p[i][1], p[i][2], nx, ny, nz,
+                        uv ? uv[i][0] : 0.0f, uv ? uv[i][1] : 0.0f);
+    }
+    GLuint idx[] = {base, base + 1, base + 2, base, base + 2, base + 3};
+    staticIndices.insert(staticIndices.end(), idx, idx + 6);
+}
+
+// axis-aligned box, same faces and normals as a scaled solidCube(1.0f)
+void addStaticBox(float cx, float cy, float cz, float sx, float sy, float sz) {
+    float x1 = cx - sx / 2, x2 = cx + sx / 2;
+    float y1 = cy - sy / 2, y2 = cy + sy / 2;
+    float z1 = cz - sz / 2, z2 = cz + sz / 2;
+    const float px[4][3] = {{x2,y1,z1}, {x2,y2,z1}, {x2,y2,z2}, {x2,y1,z2}};
+    const float nx[4][3] = {{x1,y1,z2}, {x1,y2,z2}, {x1,y2,z1}, {x1,y1,z1}};
+    const float py[4][3] = {{x1,y2,z1}, {x1,y2,z2}, {x2,y2,z2}, {x2,y2,z1}};
+    const float ny[4][3] = {{x1,y1,z2}, {x1,y1,z1}, {x2,y1,z1}, {x2,y1,z2}};
+    const float pz[4][3] = {{x1,y1,z2}, {x2,y1,z2}, {x2,y2,z2}, {x1,y2,z2}};
+    const float nz[4][3] = {{x2,y1,z1}, {x1,y1,z1}, {x1,y2,z1}, {x2,y2,z1}};
+    addStaticQuad(px, 1, 0, 0);
+    addStaticQuad(nx, -1, 0, 0);
+    addStaticQuad(py, 0, 1, 0);
+    addStaticQuad(ny, 0, -1, 0);
+    addStaticQuad(pz, 0, 0, 1);
+    addStaticQuad(nz, 0, 0, -1);
+}
+
+MeshRange beginStaticMesh() {
+    MeshRange r = {(GLuint)staticIndices.size(), 0, makeBounds(0, 0, 0, 0, 0, 0)};
+    return r;
+}
+
+void endStaticMesh(MeshRange &r) {
+    r.count = staticIndices.size() - r.first;
+    for (GLsizei i = 0; i < r.count; i++) {
+        const GLfloat *v = &staticVerts[staticIndices[r.first + i] * 8];
+        Bounds p = makeBounds(v[0], v[1], v[2], v[0], v[1], v[2]);
+        r.bounds = i ? unionBounds(r.bounds, p) : p;
+    }
+}
+
+void buildStaticGeometry() {
+    // grass plane
+    grassMesh = beginStaticMesh();
+    const float grass[4][3] = {{-50, 0, -50}, {50, 0, -50}, {50, 0, 50}, {-50, 0, 50}};
+    const float grassUV[4][2] = {{0, 0}, {5, 0}, {5, 5}, {0, 5}};
+    addStaticQuad(grass, 0, 1, 0, grassUV);
+    endStaticMesh(grassMesh);
+
+    // room
+    float w = 10.0f, h = roomHeight, d = 10.0f;
+    float x1 = -w / 2, x2 = w / 2;
+    float y1 = 0.01f, y2 = h;
+    float z1 = -d / 2 - 5, z2 = d / 2 - 5;
+    float doorW = doorWidth, doorH = doorHeight;
+    float doorL = x1 + (w - doorW) / 2.0f, doorR = x2 - (w - doorW) / 2.0f;
+
+    floorMesh = beginStaticMesh();
+    const float floorQ[4][3] = {{x1,y1,z1}, {x2,y1,z1}, {x2,y1,z2}, {x1,y1,z2}};
+    addStaticQuad(floorQ, 0, 1, 0);
+    endStaticMesh(floorMesh);
+
+    ceilingMesh = beginStaticMesh();
+    const float ceilingQ[4][3] = {{x1,y2,z1}, {x1,y2,z2}, {x2,y2,z2}, {x2,y2,z1}};
+    addStaticQuad(ceilingQ, 0, 1, 0);
+    endStaticMesh(ceilingMesh);
+
+    backWallMesh = beginStaticMesh();
+    const float backQ[4][3] = {{x1,y1,z1}, {x1,y2,z1}, {x2,y2,z1}, {x2,y1,z1}};
+    addStaticQuad(backQ, 0, 0, 1);
+    endStaticMesh(backWallMesh);
+
+    leftWallMesh = beginStaticMesh();
+    const float leftQ[4][3] = {{x1,y1,z1}, {x1,y1,z2}, {x1,y2,z2}, {x1,y2,z1}};
+    addStaticQuad(leftQ, 1, 0, 0);
+    endStaticMesh(leftWallMesh);
+
+    rightWallMesh = beginStaticMesh();
+    const float rightQ[4][3] = {{x2,y1,z2}, {x2,y1,z1}, {x2,y2,z1}, {x2,y2,z2}};
+    addStaticQuad(rightQ, -1, 0, 0);
+    endStaticMesh(rightWallMesh);
+
+    frontWallMesh = beginStaticMesh();
+    const float frontLeftQ[4][3]  = {{x1,y1,z2}, {doorL,y1,z2}, {doorL,y2,z2}, {x1,y2,z2}};
+    const float frontRightQ[4][3] = {{x2,y1,z2}, {doorR,y1,z2}, {doorR,y2,z2}, {x2,y2,z2}};
+    const float aboveDoorQ[4][3]  = {{doorL,doorH,z2}, {doorR,doorH,z2}, {doorR,y2,z2}, {doorL,y2,z2}};
+    addStaticQuad(frontLeftQ, 0, 0, -1);
+    addStaticQuad(frontRightQ, 0, 0, -1);
+    addStaticQuad(aboveDoorQ, 0, 0, -1);
+    endStaticMesh(frontWallMesh);
+
+    // light switch
+    switchMesh = beginStaticMesh();
+    addStaticBox(-1.8f, 2.0f, -0.1f, 0.2f, 0.4f, 0.05f);
+    endStaticMesh(switchMesh);
+
+    // sliding door, built closed and moved by doorOffset at draw time
+    doorMesh = beginStaticMesh();
+    const float doorQ[4][3] = {{-doorW/2.0f,y1,z2}, {doorW/2.0f,y1,z2}, {doorW/2.0f,doorH,z2}, {-doorW/2.0f,doorH,z2}};
+    addStaticQuad(doorQ, 0, 0, -1);
+    endStaticMesh(doorMesh);
+
+    // table top and legs, in the table's local space
+    tableMesh = beginStaticMesh();
+    addStaticBox(0.0f, 2.5f, -5.0f, 4.0f, 0.2f, 3.0f);
+    float legX[] = {-1.8f, 1.8f};
+    float legZ[] = {-1.3f, 1.3f};
+    for (int i = 0; i < 2; i++)
+        for (int j = 0; j < 2; j++)
+            addStaticBox(legX[i], 1.25f, -5.0f + legZ[j], 0.2f, 2.5f, 0.2f);
+    endStaticMesh(tableMesh);
+
+    glGenBuffers(1, &staticVBO);
+    glBindBuffer(GL_ARRAY_BUFFER, staticVBO);
+    glBufferData(GL_ARRAY_BUFFER, staticVerts.size() * sizeof(GLfloat), &staticVerts[0], GL_STATIC_DRAW);
+    glGenBuffers(1, &staticIBO);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, staticIBO);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, staticIndices.size() * sizeof(GLuint), &staticIndices[0], GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+// The shapes below use client-side arrays, so the buffers must be unbound
+// (endStaticDraw) before drawing any of them.
+void beginStaticDraw() {
+    glBindBuffer(GL_ARRAY_BUFFER, staticVBO);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, staticIBO);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    glVertexPointer(3, GL_FLOAT, STATIC_STRIDE, (const GLvoid*)0);
+    glNormalPointer(GL_FLOAT, STATIC_STRIDE, (const GLvoid*)(3 * sizeof(GLfloat)));
+    glTexCoordPointer(2, GL_FLOAT, STATIC_STRIDE, (const GLvoid*)(6 * sizeof(GLfloat)));
+}
+
+void drawStaticMesh(const MeshRange &r) {
+    flushShaderLighting();
+    glDrawElements(GL_TRIANGLES, r.count, GL_UNSIGNED_INT, (const GLvoid*)(r.first * sizeof(GLuint)));
+}
+
+void endStaticDraw() {
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+// GL state cache
+// Shadow copy of the material, light-model and enable state the draw code
+// touches. Calls that would not change anything are dropped and counted.
+struct MaterialState {
+    bool valid;
+    GLfloat v[4];
+};
+
+MaterialState matAmbient, matDiffuse, matSpecular, matEmission, matShininess;
+MaterialState lightModelAmbient;
+
+const GLenum trackedCaps[] = {
+    GL_LIGHTING, GL_LIGHT0, GL_LIGHT1, GL_LIGHT2, GL_LIGHT3, GL_LIGHT4, GL_LIGHT5,
+    GL_LIGHT6, GL_LIGHT7, GL_TEXTURE_2D, GL_BLEND, GL_DEPTH_TEST, GL_NORMALIZE,
+    GL_POINT_SPRITE, GL_ALPHA_TEST
+};
+const int NUM_TRACKED_CAPS = sizeof(trackedCaps) / sizeof(trackedCaps[0]);
+signed char capState[NUM_TRACKED_CAPS]; // -1 unknown, 0 off, 1 on
+
+long stateCallsIssued = 0;
+long stateCallsElided = 0;
+
+void invalidateStateCache() {
+    matAmbient.valid = matDiffuse.valid = matSpecular.valid = false;
+    matEmission.valid = matShininess.valid = false;
+    lightModelAmbient.valid = false;
+    for (int i = 0; i < NUM_TRACKED_CAPS; i++) capState[i] = -1;
+}
+
+// true if the cached value already equals v; otherwise stores v
+bool stateMatches(MaterialState &st, const GLfloat *v, int n) {
+    if (st.valid && memcmp(st.v, v, n * sizeof(GLfloat)) == 0) {
+        stateCallsElided++;
+        return true;
+    }
+    memcpy(st.v, v, n * sizeof(GLfloat));
+    st.valid = true;
+    stateCallsIssued++;
+    return false;
+}
+
+// all materials in this scene are GL_FRONT_AND_BACK
+void issueMaterial(GLenum pname, const GLfloat *v) {
+    if (shaderLighting) shaderMaterial(pname, v);
+    else glMaterialfv(GL_FRONT_AND_BACK, pname, v);
+}
+
+void stateMaterial(GLenum pname, const GLfloat *v) {
+    switch (pname) {
+    case GL_AMBIENT:
+        if (!stateMatches(matAmbient, v, 4)) issueMaterial(pname, v);
+        break;
+    case GL_DIFFUSE:
+        if (!stateMatches(matDiffuse, v, 4)) issueMaterial(pname, v);
+        break;
+    case GL_AMBIENT_AND_DIFFUSE: {
+        bool sameAmbient = matAmbient.valid && memcmp(matAmbient.v, v, sizeof(matAmbient.v)) == 0;
+        if (sameAmbient) {
+            if (!stateMatches(matDiffuse, v, 4)) issueMaterial(GL_DIFFUSE, v);
+        } else {
+            stateMatches(matAmbient, v, 4);
+            memcpy(matDiffuse.v, v, sizeof(matDiffuse.v));
+            matDiffuse.valid = true;
+            issueMaterial(pname, v);
+        }
+        break;
+    }
+    case GL_SPECULAR:
+        if (!stateMatches(matSpecular, v, 4)) issueMaterial(pname, v);
+        break;
+    case GL_EMISSION:
+        if (!stateMatches(matEmission, v, 4)) issueMaterial(pname, v);
+        break;
+    case GL_SHININESS:
+        if (!stateMatches(matShininess, v, 1)) issueMaterial(pname, v);
+        break;
+    default:
+        stateCallsIssued++;
+        issueMaterial(pname, v);
+    }
+}
+
+void stateMaterialf(GLenum pname, GLfloat value) {
+    stateMaterial(pname, &value);
+}
+
+void stateLightModelAmbient(const GLfloat *v) {
+    if (stateMatches(lightModelAmbient, v, 4)) return;
+    if (shaderLighting) shaderLightModelAmbient(v);
+    else glLightModelfv(GL_LIGHT_MODEL_AMBIENT, v);
+}
+
+// not cached: lights are only set up at init
+void stateLight(GLenum light, GLenum pname, const GLfloat *v) {
+    stateCallsIssued++;
+    if (shaderLighting) shaderLight(light - GL_LIGHT0, pname, v);
+    else glLightfv(light, pname, v);
+}
+
+void stateSetEnabled(GLenum cap, bool on) {
+    for (int i = 0; i < NUM_TRACKED_CAPS; i++) {
+        if (trackedCaps[i] != cap) continue;
+        if (capState[i] == (on ? 1 : 0)) {
+            stateCallsElided++;
+            return;
+        }
+        capState[i] = on ? 1 : 0;
+        break;
+    }
+    stateCallsIssued++;
+    if (shaderLighting && cap == GL_LIGHTING) glUseProgram(on ? lightingProgram : 0);
+    else if (shaderLighting && cap >= GL_LIGHT0 && cap <= GL_LIGHT7) shaderLightEnabled(cap - GL_LIGHT0, on);
+    else if (on) glEnable(cap);
+    else glDisable(cap);
+}
+
+// as far as the cache knows; unknown counts as off
+bool stateIsEnabled(GLenum cap) {
+    for (int i = 0; i < NUM_TRACKED_CAPS; i++)
+        if (trackedCaps[i] == cap) return capState[i] == 1;
+    return false;
+}
+
+void stateEnable(GLenum cap) { stateSetEnabled(cap, true); }
+void stateDisable(GLenum cap) { stateSetEnabled(cap, false); }
+
+// scene files
+// The scene is one little-endian binary file of materials, lights and nodes
+// that is mapped read-only and used in place. Every offset, index and float
+// is checked once at load, after which the draw code reads the mapping
+// directly. The binary is converted from a line-based text file (see
+// Scenes/oz.txt for the syntax), by --convert-scene or automatically at
+// startup when the text is newer or the binary is from another version.
+// Besides what is drawn it holds the animation tracks and the clips that
+// keys play.
+const uint32_t SCENE_MAGIC = 0x43535a4f; // "OZSC"
+const uint32_t SCENE_VERSION = 3;
+
+struct SceneHeader {
+    uint32_t magic, version, fileSize;
+    uint32_t materialCount, materialOffset;
+    uint32_t lightCount, lightOffset;
+    uint32_t nodeCount, nodeOffset;
+    uint32_t trackCount, trackOffset;
+    uint32_t keyframeCount, keyframeOffset;
+    uint32_t clipCount, clipOffset;
+    uint32_t stringSize, stringOffset;
+};
+
+struct SceneMaterial {
+    float ambient[4], diffuse[4], specular[4], emission[4];
+    float shininess;
+};
+
+struct SceneLight {
+    uint32_t index; // GL_LIGHT0 + index
+    uint32_t enabled;
+    uint32_t flags; // SceneLightFlag
+    float position[4], ambient[4], diffuse[4], specular[4];
+};
+
+enum SceneLightFlag {
+    LIGHT_WORLD = 1,          // position is in world space, not eye space
+    LIGHT_SHADOWS = 2,        // shadow mapped (GLSL path); implies LIGHT_WORLD
+    LIGHT_SHADOWED_ONLY = 4,  // left off where there are no shadow maps
+    LIGHT_FLAG_MASK = 7
+};
+
+enum SceneNodeKind { NODE_MESH, NODE_SPHERE, NODE_CUBE, NODE_TEAPOT, NODE_PROP, NODE_BOX, NODE_KIND_COUNT };
+
+enum SceneNodeFlag {
+    NODE_INTERIOR = 1,  // in the room, seen from outdoors only through the door
+    NODE_EXTERIOR = 2,  // outdoors, seen from the room only through the door
+    NODE_COLLIDER = 4,
+    NODE_UNLIT = 8,     // lighting off, drawn in the material's diffuse colour
+    NODE_TEXTURED = 16, // grass texture
+    NODE_GREEN = 32,    // green ambient in green mode
+    NODE_DOOR = 64,     // slides with doorOffset
+    NODE_BROOM = 128,   // rises with broomOffsetY
+    NODE_CASTER = 256,  // drawn into the shadow maps
+    NODE_FLAG_MASK = 511
+};
+
+struct SceneNode {
+    uint32_t name;      // offset into the string table
+    uint32_t kind;
+    uint32_t mesh;      // static mesh (NODE_MESH) or prop (NODE_PROP)
+    int32_t material;   // -1: a prop that sets its own materials
+    uint32_t flags;
+    uint32_t phase;     // ProfPhase
+    float params[3];    // sphere radius, slices, stacks; cube or teapot size
+    float translate[3];
+    float rotate[4];    // angle in degrees, axis
+    float scale;
+    float boundsLo[3], boundsHi[3]; // object space; lo > hi means the static mesh's
+};
+
+enum Easing { EASE_LINEAR, EASE_STEP, EASE_IN, EASE_OUT, EASE_IN_OUT, EASING_COUNT };
+
+struct SceneKeyframe {
+    float time;       // seconds from the start of the track; the first key is at 0
+    float value;
+    uint32_t easing;  // Easing from this key to the next
+};
+
+// the values a track can drive
+enum AnimChannel { CHANNEL_DOOR, CHANNEL_HEEL, CHANNEL_BROOM, CHANNEL_COUNT };
+
+enum TrackFlag {
+    TRACK_LOOP = 1,   // starts over after the last key instead of holding it
+    TRACK_FLAG_MASK = 1
+};
+
+struct SceneTrack {
+    uint32_t name;    // offset into the string table
+    uint32_t channel; // AnimChannel
+    uint32_t flags;   // TrackFlag
+    uint32_t firstKey, keyCount;
+};
+
+enum ClipMode {
+    CLIP_RESTART,       // from the first key
+    CLIP_FROM_CURRENT,  // the first segment starts where the channel is
+    CLIP_WHEN_IDLE,     // ignored while one of its channels is playing
+    CLIP_TOGGLE,        // stops its tracks if they are playing, else from-current
+    CLIP_MODE_COUNT
+};
+
+const int MAX_CLIP_TRACKS = 4;
+
+// tracks played together when a key is pressed, each on its own channel
+struct SceneClip {
+    uint32_t key;     // keyboard() key
+    uint32_t mode;    // ClipMode
+    uint32_t trackCount;
+    uint32_t tracks[MAX_CLIP_TRACKS];
+};
+
+enum SceneProp { PROP_SLIPPERS, PROP_LAMP, PROP_BROOM, PROP_FIXTURE, PROP_BUBBLES, PROP_COUNT };
+
+const char* scenePropNames[PROP_COUNT] = {"slippers", "lamp", "broom", "fixture", "bubbles"};
+const char* nodeKindNames[NODE_KIND_COUNT] = {"mesh", "sphere", "cube", "teapot", "prop", "box"};
+const char* nodeFlagNames[] = {"interior", "exterior", "collider", "unlit", "textured", "green", "door", "broom", "caster"};
+const char* lightFlagNames[] = {"world", "shadows", "shadowed-only"};
+const char* easingNames[EASING_COUNT] = {"linear", "step", "ease-in", "ease-out", "ease-in-out"};
+const char* animChannelNames[CHANNEL_COUNT] = {"door", "heel", "broom"};
+const char* clipModeNames[CLIP_MODE_COUNT] = {"restart", "from-current", "when-idle", "toggle"};
+const int NUM_NODE_FLAGS = sizeof(nodeFlagNames) / sizeof(nodeFlagNames[0]);
+const char* staticMeshNames[] = {
+    "grass", "floor", "ceiling", "backWall", "leftWall", "rightWall", "frontWall", "switch", "door", "table"
+};
+MeshRange* const staticMeshes[] = {
+    &grassMesh, &floorMesh, &ceilingMesh, &backWallMesh, &leftWallMesh, &rightWallMesh,
+    &frontWallMesh, &switchMesh, &doorMesh, &tableMesh
+};
+const int NUM_STATIC_MESHES = sizeof(staticMeshes) / sizeof(staticMeshes[0]);
+
+struct Scene {
+    string path;
+    MappedFile file;
+    const SceneHeader *header = NULL;
+    const SceneMaterial *materials = NULL;
+    const SceneLight *lights = NULL;
+    const SceneNode *nodes = NULL;
+    const SceneTrack *tracks = NULL;
+    const SceneKeyframe *keyframes = NULL;
+    const SceneClip *clips = NULL;
+    const char *strings = NULL;
+    vector<Bounds> bounds;  // world space, door shut and broom grounded
+    vector<int> colliders;  // collider id per node, -1 if none
+};
+
+Scene scene;
+string scenePath = "Scenes/oz.txt";
+double sceneConvertMs = 0.0, sceneLoadMs = 0.0;
+
+int findName(const char* const names[], int count, const string &name) {
+    for (int i = 0; i < count; i++)
+        if (name == names[i]) return i;
+    return -1;
+}
+
+bool allFinite(const float *v, int n) {
+    for (int i = 0; i < n; i++)
+        if (!isfinite(v[i])) return false;
+    return true;
+}
+
+// table of count elements at offset lies inside the file and is aligned
+bool tableInFile(uint32_t offset, uint32_t count, size_t elemSize, size_t fileSize) {
+    return offset % 4 == 0 && (uint64_t)offset + (uint64_t)count * elemSize <= fileSize;
+}
+
+// NULL if the mapped file is a well-formed scene, otherwise what is wrong
+const char* validateScene(const unsigned char *data, size_t size) {
+    if (size < sizeof(SceneHeader)) return "truncated header";
+    const SceneHeader *h = (const SceneHeader*)data;
+    if (h->magic != SCENE_MAGIC) return "not a scene file";
+    if (h->version != SCENE_VERSION) return "unsupported version";
+    if (h->fileSize != size) return "size does not match the header";
+    if (!tableInFile(h->materialOffset, h->materialCount, sizeof(SceneMaterial), size) ||
+        !tableInFile(h->lightOffset, h->lightCount, sizeof(SceneLight), size) ||
+        !tableInFile(h->nodeOffset, h->nodeCount, sizeof(SceneNode), size) ||
+        !tableInFile(h->trackOffset, h->trackCount, sizeof(SceneTrack), size) ||
+        !tableInFile(h->keyframeOffset, h->keyframeCount, sizeof(SceneKeyframe), size) ||
+        !tableInFile(h->clipOffset, h->clipCount, sizeof(SceneClip), size) ||
+        !tableInFile(h->stringOffset, h->stringSize, 1, size))
+        return "table outside the file";
+    const char *strings = (const char*)data + h->stringOffset;
+    if (h->stringSize == 0 || strings[h->stringSize - 1] != '\0') return "unterminated string table";
+
+    const SceneMaterial *materials = (const SceneMaterial*)(data + h->materialOffset);
+    for (uint32_t i = 0; i < h->materialCount; i++) {
+        const SceneMaterial &m = materials[i];
+        // ambient through emission
+        if (!allFinite(m.ambient, 16) || !(m.shininess >= 0.0f && m.shininess <= 128.0f))
+            return "bad material";
+    }
+    const SceneLight *lights = (const SceneLight*)(data + h->lightOffset);
+    for (uint32_t i = 0; i < h->lightCount; i++) {
+        const SceneLight &l = lights[i];
+        // position through specular
+        if (l.index >= 8 || l.enabled > 1 || (l.flags & ~LIGHT_FLAG_MASK) || !allFinite(l.position, 16))
+            return "bad light";
+    }
+    const SceneNode *nodes = (const SceneNode*)(data + h->nodeOffset);
+    for (uint32_t i = 0; i < h->nodeCount; i++) {
+        const SceneNode &n = nodes[i];
+        if (n.name >= h->stringSize || n.kind >= NODE_KIND_COUNT || n.phase >= PROF_COUNT ||
+            (n.flags & ~NODE_FLAG_MASK))
+            return "bad node";
+        if (n.kind == NODE_MESH ? n.mesh >= (uint32_t)NUM_STATIC_MESHES
+                                : n.kind == NODE_PROP && n.mesh >= PROP_COUNT)
+            return "node mesh out of range";
+        if (n.material < -1 || n.material >= (int32_t)h->materialCount ||
+            (n.material < 0 && n.kind != NODE_PROP && n.kind != NODE_BOX))
+            return "node material out of range";
+        // params through boundsHi
+        if (!allFinite(n.params, 17) || n.scale <= 0.0f) return "bad node transform";
+        if (n.kind == NODE_SPHERE && !(n.params[0] > 0.0f && n.params[1] >= 3.0f && n.params[2] >= 2.0f))
+            return "bad sphere";
+        if ((n.kind == NODE_CUBE || n.kind == NODE_TEAPOT) && !(n.params[0] > 0.0f)) return "bad shape size";
+    }
+    const SceneTrack *tracks = (const SceneTrack*)(data + h->trackOffset);
+    const SceneKeyframe *keyframes = (const SceneKeyframe*)(data + h->keyframeOffset);
+    for (uint32_t i = 0; i < h->trackCount; i++) {
+        const SceneTrack &t = tracks[i];
+        if (t.name >= h->stringSize || t.channel >= CHANNEL_COUNT || (t.flags & ~TRACK_FLAG_MASK) ||
+            t.keyCount == 0 || (uint64_t)t.firstKey + t.keyCount > h->keyframeCount ||
+            ((t.flags & TRACK_LOOP) && t.keyCount < 2))
+            return "bad track";
+        const SceneKeyframe *keys = keyframes + t.firstKey;
+        for (uint32_t k = 0; k < t.keyCount; k++) {
+            // times start at 0 and strictly increase
+            if (!allFinite(&keys[k].time, 2) || keys[k].easing >= EASING_COUNT ||
+                (k == 0 ? keys[k].time != 0.0f : !(keys[k].time > keys[k - 1].time)))
+                return "bad keyframe";
+        }
+    }
+    const SceneClip *clips = (const SceneClip*)(data + h->clipOffset);
+    for (uint32_t i = 0; i < h->clipCount; i++) {
+        const SceneClip &c = clips[i];
+        if (c.key > 255 || c.mode >= CLIP_MODE_COUNT || c.trackCount == 0 || c.trackCount > MAX_CLIP_TRACKS)
+            return "bad clip";
+        for (uint32_t k = 0; k < c.trackCount; k++)
+            if (c.tracks[k] >= h->trackCount) return "clip track out of range";
+    }
+    return NULL;
+}
+
+void closeScene() {
+    unmapFile(scene.file);
+    scene = Scene();
+}
+
+bool loadScene(const string &path) {
+    closeScene();
+    MappedFile file;
+    if (!mapFile(path, file)) {
+        cerr << "error: cannot map scene " << path << "\n";
+        return false;
+    }
+    const char *problem = validateScene(file.data, file.size);
+    if (problem) {
+        unmapFile(file);
+        cerr << "error: " << path << ": " << problem << "\n";
+        return false;
+    }
+    const unsigned char *bytes = file.data;
+    scene.path = path;
+    scene.file = file;
+    scene.header = (const SceneHeader*)bytes;
+    scene.materials = (const SceneMaterial*)(bytes + scene.header->materialOffset);
+    scene.lights = (const SceneLight*)(bytes + scene.header->lightOffset);
+    scene.nodes = (const SceneNode*)(bytes + scene.header->nodeOffset);
+    scene.tracks = (const SceneTrack*)(bytes + scene.header->trackOffset);
+    scene.keyframes = (const SceneKeyframe*)(bytes + scene.header->keyframeOffset);
+    scene.clips = (const SceneClip*)(bytes + scene.header->clipOffset);
+    scene.strings = (const char*)bytes + scene.header->stringOffset;
+    return true;
+}
+
+// read n numbers from the rest of a text line
+bool readFloats(istringstream &in, float *v, int n) {
+    for (int i = 0; i < n; i++)
+        if (!(in >> v[i])) return false;
+    return true;
+}
+
+// append a table to the file image at the next 4-byte boundary
+template <typename T>
+uint32_t appendTable(vector<unsigned char> &image, const vector<T> &table) {
+    image.resize((image.size() + 3) & ~(size_t)3);
+    uint32_t offset = image.size();
+    const unsigned char *p = (const unsigned char*)table.data();
+    image.insert(image.end(), p, p + table.size() * sizeof(T));
+    return offset;
+}
+
+bool convertScene(const string &inPath, const string &outPath) {
+    ifstream in(inPath.c_str());
+    if (!in) {
+        cerr << "error: cannot read " << inPath << "\n";
+        return false;
+    }
+    vector<SceneMaterial> materials;
+    vector<SceneLight> lights;
+    vector<SceneNode> nodes;
+    vector<SceneTrack> tracks;
+    vector<SceneKeyframe> keyframes;
+    vector<SceneClip> clips;
+    vector<char> strings(1, '\0');
+    vector<string> materialNames, trackNames;
+    string line;
+    int lineNo = 0;
+    while (getline(in, line)) {
+        lineNo++;
+        line = line.substr(0, line.find('#'));
+        istringstream words(line);
+        string type, name, key;
+        if (!(words >> type)) continue;
+        string error;
+        if (type == "material" && words >> name) {
+            // GL's default material
+            SceneMaterial m = {{0.2f, 0.2f, 0.2f, 1.0f}, {0.8f, 0.8f, 0.8f, 1.0f},
+                               {0.0f, 0.0f, 0.0f, 1.0f}, {0.0f, 0.0f, 0.0f, 1.0f}, 0.0f};
+            while (error.empty() && words >> key) {
+                float *v = key == "ambient" ? m.ambient : key == "diffuse" ? m.diffuse :
+                           key == "specular" ? m.specular : key == "emission" ? m.emission :
+                           key == "shininess" ? &m.shininess : NULL;
+                if (!v) error = "unknown material property " + key;
+                else if (!readFloats(words, v, v == &m.shininess ? 1 : 4)) error = "bad " + key;
+            }
+            materials.push_back(m);
+            materialNames.push_back(name);
+        }
+        else if (type == "light") {
+            // GL's defaults: only light 0 is white
+            SceneLight l = {0, 1, 0, {0.0f, 0.0f, 1.0f, 0.0f}, {0.0f, 0.0f, 0.0f, 1.0f},
+                            {0.0f, 0.0f, 0.0f, 1.0f}, {0.0f, 0.0f, 0.0f, 1.0f}};
+            if (!(words >> l.index) || l.index >= 8) error = "light index must be 0..7";
+            for (int i = 0; i < 3 && l.index == 0; i++) l.diffuse[i] = l.specular[i] = 1.0f;
+            while (error.empty() && words >> key) {
+                float *v = key == "position" ? l.position : key == "ambient" ? l.ambient :
+                           key == "diffuse" ? l.diffuse : key == "specular" ? l.specular : NULL;
+                int flag = findName(lightFlagNames, 3, key);
+                if (flag >= 0) l.flags |= 1u << flag;
+                else if (key == "enabled") {
+                    if (!(words >> l.enabled) || l.enabled > 1) error = "enabled must be 0 or 1";
+                }
+                else if (!v) error = "unknown light property " + key;
+                else if (!readFloats(words, v, 4)) error = "bad " + key;
+            }
+            if (l.flags & LIGHT_SHADOWS) l.flags |= LIGHT_WORLD;
+            lights.push_back(l);
+        }
+        else if (type == "node" && words >> name) {
+            SceneNode n;
+            memset(&n, 0, sizeof(n));
+            n.name = strings.size();
+            strings.insert(strings.end(), name.c_str(), name.c_str() + name.size() + 1);
+            n.kind = NODE_KIND_COUNT;
+            n.material = -1;
+            n.phase = PROF_COUNT;
+            n.scale = 1.0f;
+            bool hasBounds = false;
+            while (error.empty() && words >> key) {
+                int flag = findName(nodeFlagNames, NUM_NODE_FLAGS, key);
+                int kind = findName(nodeKindNames, NODE_KIND_COUNT, key);
+                string value;
+                if (flag >= 0) n.flags |= 1u << flag;
+                else if (kind >= 0) {
+                    n.kind = kind;
+                    if (kind == NODE_MESH || kind == NODE_PROP) {
+                        int mesh = words >> value ? (kind == NODE_MESH ? findName(staticMeshNames, NUM_STATIC_MESHES, value)
+                                                                       : findName(scenePropNames, PROP_COUNT, value)) : -1;
+                        if (mesh < 0) error = "unknown " + key + " " + value;
+                        n.mesh = mesh;
+                    }
+                    else if (kind != NODE_BOX && !readFloats(words, n.params, kind == NODE_SPHERE ? 3 : 1))
+                        error = "bad " + key;
+                }
+                else if (key == "material") {
+                    words >> value;
+                    n.material = find(materialNames.begin(), materialNames.end(), value) - materialNames.begin();
+                    if (n.material == (int32_t)materialNames.size()) error = "unknown material " + value;
+                }
+                else if (key == "phase") {
+                    words >> value;
+                    n.phase = findName(profPhaseNames, PROF_COUNT, value);
+                    if (n.phase == (uint32_t)-1) error = "unknown phase " + value;
+                }
+                else if (key == "translate") { if (!readFloats(words, n.translate, 3)) error = "bad translate"; }
+                else if (key == "rotate") { if (!readFloats(words, n.rotate, 4)) error = "bad rotate"; }
+                else if (key == "scale") { if (!readFloats(words, &n.scale, 1) || n.scale <= 0.0f) error = "bad scale"; }
+                else if (key == "bounds") {
+                    hasBounds = readFloats(words, n.boundsLo, 3) && readFloats(words, n.boundsHi, 3);
+                    if (!hasBounds) error = "bad bounds";
+                }
+                else error = "unknown node property " + key;
+            }
+            if (error.empty()) {
+                if (n.kind == NODE_KIND_COUNT) error = "node needs a shape";
+                else if (n.phase == PROF_COUNT) error = "node needs a phase";
+                else if (n.material < 0 && n.kind != NODE_PROP && n.kind != NODE_BOX) error = "node needs a material";
+            }
+            if (error.empty() && !hasBounds) {
+                float r = n.kind == NODE_SPHERE ? n.params[0] : n.kind == NODE_CUBE ? n.params[0] / 2 : -1.0f;
+                if (n.kind == NODE_MESH) r = -1.0f; // resolved from the mesh once it is built
+                else if (r < 0.0f) error = "node needs bounds";
+                for (int i = 0; i < 3; i++) {
+                    n.boundsLo[i] = n.kind == NODE_MESH ? 1.0f : -r;
+                    n.boundsHi[i] = n.kind == NODE_MESH ? -1.0f : r;
+                }
+            }
+            nodes.push_back(n);
+        }
+        else if (type == "track" && words >> name) {
+            SceneTrack t = {(uint32_t)strings.size(), CHANNEL_COUNT, 0, (uint32_t)keyframes.size(), 0};
+            strings.insert(strings.end(), name.c_str(), name.c_str() + name.size() + 1);
+            string value;
+            if (words >> value) t.channel = findName(animChannelNames, CHANNEL_COUNT, value);
+            if (t.channel >= CHANNEL_COUNT) error = "unknown channel " + value;
+            while (error.empty() && words >> key) {
+                int easing = findName(easingNames, EASING_COUNT, key);
+                if (key == "loop") t.flags |= TRACK_LOOP;
+                else if (key == "key") {
+                    SceneKeyframe k = {0.0f, 0.0f, EASE_LINEAR};
+                    if (!readFloats(words, &k.time, 2)) error = "bad key";
+                    else if (t.keyCount == 0 ? k.time != 0.0f : !(k.time > keyframes.back().time))
+                        error = "key times must start at 0 and increase";
+                    keyframes.push_back(k);
+                    t.keyCount++;
+                }
+                // applies to the key before it
+                else if (easing >= 0 && t.keyCount > 0) keyframes.back().easing = easing;
+                else error = "unknown track property " + key;
+            }
+            if (error.empty() && t.keyCount == 0) error = "track needs keys";
+            if (error.empty() && (t.flags & TRACK_LOOP) && t.keyCount < 2) error = "a looping track needs two keys";
+            tracks.push_back(t);
+            trackNames.push_back(name);
+        }
+        else if (type == "clip" && words >> name) {
+            SceneClip c;
+            memset(&c, 0, sizeof(c));
+            c.key = (unsigned char)name[0];
+            if (name.size() != 1) error = "clip key must be one character";
+            while (error.empty() && words >> key) {
+                int mode = findName(clipModeNames, CLIP_MODE_COUNT, key);
+                uint32_t track = find(trackNames.begin(), trackNames.end(), key) - trackNames.begin();
+                if (mode >= 0) c.mode = mode;
+                else if (track == trackNames.size()) error = "unknown track " + key;
+                else if (c.trackCount == (uint32_t)MAX_CLIP_TRACKS) error = "too many tracks in clip";
+                else c.tracks[c.trackCount++] = track;
+            }
+            if (error.empty() && c.trackCount == 0) error = "clip needs a track";
+            clips.push_back(c);
+        }
+        else error = "expected material, light, node, track or clip";
+        if (!error.empty()) {
+            cerr << inPath << ":" << lineNo << ": " << error << "\n";
+            return false;
+        }
+    }
+
+    vector<unsigned char> image(sizeof(SceneHeader));
+    SceneHeader h;
+    h.magic = SCENE_MAGIC;
+    h.version = SCENE_VERSION;
+    h.materialCount = materials.size();
+    h.materialOffset = appendTable(image, materials);
+    h.lightCount = lights.size();
+    h.lightOffset = appendTable(image, lights);
+    h.nodeCount = nodes.size();
+    h.nodeOffset = appendTable(image, nodes);
+    h.trackCount = tracks.size();
+    h.trackOffset = appendTable(image, tracks);
+    h.keyframeCount = keyframes.size();
+    h.keyframeOffset = appendTable(image, keyframes);
+    h.clipCount = clips.size();
+    h.clipOffset = appendTable(image, clips);
+    h.stringSize = strings.size();
+    h.stringOffset = appendTable(image, strings);
+    h.fileSize = image.size();
+    memcpy(&image[0], &h, sizeof(h));
+
+    if (!writeFileAtomically(outPath, &image[0], image.size())) {
+        cerr << "error: cannot write " << outPath << "\n";
+        return false;
+    }
+    return true;
+}
+
+// whether the binary at path would load, so a stale format is rebuilt
+bool sceneBinaryValid(const string &path) {
+    MappedFile file;
+    if (!mapFile(path, file)) return false;
+    bool valid = validateScene(file.data, file.size) == NULL;
+    unmapFile(file);
+    return valid;
+}
+
+// Load a .ozb, or for a .txt the .ozb beside it, converting first when the
+// binary is missing, older than the text or from another format version.
+bool openScene(const string &path) {
+    string binPath = path;
+    size_t ext = path.rfind(".txt");
+    if (ext != string::npos && ext + 4 == path.size()) {
+        binPath = path.substr(0, ext) + ".ozb";
+        struct stat text, bin;
+        bool haveText = stat(path.c_str(), &text) == 0;
+        bool haveBin = stat(binPath.c_str(), &bin) == 0;
+        if (haveText && (!haveBin || bin.st_mtime < text.st_mtime || !sceneBinaryValid(binPath))) {
+            chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+            if (!convertScene(path, binPath)) return false;
+            sceneConvertMs = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+        }
+    }
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    if (!loadScene(binPath)) return false;
+    sceneLoadMs = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+    return true;
+}
+
+// a point in the node's object space to world space
+void transformPoint(const SceneNode &n, const float p[3], float out[3]) {
+    float a = n.rotate[0] * M_PI / 180.0f;
+    float len = sqrt(n.rotate[1] * n.rotate[1] + n.rotate[2] * n.rotate[2] + n.rotate[3] * n.rotate[3]);
+    float x = len > 0.0f ? n.rotate[1] / len : 1.0f, y = len > 0.0f ? n.rotate[2] / len : 0.0f;
+    float z = len > 0.0f ? n.rotate[3] / len : 0.0f, c = cos(a), s = sin(a), t = 1.0f - c;
+    // glRotatef's matrix
+    float r[3][3] = {{t * x * x + c, t * x * y - s * z, t * x * z + s * y},
+                     {t * x * y + s * z, t * y * y + c, t * y * z - s * x},
+                     {t * x * z - s * y, t * y * z + s * x, t * z * z + c}};
+    for (int i = 0; i < 3; i++)
+        out[i] = n.translate[i] + (r[i][0] * p[0] + r[i][1] * p[1] + r[i][2] * p[2]) * n.scale;
+}
+
+// world-space box around the 8 transformed corners
+Bounds transformBounds(const SceneNode &n, const Bounds &b) {
+    Bounds out;
+    for (int corner = 0; corner < 8; corner++) {
+        float p[3], q[3];
+        for (int i = 0; i < 3; i++) p[i] = corner >> i & 1 ? b.hi[i] : b.lo[i];
+        transformPoint(n, p, q);
+        Bounds qb = makeBounds(q[0], q[1], q[2], q[0], q[1], q[2]);
+        out = corner ? unionBounds(out, qb) : qb;
+    }
+    return out;
+}
+
+// after buildStaticGeometry(), which supplies the mesh bounds
+void placeSceneNodes() {
+    const SceneHeader &h = *scene.header;
+    scene.bounds.resize(h.nodeCount);
+    scene.colliders.assign(h.nodeCount, -1);
+    for (uint32_t i = 0; i < h.nodeCount; i++) {
+        const SceneNode &n = scene.nodes[i];
+        Bounds local = makeBounds(n.boundsLo[0], n.boundsLo[1], n.boundsLo[2],
+                                  n.boundsHi[0], n.boundsHi[1], n.boundsHi[2]);
+        if (n.kind == NODE_MESH && local.lo[0] > local.hi[0]) local = staticMeshes[n.mesh]->bounds;
+        scene.bounds[i] = transformBounds(n, local);
+    }
+}
+
+// world bounds with the door and broom at the given positions
+Bounds sceneNodeBounds(int i, float door, float broomLift) {
+    const SceneNode &n = scene.nodes[i];
+    return placeBounds(scene.bounds[i], n.flags & NODE_DOOR ? door : 0.0f,
+                       n.flags & NODE_BROOM ? broomLift : 0.0f, 0.0f, 1.0f);
+}
+
+bool shadowMapsAvailable = false; // set by initShadowMaps()
+
+// eye-space positions are given as they are, so call with an identity
+// modelview; world-space ones are placed by positionWorldLights()
+void applySceneLights() {
+    for (uint32_t i = 0; i < scene.header->lightCount; i++) {
+        const SceneLight &l = scene.lights[i];
+        GLenum light = GL_LIGHT0 + l.index;
+        stateLight(light, GL_POSITION, l.position);
+        stateLight(light, GL_AMBIENT, l.ambient);
+        stateLight(light, GL_DIFFUSE, l.diffuse);
+        stateLight(light, GL_SPECULAR, l.specular);
+        stateSetEnabled(light, l.enabled && (shadowMapsAvailable || !(l.flags & LIGHT_SHADOWED_ONLY)));
+    }
+}
+
+// each frame, with the camera's view on the modelview stack
+void positionWorldLights() {
+    for (uint32_t i = 0; i < scene.header->lightCount; i++) {
+        const SceneLight &l = scene.lights[i];
+        if (!(l.flags & LIGHT_WORLD)) continue;
+        // glLightfv applies the modelview itself; the shader copies are eye space
+        GLfloat eye[4];
+        if (shaderLighting) mat4Apply(cameraView, l.position, eye);
+        else memcpy(eye, l.position, sizeof(eye));
+        stateLight(GL_LIGHT0 + l.index, GL_POSITION, eye);
+    }
+}
+
+// SIMD helpers
+// Four-wide float ops on SSE or NEON, with a scalar fallback.
+#if defined(__SSE__) || defined(_M_X64)
+typedef __m128 f4;
+inline f4 f4_load(const float *p) { return _mm_loadu_ps(p); }
+inline void f4_store(float *p, f4 v) { _mm_storeu_ps(p, v); }
+inline f4 f4_set1(float v) { return _mm_set1_ps(v); }
+inline f4 f4_add(f4 a, f4 b) { return _mm_add_ps(a, b); }
+inline f4 f4_sub(f4 a, f4 b) { return _mm_sub_ps(a, b); }
+inline f4 f4_mul(f4 a, f4 b) { return _mm_mul_ps(a, b); }
+inline f4 f4_min(f4 a, f4 b) { return _mm_min_ps(a, b); }
+inline f4 f4_max(f4 a, f4 b) { return _mm_max_ps(a, b); }
+// bit i set when lane i has a <= b
+inline int f4_mask_le(f4 a, f4 b) { return _mm_movemask_ps(_mm_cmple_ps(a, b)); }
+// per lane: a > b ? x : y
+inline f4 f4_select_gt(f4 a, f4 b, f4 x, f4 y) {
+    f4 m = _mm_cmpgt_ps(a, b);
+    return _mm_or_ps(_mm_and_ps(m, x), _mm_andnot_ps(m, y));
+}
+#elif defined(__ARM_NEON)
+typedef float32x4_t f4;
+inline f4 f4_load(const float *p) { return vld1q_f32(p); }
+inline void f4_store(float *p, f4 v) { vst1q_f32(p, v); }
+inline f4 f4_set1(float v) { return vdupq_n_f32(v); }
+inline f4 f4_add(f4 a, f4 b) { return vaddq_f32(a, b); }
+inline f4 f4_sub(f4 a, f4 b) { return vsubq_f32(a, b); }
+inline f4 f4_mul(f4 a, f4 b) { return vmulq_f32(a, b); }
+inline f4 f4_min(f4 a, f4 b) { return vminq_f32(a, b); }
+inline f4 f4_max(f4 a, f4 b) { return vmaxq_f32(a, b); }
+inline int f4_mask_le(f4 a, f4 b) {
+    const uint32_t bits[4] = {1, 2, 4, 8};
+    return vaddvq_u32(vandq_u32(vcleq_f32(a, b), vld1q_u32(bits)));
+}
+inline f4 f4_select_gt(f4 a, f4 b, f4 x, f4 y) { return vbslq_f32(vcgtq_f32(a, b), x, y); }
+#else
+struct f4 { float v[4]; };
+inline f4 f4_load(const float *p) { f4 r; memcpy(r.v, p, sizeof(r.v)); return r; }
+inline void f4_store(float *p, f4 v) { memcpy(p, v.v, sizeof(v.v)); }
+inline f4 f4_set1(float v) { f4 r = {{v, v, v, v}}; return r; }
+inline f4 f4_add(f4 a, f4 b) { for (int i = 0; i < 4; i++) a.v[i] += b.v[i]; return a; }
+inline f4 f4_sub(f4 a, f4 b) { for (int i = 0; i < 4; i++) a.v[i] -= b.v[i]; return a; }
+inline f4 f4_mul(f4 a, f4 b) { for (int i = 0; i < 4; i++) a.v[i] *= b.v[i]; return a; }
+inline f4 f4_min(f4 a, f4 b) { for (int i = 0; i < 4; i++) a.v[i] = min(a.v[i], b.v[i]); return a; }
+inline f4 f4_max(f4 a, f4 b) { for (int i = 0; i < 4; i++) a.v[i] = max(a.v[i], b.v[i]); return a; }
+inline int f4_mask_le(f4 a, f4 b) {
+    int m = 0;
+    for (int i = 0; i < 4; i++) m |= (a.v[i] <= b.v[i]) << i;
+    return m;
+}
+inline f4 f4_select_gt(f4 a, f4 b, f4 x, f4 y) {
+    for (int i = 0; i < 4; i++) x.v[i] = a.v[i] > b.v[i] ? x.v[i] : y.v[i];
+    return x;
+}
+#endif
+
+// transform hierarchy
+// Every drawn thing has a local matrix relative to its parent and a cached
+// world matrix: per scene copy a room root, under it the scene nodes, under
+// the props their parts (shoes, heels, lamp arms, broom stick, ...). Nodes
+// are stored parents first, so one pass in order brings every world matrix
+// up to date. Only locals that changed are marked dirty; a pass recomputes
+// those and everything below them, four floats at a time, and the draw code
+// multiplies the finished world matrix onto the camera.
+struct Transform {
+    int parent; // -1 for a root; always before the node itself
+    float local[16];
+    float world[16];
+};
+
+vector<Transform> transforms;
+vector<uint8_t> transformDirty;   // local changed since the last pass
+vector<uint32_t> transformPass;   // pass that last recomputed the world matrix
+uint32_t transformPasses = 0;
+vector<int> itemTransforms; // each scene node's, copy by copy
+int transformCopies = 0;    // scene copies the hierarchy was built for
+long transformsRecomputed = 0, transformPassesRun = 0; // stats
+
+void mat4Identity(float m[16]) {
+    for (int i = 0; i < 16; i++) m[i] = i % 5 == 0 ? 1.0f : 0.0f;
+}
+
+// the glTranslatef, glRotatef and glScalef matrices, applied the way they
+// apply to the current matrix: m = m * op
+void mat4Translate(float m[16], float x, float y, float z) {
+    for (int row = 0; row < 4; row++) m[12 + row] += m[row] * x + m[4 + row] * y + m[8 + row] * z;
+}
+
+void mat4Scale(float m[16], float x, float y, float z) {
+    for (int row = 0; row < 4; row++) {
+        m[row] *= x;
+        m[4 + row] *= y;
+        m[8 + row] *= z;
+    }
+}
+
+void mat4Rotate(float m[16], float angle, float x, float y, float z) {
+    float len = sqrt(x * x + y * y + z * z);
+    x /= len; y /= len; z /= len;
+    float a = angle * M_PI / 180.0f, c = cos(a), s = sin(a), t = 1.0f - c;
+    float r[16] = {x * x * t + c,     y * x * t + z * s, x * z * t - y * s, 0.0f,
+                   x * y * t - z * s, y * y * t + c,     y * z * t + x * s, 0.0f,
+                   x * z * t + y * s, y * z * t - x * s, z * z * t + c,     0.0f,
+                   0.0f,              0.0f,              0.0f,              1.0f};
+    mat4Mul(m, r, m);
+}
+
+// mat4Mul with a's columns in registers; out must not alias a or b
+inline void mat4MulSimd(const float a[16], const float b[16], float out[16]) {
+    f4 c0 = f4_load(a), c1 = f4_load(a + 4), c2 = f4_load(a + 8), c3 = f4_load(a + 12);
+    for (int col = 0; col < 4; col++) {
+        const float *bc = b + col * 4;
+        f4 lo = f4_add(f4_mul(c0, f4_set1(bc[0])), f4_mul(c1, f4_set1(bc[1])));
+        f4 hi = f4_add(f4_mul(c2, f4_set1(bc[2])), f4_mul(c3, f4_set1(bc[3])));
+        f4_store(out + col * 4, f4_add(lo, hi));
+    }
+}
+
+int addTransform(int parent, const float local[16]) {
+    Transform t;
+    t.parent = parent;
+    memcpy(t.local, local, sizeof(t.local));
+    memcpy(t.world, local, sizeof(t.world));
+    transforms.push_back(t);
+    transformDirty.push_back(1);
+    transformPass.push_back(0);
+    return transforms.size() - 1;
+}
+
+void clearTransforms() {
+    transforms.clear();
+    transformDirty.clear();
+    transformPass.clear();
+}
+
+// marks the node dirty only when the matrix actually changed
+void setLocalTransform(int id, const float local[16]) {
+    Transform &t = transforms[id];
+    if (memcmp(t.local, local, sizeof(t.local)) == 0) return;
+    memcpy(t.local, local, sizeof(t.local));
+    transformDirty[id] = 1;
+}
+
+// recompute the dirty subtrees; returns how many world matrices changed
+int updateTransforms() {
+    uint32_t pass = ++transformPasses;
+    int recomputed = 0;
+    for (size_t i = 0; i < transforms.size(); i++) {
+        Transform &t = transforms[i];
+        bool parentMoved = t.parent >= 0 && transformPass[t.parent] == pass;
+        if (!transformDirty[i] && !parentMoved) continue;
+        if (t.parent >= 0) mat4MulSimd(transforms[t.parent].world, t.local, t.world);
+        else memcpy(t.world, t.local, sizeof(t.world));
+        transformDirty[i] = 0;
+        transformPass[i] = pass;
+        recomputed++;
+    }
+    transformsRecomputed += recomputed;
+    transformPassesRun++;
+    return recomputed;
+}
+
+// every world matrix, one scalar multiply each; the benchmark's baseline
+void updateTransformsScalar() {
+    for (size_t i = 0; i < transforms.size(); i++) {
+        Transform &t = transforms[i];
+        if (t.parent >= 0) mat4Mul(transforms[t.parent].world, t.local, t.world);
+        else memcpy(t.world, t.local, sizeof(t.world));
+        transformDirty[i] = 0;
+    }
+}
+
+// what glTranslatef, glRotatef and glScalef used to build for the node,
+// door and broom offsets included
+void nodeTransform(const SceneNode &n, const float offset[3], float m[16]) {
+    float r[9] = {1, 0, 0, 0, 1, 0, 0, 0, 1}; // row-major rotation
+    if (n.rotate[0] != 0.0f) {
+        float x = n.rotate[1], y = n.rotate[2], z = n.rotate[3];
+        float len = sqrt(x * x + y * y + z * z);
+        x /= len; y /= len; z /= len;
+        float a = n.rotate[0] * M_PI / 180.0f, c = cos(a), s = sin(a), t = 1.0f - c;
+        float g[9] = {x * x * t + c,     x * y * t - z * s, x * z * t + y * s,
+                      y * x * t + z * s, y * y * t + c,     y * z * t - x * s,
+                      x * z * t - y * s, y * z * t + x * s, z * z * t + c};
+        memcpy(r, g, sizeof(r));
+    }
+    for (int col = 0; col < 3; col++) {
+        for (int row = 0; row < 3; row++) m[col * 4 + row] = r[row * 3 + col] * n.scale;
+        m[col * 4 + 3] = 0.0f;
+    }
+    m[12] = n.translate[0] + offset[0] + (n.flags & NODE_DOOR ? view.doorOffset : 0.0f);
+    m[13] = n.translate[1] + offset[1] + (n.flags & NODE_BROOM ? view.broomOffsetY : 0.0f);
+    m[14] = n.translate[2] + offset[2];
+    m[15] = 1.0f;
+}
+
+// draw under a node's world matrix; glPopMatrix() when done
+void pushTransform(int id) {
+    glPushMatrix();
+    glMultMatrixf(transforms[id].world);
+}
+
+// keyframe animation
+// Tracks of keyframes, each easing into the next, and the clips that play
+// them when a key is pressed come from the scene file. A channel plays one
+// track at a time. Its current segment is kept in structure-of-arrays form
+// so every channel is evaluated four at a time with the same few multiplies;
+// only a channel whose segment has just ended takes the scalar path that
+// moves on to the next key. The scene's channels drive the door, heel and
+// broom offsets, so a new animated prop is a track and a clip in the scene.
+
+// e(u) = ((a u + b) u + c) u for u in [0, 1]
+const float easingCurves[EASING_COUNT][3] = {
+    {0.0f, 0.0f, 1.0f},   // linear
+    {0.0f, 0.0f, 0.0f},   // step: the key's value until the next key
+    {0.0f, 1.0f, 0.0f},   // ease-in: u^2
+    {0.0f, -1.0f, 2.0f},  // ease-out: 2u - u^2
+    {-2.0f, 3.0f, 0.0f},  // ease-in-out: 3u^2 - 2u^3
+};
+
+float* const animChannelTargets[CHANNEL_COUNT] = {&doorOffset, &heelOffset, &broomOffsetY};
+
+struct Animator {
+    const SceneTrack *tracks = NULL;
+    const SceneKeyframe *keys = NULL;
+    int channels = 0;
+    // Per channel, padded to a multiple of 4: value is from + delta * e(u),
+    // u = (now - start) * rate, until end. Idle channels end at infinity
+    // and have delta 0.
+    vector<float> start, end, rate, from, delta, curveA, curveB, curveC, value;
+    vector<int> track, key;  // track playing and its segment's first key; -1 when idle
+    vector<float> origin;    // when the track's first key falls
+    long segmentsEntered = 0;
+};
+
+Animator sceneAnimator;
+
+void holdChannel(Animator &a, int c, float v) {
+    a.track[c] = a.key[c] = -1;
+    a.start[c] = a.rate[c] = a.delta[c] = 0.0f;
+    a.curveA[c] = a.curveB[c] = a.curveC[c] = 0.0f;
+    a.end[c] = INFINITY;
+    a.from[c] = a.value[c] = v;
+}
+
+void initAnimator(Animator &a, int channels, const SceneTrack *tracks, const SceneKeyframe *keys) {
+    a.tracks = tracks;
+    a.keys = keys;
+    a.channels = channels;
+    int padded = (channels + 3) & ~3;
+    vector<float>* arrays[] = {&a.start, &a.end, &a.rate, &a.from, &a.delta,
+                               &a.curveA, &a.curveB, &a.curveC, &a.value, &a.origin};
+    for (int i = 0; i < 10; i++) arrays[i]->assign(padded, 0.0f);
+    a.track.assign(padded, -1);
+    a.key.assign(padded, -1);
+    for (int c = 0; c < padded; c++) holdChannel(a, c, 0.0f);
+    a.segmentsEntered = 0;
+}
+
+// the segment from key k of the channel's track to the next
+void setSegment(Animator &a, int c, int k) {
+    const SceneKeyframe *keys = a.keys + a.tracks[a.track[c]].firstKey;
+    const float *curve = easingCurves[keys[k].easing];
+    a.key[c] = k;
+    a.start[c] = a.origin[c] + keys[k].time;
+    a.end[c] = a.origin[c] + keys[k + 1].time;
+    a.rate[c] = 1.0f / (keys[k + 1].time - keys[k].time);
+    a.from[c] = keys[k].value;
+    a.delta[c] = keys[k + 1].value - keys[k].value;
+    a.curveA[c] = curve[0];
+    a.curveB[c] = curve[1];
+    a.curveC[c] = curve[2];
+    a.segmentsEntered++;
+}
+
+// past the end of the channel's segment: on to the segment now falls in,
+// round again for a looping track, or idle on the last key
+void advanceChannel(Animator &a, int c, float now) {
+    const SceneTrack &t = a.tracks[a.track[c]];
+    const SceneKeyframe *keys = a.keys + t.firstKey;
+    int last = t.keyCount - 1, k = a.key[c];
+    while (a.origin[c] + keys[k + 1].time <= now) {
+        if (++k < last) continue;
+        if (!(t.flags & TRACK_LOOP)) {
+            holdChannel(a, c, keys[last].value);
+            return;
+        }
+        // skips whole loops at once after a long gap
+        a.origin[c] += keys[last].time * floorf((now - a.origin[c]) / keys[last].time);
+        k = 0;
+    }
+    setSegment(a, c, k);
+}
+
+// Plays a track on channel c from now. fromCurrent starts the first segment
+// at the channel's value, shortened to the part of it that is left.
+void playTrack(Animator &a, int c, int track, float now, bool fromCurrent) {
+    const SceneTrack &t = a.tracks[track];
+    const SceneKeyframe *keys = a.keys + t.firstKey;
+    if (t.keyCount < 2) {
+        holdChannel(a, c, keys[0].value);
+        return;
+    }
+    float current = a.value[c];
+    a.track[c] = track;
+    a.origin[c] = now;
+    setSegment(a, c, 0);
+    if (!fromCurrent) return;
+    float span = keys[1].value - keys[0].value;
+    float left = span != 0.0f ? min(1.0f, max(0.0f, (keys[1].value - current) / span)) : 1.0f;
+    a.origin[c] = now - keys[1].time * (1.0f - left);
+    a.start[c] = now;
+    a.end[c] = a.origin[c] + keys[1].time;
+    a.rate[c] = left > 0.0f ? 1.0f / (keys[1].time * left) : 0.0f;
+    a.from[c] = current;
+    a.delta[c] = keys[1].value - current;
+}
+
+// every channel at time now, four at a time
+void evaluateAnimator(Animator &a, float now) {
+    f4 t = f4_set1(now), zero = f4_set1(0.0f), one = f4_set1(1.0f);
+    for (int c = 0; c < a.channels; c += 4) {
+        if (int ended = f4_mask_le(f4_load(&a.end[c]), t)) {
+            for (int i = 0; i < 4; i++)
+                if (ended >> i & 1) advanceChannel(a, c + i, now);
+        }
+        f4 u = f4_mul(f4_sub(t, f4_load(&a.start[c])), f4_load(&a.rate[c]));
+        u = f4_min(f4_max(u, zero), one);
+        f4 e = f4_add(f4_mul(f4_load(&a.curveA[c]), u), f4_load(&a.curveB[c]));
+        e = f4_mul(f4_add(f4_mul(e, u), f4_load(&a.curveC[c])), u);
+        f4_store(&a.value[c], f4_add(f4_load(&a.from[c]), f4_mul(f4_load(&a.delta[c]), e)));
+    }
+}
+
+// the same one channel at a time, for --bench-animation to compare against
+void evaluateAnimatorScalar(Animator &a, float now) {
+    for (int c = 0; c < a.channels; c++) {
+        if (a.end[c] <= now) advanceChannel(a, c, now);
+        float u = min(1.0f, max(0.0f, (now - a.start[c]) * a.rate[c]));
+        float e = ((a.curveA[c] * u + a.curveB[c]) * u + a.curveC[c]) * u;
+        a.value[c] = a.from[c] + a.delta[c] * e;
+    }
+}
+
+// all channels idle at 0, the pose init() starts from
+void initSceneAnimation() {
+    initAnimator(sceneAnimator, CHANNEL_COUNT, scene.tracks, scene.keyframes);
+}
+
+void applySceneAnimation() {
+    for (int c = 0; c < CHANNEL_COUNT; c++) *animChannelTargets[c] = sceneAnimator.value[c];
+}
+
+// the scene's clips for a keyboard() key, started at the current tick
+void playClips(unsigned char key) {
+    Animator &a = sceneAnimator;
+    for (uint32_t i = 0; i < scene.header->clipCount; i++) {
+        const SceneClip &clip = scene.clips[i];
+        if (clip.key != key) continue;
+        bool anyPlaying = false, allPlaying = true;
+        for (uint32_t k = 0; k < clip.trackCount; k++) {
+            int c = scene.tracks[clip.tracks[k]].channel;
+            anyPlaying |= a.track[c] >= 0;
+            allPlaying &= a.track[c] == (int)clip.tracks[k];
+        }
+        if (clip.mode == CLIP_WHEN_IDLE && anyPlaying) continue;
+        for (uint32_t k = 0; k < clip.trackCount; k++) {
+            int c = scene.tracks[clip.tracks[k]].channel;
+            if (clip.mode == CLIP_TOGGLE && allPlaying) holdChannel(a, c, a.value[c]);
+            else playTrack(a, c, clip.tracks[k], simTime,
+                           clip.mode == CLIP_FROM_CURRENT || clip.mode == CLIP_TOGGLE);
+        }
+    }
+}
+
+// random numbers
+// PCG32 (O'Neill): small state, fast, and reproducible across platforms,
+// unlike rand().
+struct Pcg32 {
+    uint64_t state, inc;
+};
+
+uint32_t pcgNext(Pcg32 &rng) {
+    uint64_t old = rng.state;
+    rng.state = old * 6364136223846793005ULL + rng.inc;
+    uint32_t xorshifted = (uint32_t)(((old >> 18u) ^ old) >> 27u);
+    uint32_t rot = (uint32_t)(old >> 59u);
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
+
+Pcg32 pcgSeed(uint64_t seed, uint64_t stream) {
+    Pcg32 rng = {0u, (stream << 1u) | 1u};
+    pcgNext(rng);
+    rng.state += seed;
+    pcgNext(rng);
+    return rng;
+}
+
+// uniform in [0, 1)
+float pcgFloat(Pcg32 &rng) {
+    return (pcgNext(rng) >> 8) * (1.0f / 16777216.0f);
+}
+
+// particles
+// Structure-of-arrays particle store. Particles rise at their own speed and
+// respawn at respawnY once they pass maxY. They are drawn as point sprites
+// from one buffer, so draw cost is one call regardless of count.
+struct ParticleSystem {
+    int count = 0;
+    vector<float> x, y, z, speed;
+    vector<float> prevY; // y before the last tick, for interpolation
+    float maxY = 5.0f, respawnY = 0.5f;
+    float radius = 0.1f;
+    vector<GLfloat> packed; // xyz staging for the vertex buffer
+    GLuint vbo = 0;
+};
+
+ParticleSystem bubbles;
+GLuint spriteTexture = 0;
+
+void resizeParticles(ParticleSystem &ps, int count) {
+    ps.count = count;
+    ps.x.resize(count);
+    ps.y.resize(count);
+    ps.z.resize(count);
+    ps.speed.resize(count);
+    ps.prevY.resize(count);
+    ps.packed.resize(count * 3);
+}
+
+// bubbles fill the room: x in [-5,5], y in [0.5,5.5], z in [-8,-3]
+void spawnBubbles(ParticleSystem &ps, int count) {
+    resizeParticles(ps, count);
+    Pcg32 rng = pcgSeed(sceneSeed, 0xb0bb1e);
+    for (int i = 0; i < count; i++) {
+        ps.x[i] = ((pcgNext(rng) % 100) / 10.0f) - 5.0f;
+        ps.y[i] = 0.5f + ((pcgNext(rng) % 50) / 10.0f);
+        ps.z[i] = -8.0f + ((pcgNext(rng) % 100) / 20.0f);
+        ps.speed[i] = 0.005f + ((pcgNext(rng) % 10) / 1000.0f);
+    }
+    ps.prevY = ps.y;
+}
+
+// reference version, kept for the benchmark
+void integrateParticlesScalar(ParticleSystem &ps, float ticks) {
+    for (int i = 0; i < ps.count; i++) {
+        ps.prevY[i] = ps.y[i];
+        ps.y[i] += ps.speed[i] * ticks;
+        if (ps.y[i] > ps.maxY) ps.y[i] = ps.respawnY;
+    }
+}
+
+// advance by a number of 16 ms ticks, four particles at a time
+void integrateParticles(ParticleSystem &ps, float ticks) {
+    float *y = ps.y.data(), *prevY = ps.prevY.data();
+    const float *speed = ps.speed.data();
+    f4 dt = f4_set1(ticks), maxY = f4_set1(ps.maxY), respawn = f4_set1(ps.respawnY);
+    int i = 0;
+    for (; i + 4 <= ps.count; i += 4) {
+        f4 oy = f4_load(y + i);
+        f4_store(prevY + i, oy);
+        f4 ny = f4_add(oy, f4_mul(f4_load(speed + i), dt));
+        f4_store(y + i, f4_select_gt(ny, maxY, respawn, ny));
+    }
+    for (; i < ps.count; i++) {
+        prevY[i] = y[i];
+        y[i] += speed[i] * ticks;
+        if (y[i] > ps.maxY) y[i] = ps.respawnY;
+    }
+}
+
+// lit-sphere impostor baked into an RGBA texture, tinted by glColor at draw
+// time; alpha marks the disc
+void buildSpriteTexture() {
+    const int N = 32;
+    GLubyte img[N * N * 4];
+    float lx = -0.4f, ly = 0.5f, lz = 0.77f; // light from upper left, toward viewer
+    for (int j = 0; j < N; j++) {
+        for (int i = 0; i < N; i++) {
+            float u = (i + 0.5f) / N * 2.0f - 1.0f, v = (j + 0.5f) / N * 2.0f - 1.0f;
+            float r2 = u * u + v * v;
+            GLubyte *px = img + (j * N + i) * 4;
+            if (r2 > 1.0f) {
+                px[0] = px[1] = px[2] = px[3] = 0;
+                continue;
+            }
+            float nz = sqrt(1.0f - r2);
+            float diffuse = max(0.0f, u * lx + v * ly + nz * lz);
+            float spec = pow(max(0.0f, nz * (2 * diffuse * nz) - lz), 20.0f);
+            float shade = 0.8f + 0.5f * diffuse; // the lit spheres this replaces were near white
+            px[0] = px[1] = px[2] = (GLubyte)min(255.0f, 255.0f * (shade + spec));
+            px[3] = 255;
+        }
+    }
+    glGenTextures(1, &spriteTexture);
+    glBindTexture(GL_TEXTURE_2D, spriteTexture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, N, N, 0, GL_RGBA, GL_UNSIGNED_BYTE, img);
+    glTexEnvi(GL_POINT_SPRITE, GL_COORD_REPLACE, GL_TRUE);
+}
+
+// alpha blends from the previous tick's height; respawned particles jump
+void uploadParticles(ParticleSystem &ps, float alpha) {
+    GLfloat *out = ps.packed.data();
+    for (int i = 0; i < ps.count; i++) {
+        float y = ps.y[i], py = ps.prevY[i];
+        out[i * 3] = ps.x[i];
+        out[i * 3 + 1] = y < py ? y : py + (y - py) * alpha;
+        out[i * 3 + 2] = ps.z[i];
+    }
+    if (!ps.vbo) glGenBuffers(1, &ps.vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, ps.vbo);
+    glBufferData(GL_ARRAY_BUFFER, ps.packed.size() * sizeof(GLfloat), out, GL_STREAM_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// uniform scale of the current modelview, so sprite sizes follow glScalef
+float modelviewScale() {
+    GLfloat m[16];
+    glGetFloatv(GL_MODELVIEW_MATRIX, m);
+    return sqrt(m[0] * m[0] + m[1] * m[1] + m[2] * m[2]);
+}
+
+// count points from vbo as camera-facing spheres of the given radius
+void drawSprites(GLuint vbo, int count, float radius, const GLfloat color[4]) {
+    // size = k / distance matches a sphere of this radius under gluPerspective(60)
+    float k = 2.0f * radius * modelviewScale() * viewportHeight / (2.0f * tan(30.0f * M_PI / 180.0f));
+    GLfloat atten[] = {0.0f, 0.0f, 1.0f};
+    glPointParameterfv(GL_POINT_DISTANCE_ATTENUATION, atten);
+    glPointSize(k);
+
+    stateDisable(GL_LIGHTING);
+    stateEnable(GL_TEXTURE_2D);
+    stateEnable(GL_POINT_SPRITE);
+    stateEnable(GL_ALPHA_TEST);
+    glAlphaFunc(GL_GREATER, 0.5f);
+    glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+    glColor4fv(color);
+    glBindTexture(GL_TEXTURE_2D, spriteTexture);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glVertexPointer(3, GL_FLOAT, 0, (const GLvoid*)0);
+    glDrawArrays(GL_POINTS, 0, count);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+    stateDisable(GL_ALPHA_TEST);
+    stateDisable(GL_POINT_SPRITE);
+    stateDisable(GL_TEXTURE_2D);
+    stateEnable(GL_LIGHTING);
+}
+
+void drawParticles(ParticleSystem &ps, float alpha = 1.0f) {
+    if (ps.count == 0) return;
+    uploadParticles(ps, alpha);
+    GLfloat bubbleColor[] = {0.8f, 0.9f, 1.0f, 1.0f};
+    drawSprites(ps.vbo, ps.count, ps.radius, bubbleColor);
+}
+
+// sparkle field
+// The pattern for generation g depends only on (sceneSeed, g), and g is
+// derived from simulated time, so the same moment always sparkles the same
+// way however fast frames are drawn.
+const float slipperTableTopY = 2.5f; // the slippers sit on the table
+const float slipperShoeX[2] = {-0.4f, 0.4f};
+
+vector<GLfloat> sparkleXYZ;
+GLuint sparkleVBO = 0;
+long sparkleGeneration = -1;
+bool sparklesUploaded = false;
+
+// CPU side only; the draw command stage runs it on a worker
+void generateSparkles() {
+    long generation = (long)floor(view.time * sparkleHz);
+    int count = 2 * sparklesPerShoe;
+    if (generation == sparkleGeneration && (int)sparkleXYZ.size() == count * 3) return;
+    sparkleGeneration = generation;
+    sparklesUploaded = false;
+    sparkleXYZ.resize(count * 3);
+    Pcg32 rng = pcgSeed(sceneSeed, (uint64_t)generation);
+    for (int i = 0; i < count; i++) {
+        GLfloat *p = &sparkleXYZ[i * 3];
+        p[0] = slipperShoeX[i / sparklesPerShoe] + pcgFloat(rng) * 0.2f - 0.1f;
+        p[1] = slipperTableTopY + 0.2f + pcgFloat(rng) * 0.2f;
+        p[2] = -5.0f + pcgFloat(rng) * 0.2f - 0.1f;
+    }
+}
+
+void updateSparkles() {
+    generateSparkles();
+    if (sparklesUploaded) return;
+    sparklesUploaded = true;
+    int count = 2 * sparklesPerShoe;
+    if (!sparkleVBO) glGenBuffers(1, &sparkleVBO);
+    glBindBuffer(GL_ARRAY_BUFFER, sparkleVBO);
+    glBufferData(GL_ARRAY_BUFFER, count > 0 ? sparkleXYZ.size() * sizeof(GLfloat) : 0,
+                 count > 0 ? &sparkleXYZ[0] : NULL, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// under the slippers' sparkle part, which rises with the shoes
+void drawSparkles() {
+    updateSparkles();
+    if (sparkleXYZ.empty()) return;
+    sparklesShown = true;
+    GLfloat white[] = {1.0f, 1.0f, 1.0f, 1.0f};
+    drawSprites(sparkleVBO, sparkleXYZ.size() / 3, 0.02f, white);
+}
+
+// mesh cache
+// Spheres, cylinders, disks, the cube and the teapot are tessellated once
+// per (shape, parameters, slices, stacks) and kept in vertex buffers. Curved
+// shapes pick a level of detail from their projected radius in pixels, so a
+// small or distant sphere uses a fraction of its nominal tessellation.
+enum ShapeKind { SHAPE_SPHERE, SHAPE_CYLINDER, SHAPE_DISK, SHAPE_CUBE, SHAPE_TEAPOT };
+
+struct ShapeKey {
+    int kind, slices, stacks;
+    float a, b, c; // cylinder: base, top, height; disk: inner, outer
+    bool operator<(const ShapeKey &o) const {
+        if (kind != o.kind) return kind < o.kind;
+        if (slices != o.slices) return slices < o.slices;
+        if (stacks != o.stacks) return stacks < o.stacks;
+        if (a != o.a) return a < o.a;
+        if (b != o.b) return b < o.b;
+        return c < o.c;
+    }
+};
+
+struct CachedMesh {
+    GLuint vbo, ibo;
+    GLsizei indexCount;
+};
+
+map<ShapeKey, CachedMesh> meshCache;
+long meshTrianglesDrawn = 0; // running total, for stats
+
+// interleaved x,y,z, nx,ny,nz
+struct MeshBuilder {
+    vector<GLfloat> verts;
+    vector<GLuint> indices;
+    void vertex(float x, float y, float z, float nx, float ny, float nz) {
+        GLfloat v[] = {x, y, z, nx, ny, nz};
+        verts.insert(verts.end(), v, v + 6);
+    }
+    // (rows+1) x (cols+1) vertex grid starting at base, two triangles per cell
+    void grid(GLuint base, int rows, int cols) {
+        for (int i = 0; i < rows; i++) {
+            for (int j = 0; j < cols; j++) {
+                GLuint a = base + i * (cols + 1) + j;
+                GLuint b = a + cols + 1;
+                GLuint quad[] = {a, b, b + 1, a, b + 1, a + 1};
+                indices.insert(indices.end(), quad, quad + 6);
+            }
+        }
+    }
+};
+
+// unit sphere around z, like gluSphere
+void buildSphere(MeshBuilder &m, int slices, int stacks) {
+    for (int i = 0; i <= stacks; i++) {
+        float rho = M_PI * i / stacks;
+        for (int j = 0; j <= slices; j++) {
+            float theta = 2.0f * M_PI * j / slices;
+            float x = sin(theta) * sin(rho), y = cos(theta) * sin(rho), z = cos(rho);
+            m.vertex(x, y, z, x, y, z);
+        }
+    }
+    m.grid(0, stacks, slices);
+}
+
+// along +z from radius base at z=0 to radius top at z=height, like gluCylinder
+void buildCylinder(MeshBuilder &m, float base, float top, float height, int slices, int stacks) {
+    float slope = (base - top) / height;
+    float nlen = sqrt(1.0f + slope * slope);
+    for (int i = 0; i <= stacks; i++) {
+        float t = (float)i / stacks;
+        float r = base + (top - base) * t;
+        for (int j = 0; j <= slices; j++) {
+            float theta = 2.0f * M_PI * j / slices;
+            float cx = sin(theta), cy = cos(theta);
+            m.vertex(r * cx, r * cy, height * t, cx / nlen, cy / nlen, slope / nlen);
+        }
+    }
+    m.grid(0, stacks, slices);
+}
+
+// annulus in the z=0 plane facing +z, like gluDisk
+void buildDisk(MeshBuilder &m, float inner, float outer, int slices, int loops) {
+    for (int i = 0; i <= loops; i++) {
+        float r = inner + (outer - inner) * i / loops;
+        for (int j = 0; j <= slices; j++) {
+            float theta = 2.0f * M_PI * j / slices;
+            m.vertex(r * sin(theta), r * cos(theta), 0.0f, 0.0f, 0.0f, 1.0f);
+        }
+    }
+    m.grid(0, loops, slices);
+}
+
+void buildCube(MeshBuilder &m) {
+    const float n[6][3] = {{1,0,0}, {-1,0,0}, {0,1,0}, {0,-1,0}, {0,0,1}, {0,0,-1}};
+    const float q[6][4][3] = {
+        {{.5f,-.5f,-.5f}, {.5f,.5f,-.5f}, {.5f,.5f,.5f}, {.5f,-.5f,.5f}},
+        {{-.5f,-.5f,.5f}, {-.5f,.5f,.5f}, {-.5f,.5f,-.5f}, {-.5f,-.5f,-.5f}},
+        {{-.5f,.5f,-.5f}, {-.5f,.5f,.5f}, {.5f,.5f,.5f}, {.5f,.5f,-.5f}},
+        {{-.5f,-.5f,.5f}, {-.5f,-.5f,-.5f}, {.5f,-.5f,-.5f}, {.5f,-.5f,.5f}},
+        {{-.5f,-.5f,.5f}, {.5f,-.5f,.5f}, {.5f,.5f,.5f}, {-.5f,.5f,.5f}},
+        {{.5f,-.5f,-.5f}, {-.5f,-.5f,-.5f}, {-.5f,.5f,-.5f}, {.5f,.5f,-.5f}},
+    };
+    for (int f = 0; f < 6; f++) {
+        GLuint base = m.verts.size() / 6;
+        for (int v = 0; v < 4; v++) m.vertex(q[f][v][0], q[f][v][1], q[f][v][2], n[f][0], n[f][1], n[f][2]);
+        GLuint idx[] = {base, base + 1, base + 2, base, base + 2, base + 3};
+        m.indices.insert(m.indices.end(), idx, idx + 6);
+    }
+}
+
+void buildTeapot(MeshBuilder &m);
+
+const CachedMesh &cachedMesh(const ShapeKey &key) {
+    map<ShapeKey, CachedMesh>::iterator it = meshCache.find(key);
+    if (it != meshCache.end()) return it->second;
+    MeshBuilder m;
+    switch (key.kind) {
+    case SHAPE_SPHERE: buildSphere(m, key.slices, key.stacks); break;
+    case SHAPE_CYLINDER: buildCylinder(m, key.a, key.b, key.c, key.slices, key.stacks); break;
+    case SHAPE_DISK: buildDisk(m, key.a, key.b, key.slices, key.stacks); break;
+    case SHAPE_CUBE: buildCube(m); break;
+    case SHAPE_TEAPOT: buildTeapot(m); break;
+    }
+    CachedMesh mesh;
+    glGenBuffers(1, &mesh.vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
+    glBufferData(GL_ARRAY_BUFFER, m.verts.size() * sizeof(GLfloat), &m.verts[0], GL_STATIC_DRAW);
+    glGenBuffers(1, &mesh.ibo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.ibo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, m.indices.size() * sizeof(GLuint), &m.indices[0], GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    mesh.indexCount = m.indices.size();
+    return meshCache[key] = mesh;
+}
+
+void drawCachedMesh(const CachedMesh &mesh) {
+    flushShaderLighting();
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.ibo);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glVertexPointer(3, GL_FLOAT, 6 * sizeof(GLfloat), (const GLvoid*)0);
+    glNormalPointer(GL_FLOAT, 6 * sizeof(GLfloat), (const GLvoid*)(3 * sizeof(GLfloat)));
+    glDrawElements(GL_TRIANGLES, mesh.indexCount, GL_UNSIGNED_INT, (const GLvoid*)0);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    meshTrianglesDrawn += mesh.indexCount / 3;
+}
+
+// Tessellation divisor for a shape of this object-space radius at the current
+// modelview: 1 (full) when its radius covers 24+ pixels, down to 8 below 3.
+bool lodEnabled = true;
+
+int lodDivisor(float radius) {
+    if (!lodEnabled) return 1;
+    GLfloat m[16];
+    glGetFloatv(GL_MODELVIEW_MATRIX, m);
+    float scale = sqrt(m[0] * m[0] + m[1] * m[1] + m[2] * m[2]);
+    float dist = sqrt(m[12] * m[12] + m[13] * m[13] + m[14] * m[14]); // eye-space distance
+    float pixels = radius * scale * viewportHeight / (2.0f * tan(30.0f * M_PI / 180.0f) * max(dist, 0.01f));
+    if (pixels >= 24.0f) return 1;
+    if (pixels >= 8.0f) return 2;
+    if (pixels >= 3.0f) return 4;
+    return 8;
+}
+
+void solidCube(float size) {
+    ShapeKey key = {SHAPE_CUBE, 0, 0, 0, 0, 0};
+    glPushMatrix();
+    glScalef(size, size, size);
+    drawCachedMesh(cachedMesh(key));
+    glPopMatrix();
+}
+
+void solidSphere(float radius, int slices, int stacks) {
+    int lod = lodDivisor(radius);
+    ShapeKey key = {SHAPE_SPHERE, max(8, slices / lod), max(6, stacks / lod), 0, 0, 0};
+    glPushMatrix();
+    glScalef(radius, radius, radius);
+    drawCachedMesh(cachedMesh(key));
+    glPopMatrix();
+}
+
+void solidCylinder(float base, float top, float height, int slices, int stacks) {
+    int lod = lodDivisor(max(max(base, top), height / 2));
+    ShapeKey key = {SHAPE_CYLINDER, max(8, slices / lod), stacks, base, top, height};
+    drawCachedMesh(cachedMesh(key));
+}
+
+void solidDisk(float inner, float outer, int slices, int loops) {
+    int lod = lodDivisor(outer);
+    ShapeKey key = {SHAPE_DISK, max(8, slices / lod), loops, inner, outer, 0};
+    drawCachedMesh(cachedMesh(key));
+}
+
+// instanced draws
+// Parts that repeat one shape and material (the shoes and heels) go out as
+// one draw with their world matrices as per-instance attributes, which the
+// lighting program applies before the modelview. Without the lighting
+// program bound, or before GL 3.3, they are drawn one by one.
+typedef void (*DrawElementsInstancedProc)(GLenum mode, GLsizei count, GLenum type, const void *indices, GLsizei instances);
+typedef void (*VertexAttribDivisorProc)(GLuint index, GLuint divisor);
+
+DrawElementsInstancedProc pglDrawElementsInstanced = NULL;
+GLuint instanceVBO = 0;
+vector<GLfloat> instanceMatrices;
+long instancedDraws = 0, instancesDrawn = 0; // stats
+
+// the identity, for draws without the arrays; undefined once an array has fed them
+void resetInstanceAttribs() {
+    for (int c = 0; c < 4; c++) glVertexAttrib4f(INSTANCE_ATTRIB + c, c == 0, c == 1, c == 2, c == 3);
+}
+
+// after initShaderLighting()
+void initInstancing() {
+    VertexAttribDivisorProc divisor = (VertexAttribDivisorProc)glProc("glVertexAttribDivisor");
+    pglDrawElementsInstanced = (DrawElementsInstancedProc)glProc("glDrawElementsInstanced");
+    if (!shaderLighting || !divisor || !pglDrawElementsInstanced) {
+        pglDrawElementsInstanced = NULL;
+        return;
+    }
+    for (int c = 0; c < 4; c++) divisor(INSTANCE_ATTRIB + c, 1);
+    resetInstanceAttribs();
+    glGenBuffers(1, &instanceVBO);
+}
+
+void drawCachedMeshInstances(const CachedMesh &mesh, const GLfloat *matrices, int count) {
+    flushShaderLighting();
+    glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
+    glBufferData(GL_ARRAY_BUFFER, count * 16 * sizeof(GLfloat), matrices, GL_STREAM_DRAW);
+    for (int c = 0; c < 4; c++) {
+        glEnableVertexAttribArray(INSTANCE_ATTRIB + c);
+        glVertexAttribPointer(INSTANCE_ATTRIB + c, 4, GL_FLOAT, GL_FALSE, 16 * sizeof(GLfloat),
+                              (const GLvoid*)(c * 4 * sizeof(GLfloat)));
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.ibo);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glVertexPointer(3, GL_FLOAT, 6 * sizeof(GLfloat), (const GLvoid*)0);
+    glNormalPointer(GL_FLOAT, 6 * sizeof(GLfloat), (const GLvoid*)(3 * sizeof(GLfloat)));
+    pglDrawElementsInstanced(GL_TRIANGLES, mesh.indexCount, GL_UNSIGNED_INT, (const GLvoid*)0, count);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glDisableClientState(GL_NORMAL_ARRAY);
+    for (int c = 0; c < 4; c++) glDisableVertexAttribArray(INSTANCE_ATTRIB + c);
+    resetInstanceAttribs();
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    meshTrianglesDrawn += count * (mesh.indexCount / 3);
+    instancedDraws++;
+    instancesDrawn += count;
+}
+
+// solidCube(1.0f) under each of count consecutive transforms
+void solidCubeParts(int first, int count) {
+    if (!pglDrawElementsInstanced || !stateIsEnabled(GL_LIGHTING)) {
+        for (int i = 0; i < count; i++) {
+            pushTransform(first + i);
+            solidCube(1.0f);
+            glPopMatrix();
+        }
+        return;
+    }
+    instanceMatrices.resize(count * 16);
+    for (int i = 0; i < count; i++) memcpy(&instanceMatrices[i * 16], transforms[first + i].world, 16 * sizeof(GLfloat));
+    ShapeKey key = {SHAPE_CUBE, 0, 0, 0, 0, 0};
+    drawCachedMeshInstances(cachedMesh(key), &instanceMatrices[0], count);
+}
+
+// Newell teapot patches (same control data as freeglut). Rim, body, lid and
+// bottom are mirrored in x and y, handle and spout in y only.
+const float teapotCP[129][3] = {
+    {1.4f, 0.0f, 2.4f}, {1.4f, -0.784f, 2.4f}, {0.784f, -1.4f, 2.4f}, {0.0f, -1.4f, 2.4f},
+    {1.3375f, 0.0f, 2.53125f}, {1.3375f, -0.749f, 2.53125f}, {0.749f, -1.3375f, 2.53125f}, {0.0f, -1.3375f, 2.53125f},
+    {1.4375f, 0.0f, 2.53125f}, {1.4375f, -0.805f, 2.53125f}, {0.805f, -1.4375f, 2.53125f}, {0.0f, -1.4375f, 2.53125f},
+    {1.5f, 0.0f, 2.4f}, {1.5f, -0.84f, 2.4f}, {0.84f, -1.5f, 2.4f}, {0.0f, -1.5f, 2.4f},
+    {1.75f, 0.0f, 1.875f}, {1.75f, -0.98f, 1.875f}, {0.98f, -1.75f, 1.875f}, {0.0f, -1.75f, 1.875f},
+    {2.0f, 0.0f, 1.35f}, {2.0f, -1.12f, 1.35f}, {1.12f, -2.0f, 1.35f}, {0.0f, -2.0f, 1.35f},
+    {2.0f, 0.0f, 0.9f}, {2.0f, -1.12f, 0.9f}, {1.12f, -2.0f, 0.9f}, {0.0f, -2.0f, 0.9f},
+    {2.0f, 0.0f, 0.45f}, {2.0f, -1.12f, 0.45f}, {1.12f, -2.0f, 0.45f}, {0.0f, -2.0f, 0.45f},
+    {1.5f, 0.0f, 0.225f}, {1.5f, -0.84f, 0.225f}, {0.84f, -1.5f, 0.225f}, {0.0f, -1.5f, 0.225f},
+    {1.5f, 0.0f, 0.15f}, {1.5f, -0.84f, 0.15f}, {0.84f, -1.5f, 0.15f}, {0.0f, -1.5f, 0.15f},
+    {0.0f, 0.0f, 3.15f}, {0.0f, -0.002f, 3.15f}, {0.002f, 0.0f, 3.15f}, {0.8f, 0.0f, 3.15f},
+    {0.8f, -0.45f, 3.15f}, {0.45f, -0.8f, 3.15f}, {0.0f, -0.8f, 3.15f}, {0.0f, 0.0f, 2.85f},
+    {0.2f, 0.0f, 2.7f}, {0.2f, -0.112f, 2.7f}, {0.112f, -0.2f, 2.7f}, {0.0f, -0.2f, 2.7f},
+    {0.4f, 0.0f, 2.55f}, {0.4f, -0.224f, 2.55f}, {0.224f, -0.4f, 2.55f}, {0.0f, -0.4f, 2.55f},
+    {1.3f, 0.0f, 2.55f}, {1.3f, -0.728f, 2.55f}, {0.728f, -1.3f, 2.55f}, {0.0f, -1.3f, 2.55f},
+    {1.3f, 0.0f, 2.4f}, {1.3f, -0.728f, 2.4f}, {0.728f, -1.3f, 2.4f}, {0.0f, -1.3f, 2.4f},
+    {0.0f, 0.0f, 0.0f}, {0.0f, -1.425f, 0.0f}, {0.798f, -1.425f, 0.0f}, {1.425f, -0.798f, 0.0f},
+    {1.425f, 0.0f, 0.0f}, {0.0f, -1.5f, 0.075f}, {0.84f, -1.5f, 0.075f}, {1.5f, -0.84f, 0.075f},
+    {1.5f, 0.0f, 0.075f}, {-1.6f, 0.0f, 2.025f}, {-1.6f, -0.3f, 2.025f}, {-1.5f, -0.3f, 2.25f},
+    {-1.5f, 0.0f, 2.25f}, {-2.3f, 0.0f, 2.025f}, {-2.3f, -0.3f, 2.025f}, {-2.5f, -0.3f, 2.25f},
+    {-2.5f, 0.0f, 2.25f}, {-2.7f, 0.0f, 2.025f}, {-2.7f, -0.3f, 2.025f}, {-3.0f, -0.3f, 2.25f},
+    {-3.0f, 0.0f, 2.25f}, {-2.7f, 0.0f, 1.8f}, {-2.7f, -0.3f, 1.8f}, {-3.0f, -0.3f, 1.8f},
+    {-3.0f, 0.0f, 1.8f}, {-2.7f, 0.0f, 1.575f}, {-2.7f, -0.3f, 1.575f}, {-3.0f, -0.3f, 1.35f},
+    {-3.0f, 0.0f, 1.35f}, {-2.5f, 0.0f, 1.125f}, {-2.5f, -0.3f, 1.125f}, {-2.65f, -0.3f, 0.9375f},
+    {-2.65f, 0.0f, 0.9375f}, {-2.0f, 0.0f, 0.9f}, {-2.0f, -0.3f, 0.9f}, {-1.9f, -0.3f, 0.6f},
+    {-1.9f, 0.0f, 0.6f}, {1.7f, 0.0f, 1.425f}, {1.7f, -0.66f, 1.425f}, {1.7f, -0.66f, 0.6f},
+    {1.7f, 0.0f, 0.6f}, {2.6f, 0.0f, 1.425f}, {2.6f, -0.66f, 1.425f}, {3.1f, -0.66f, 0.825f},
+    {3.1f, 0.0f, 0.825f}, {2.3f, 0.0f, 2.1f}, {2.3f, -0.25f, 2.1f}, {2.4f, -0.25f, 2.025f},
+    {2.4f, 0.0f, 2.025f}, {2.7f, 0.0f, 2.4f}, {2.7f, -0.25f, 2.4f}, {3.3f, -0.25f, 2.4f},
+    {3.3f, 0.0f, 2.4f}, {2.8f, 0.0f, 2.475f}, {2.8f, -0.25f, 2.475f}, {3.525f, -0.25f, 2.49375f},
+    {3.525f, 0.0f, 2.49375f}, {2.9f, 0.0f, 2.475f}, {2.9f, -0.15f, 2.475f}, {3.45f, -0.15f, 2.5125f},
+    {3.45f, 0.0f, 2.5125f}, {2.8f, 0.0f, 2.4f}, {2.8f, -0.15f, 2.4f}, {3.2f, -0.15f, 2.4f},
+    {3.2f, 0.0f, 2.4f},
+};
+
+const int teapotPatch[10][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},           // rim
+    {12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27}, // body
+    {24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39},
+    {40, 41, 42, 40, 43, 44, 45, 46, 47, 47, 47, 47, 48, 49, 50, 51}, // lid
+    {48, 49, 50, 51, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 62, 63},
+    {64, 64, 64, 64, 65, 66, 67, 68, 69, 70, 71, 72, 39, 38, 37, 36}, // bottom
+    {73, 74, 75, 76, 77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 88}, // handle
+    {85, 86, 87, 88, 89, 90, 91, 92, 93, 94, 95, 96, 97, 98, 99, 100},
+    {101, 102, 103, 104, 105, 106, 107, 108, 109, 110, 111, 112, 113, 114, 115, 116}, // spout
+    {113, 114, 115, 116, 117, 118, 119, 120, 121, 122, 123, 124, 125, 126, 127, 128},
+};
+
+const int TEAPOT_SUBDIV = 10;
+
+void bernstein(float t, float b[4], float db[4]) {
+    float s = 1.0f - t;
+    b[0] = s * s * s; b[1] = 3 * t * s * s; b[2] = 3 * t * t * s; b[3] = t * t * t;
+    db[0] = -3 * s * s; db[1] = 3 * s * s - 6 * t * s; db[2] = 6 * t * s - 3 * t * t; db[3] = 3 * t * t;
+}
+
+void evalTeapotPatch(const float cp[16][3], float u, float v, float p[3], float n[3]) {
+    float bu[4], dbu[4], bv[4], dbv[4];
+    bernstein(u, bu, dbu);
+    bernstein(v, bv, dbv);
+    float du[3] = {0, 0, 0}, dv[3] = {0, 0, 0};
+    p[0] = p[1] = p[2] = 0;
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 4; j++) {
+            for (int k = 0; k < 3; k++) {
+                float c = cp[i * 4 + j][k];
+                p[k]  += bu[i] * bv[j] * c;
+                du[k] += dbu[i] * bv[j] * c;
+                dv[k] += bu[i] * dbv[j] * c;
+            }
+        }
+    }
+    n[0] = du[1] * dv[2] - du[2] * dv[1];
+    n[1] = du[2] * dv[0] - du[0] * dv[2];
+    n[2] = du[0] * dv[1] - du[1] * dv[0];
+}
+
+void addTeapotPatch(MeshBuilder &m, const int patch[16], float sx, float sy) {
+    float cp[16][3];
+    for (int i = 0; i < 16; i++) {
+        cp[i][0] = teapotCP[patch[i]][0] * sx;
+        cp[i][1] = teapotCP[patch[i]][1] * sy;
+        cp[i][2] = teapotCP[patch[i]][2];
+    }
+    // a single mirror flips the surface orientation
+    float flip = (sx * sy < 0) ? 1.0f : -1.0f;
+    GLuint base = m.verts.size() / 6;
+    for (int i = 0; i <= TEAPOT_SUBDIV; i++) {
+        for (int j = 0; j <= TEAPOT_SUBDIV; j++) {
+            float u = (float)i / TEAPOT_SUBDIV, v = (float)j / TEAPOT_SUBDIV;
+            float p[3], n[3];
+            evalTeapotPatch(cp, u, v, p, n);
+            // degenerate edges (lid top, bottom centre): step inwards a little
+            if (n[0] * n[0] + n[1] * n[1] + n[2] * n[2] < 1e-10f) {
+                float q[3];
+                evalTeapotPatch(cp, u == 0.0f ? 0.01f : (u == 1.0f ? 0.99f : u), v, q, n);
+            }
+            m.vertex(p[0], p[1], p[2], n[0] * flip, n[1] * flip, n[2] * flip);
+        }
+    }
+    m.grid(base, TEAPOT_SUBDIV, TEAPOT_SUBDIV);
+}
+
+void buildTeapot(MeshBuilder &m) {
+    for (int p = 0; p < 10; p++) {
+        addTeapotPatch(m, teapotPatch[p], 1, 1);
+        addTeapotPatch(m, teapotPatch[p], 1, -1);
+        if (p < 6) {
+            addTeapotPatch(m, teapotPatch[p], -1, 1);
+            addTeapotPatch(m, teapotPatch[p], -1, -1);
+        }
+    }
+}
+
+void solidTeapot(float size) {
+    ShapeKey key = {SHAPE_TEAPOT, TEAPOT_SUBDIV, TEAPOT_SUBDIV, 0, 0, 0};
+    glPushMatrix();
+    glRotatef(270.0f, 1.0f, 0.0f, 0.0f);
+    glScalef(0.5f * size, 0.5f * size, 0.5f * size);
+    glTranslatef(0.0f, 0.0f, -1.5f);
+    drawCachedMesh(cachedMesh(key));
+    glPopMatrix();
+}
+
+void presentFrame() {
+    if (headlessMode) return; // finishHeadlessFrame() stands in for the swap
+    glutSwapBuffers();
+    stampInput(LATENCY_PRESENTED);
+}
+
+// lighting
+void updateLighting() {
+   GLfloat ambient[] = {globalAmbientLevel, globalAmbientLevel, globalAmbientLevel, 1.0f};
+   stateLightModelAmbient(ambient);
+   if (ceilingLightOn) stateEnable(GL_LIGHT1);
+   else stateDisable(GL_LIGHT1);
+   if (greenLightOn) stateEnable(GL_LIGHT3);
+   else stateDisable(GL_LIGHT3);
+   positionWorldLights();
+   // the fixture can leave emission on, and the sun that used to reset it may be culled
+   GLfloat noEmission[] = {0.0f, 0.0f, 0.0f, 1.0f};
+   stateMaterial(GL_EMISSION, noEmission);
+}
+
+// prop parts
+// A prop node's parts sit right after it in the transform hierarchy, in the
+// order below. Their locals are what the prop code used to build with
+// glTranslatef/glRotatef/glScalef on top of the node's matrix.
+enum SlipperPart { SLIPPER_SHOE, SLIPPER_HEEL = 2, SLIPPER_SPARKLES = 4, SLIPPER_PARTS }; // shoes, heels adjacent
+enum LampPart { LAMP_BASE, LAMP_UPRIGHT, LAMP_ARM, LAMP_SHADE, LAMP_CONE, LAMP_PARTS };
+enum BroomPart { BROOM_STICK, BROOM_PARTS };
+enum FixturePart { FIXTURE_WHITE, FIXTURE_GREEN, FIXTURE_PARTS };
+const int MAX_PROP_PARTS = 5;
+
+const float lampBaseX = -0.8f; // left side of table
+const float lampZ = -5.0f;
+const float lampUpright = 0.8f, lampArm = 0.8f;
+const float lampHeadX = lampBaseX + lampArm, lampHeadY = slipperTableTopY + lampUpright - 0.1f;
+const float fixtureY = 4.8f, fixtureZ = -5.0f, fixtureRadius = 0.2f; // near the ceiling
+
+// the parts' local matrices at the current pose; returns how many
+int propParts(uint32_t prop, float parts[MAX_PROP_PARTS][16]) {
+    for (int p = 0; p < MAX_PROP_PARTS; p++) mat4Identity(parts[p]);
+    switch (prop) {
+    case PROP_SLIPPERS: {
+        float lift = fabs(view.heelOffset);
+        for (int s = 0; s < 2; s++) {
+            float *shoe = parts[SLIPPER_SHOE + s], *heel = parts[SLIPPER_HEEL + s];
+            mat4Translate(shoe, slipperShoeX[s], slipperTableTopY + 0.2f + lift, -5.0f);
+            mat4Rotate(shoe, 15.0f, 1.0f, 0.0f, 0.0f);
+            mat4Scale(shoe, 0.6f, 0.2f, 1.2f);
+            mat4Translate(heel, slipperShoeX[s], slipperTableTopY + 0.1f, -5.6f);
+            mat4Scale(heel, 0.2f, 0.4f, 0.2f);
+        }
+        mat4Translate(parts[SLIPPER_SPARKLES], 0.0f, lift, 0.0f); // sparkles rise with the shoes
+        return SLIPPER_PARTS;
+    }
+    case PROP_LAMP:
+        mat4Translate(parts[LAMP_BASE], lampBaseX, slipperTableTopY + 0.025f, lampZ);
+        mat4Rotate(parts[LAMP_BASE], -90.0f, 1.0f, 0.0f, 0.0f); // flat on table
+        mat4Translate(parts[LAMP_UPRIGHT], lampBaseX, slipperTableTopY + lampUpright / 2.0f, lampZ);
+        mat4Scale(parts[LAMP_UPRIGHT], 0.05f, lampUpright, 0.05f);
+        mat4Translate(parts[LAMP_ARM], lampBaseX + lampArm / 2.0f, slipperTableTopY + lampUpright, lampZ);
+        mat4Scale(parts[LAMP_ARM], lampArm, 0.05f, 0.05f);
+        mat4Translate(parts[LAMP_SHADE], lampHeadX, lampHeadY, lampZ);
+        mat4Rotate(parts[LAMP_SHADE], -90.0f, 1.0f, 0.0f, 0.0f);
+        mat4Translate(parts[LAMP_CONE], lampHeadX, lampHeadY, lampZ);
+        mat4Rotate(parts[LAMP_CONE], -90.0f, -1.0f, 0.0f, 0.0f);
+        return LAMP_PARTS;
+    case PROP_BROOM: {
+        float baseX = -4.6f, baseY = 0.3f, baseZ = -9.6f; // the scene node lifts it while flying
+        mat4Translate(parts[BROOM_STICK], baseX + 0.5f, baseY + 0.3f - 0.5f, baseZ);
+        mat4Rotate(parts[BROOM_STICK], -70.0f, 1.0f, 0.0f, 0.0f); // lean backward
+        mat4Rotate(parts[BROOM_STICK], -15.0f, 0.0f, 1.0f, 0.0f); // side tilt
+        return BROOM_PARTS;
+    }
+    case PROP_FIXTURE:
+        mat4Translate(parts[FIXTURE_WHITE], 0.0f, fixtureY, fixtureZ);
+        mat4Translate(parts[FIXTURE_GREEN], 0.0f, fixtureY - fixtureRadius * 2.0f, fixtureZ);
+        return FIXTURE_PARTS;
+    }
+    return 0;
+}
+
+// id is the prop node's transform; its parts follow it
+void drawRubySlippers(int id) {
+    // materials
+    GLfloat redAmbient[] = {0.4f, 0.0f, 0.0f, 1.0f};
+    GLfloat redDiffuse[] = {1.0f, 0.0f, 0.0f, 1.0f};
+    GLfloat redSpecular[] = {1.0f, 1.0f, 1.0f, 1.0f};
+    GLfloat shininess[] = {100.0f};
+    stateMaterial(GL_AMBIENT, redAmbient);
+    stateMaterial(GL_DIFFUSE, redDiffuse);
+    stateMaterial(GL_SPECULAR, redSpecular);
+    stateMaterial(GL_SHININESS, shininess);
+    solidCubeParts(id + 1 + SLIPPER_SHOE, 4); // both shoes and both heels
+    pushTransform(id + 1 + SLIPPER_SPARKLES);
+    drawSparkles();
+    glPopMatrix();
+}
+
+void drawLampOnTable(int id) {
+    GLfloat darkGray[] = {0.2f, 0.2f, 0.2f, 1.0f};
+    GLfloat bulbColor[] = {1.0f, 0.9f, 0.6f, 1.0f};
+
+    // base
+    pushTransform(id + 1 + LAMP_BASE);
+    stateMaterial(GL_AMBIENT_AND_DIFFUSE, darkGray);
+    solidDisk(0.0f, 0.2f, 32, 1);
+    glPopMatrix();
+
+    // Vertical Arm
+    pushTransform(id + 1 + LAMP_UPRIGHT);
+    stateMaterial(GL_AMBIENT_AND_DIFFUSE, darkGray);
+    solidCube(1.0f);
+    glPopMatrix();
+
+    // Horizontal Arm
+    pushTransform(id + 1 + LAMP_ARM);
+    stateMaterial(GL_AMBIENT_AND_DIFFUSE, darkGray);
+    solidCube(1.0f);
+    glPopMatrix();
+
+    //  Cone Lampshade
+    pushTransform(id + 1 + LAMP_SHADE);
+    stateMaterial(GL_AMBIENT_AND_DIFFUSE, bulbColor);
+    solidCylinder(0.15f, 0.0f, 0.25f, 20, 4);
+    glPopMatrix();
+
+    pushTransform(id + 1 + LAMP_CONE);
+    stateEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    stateDisable(GL_LIGHTING);
+    glColor4f(1.0f, 1.0f, 1.0f, 0.15f);
+
+    float coneBase = 1.0f;
+    float coneTip = 0.05f;
+    float coneHeight = lampHeadY - 2.5f;
+    solidCylinder(coneTip, coneBase, coneHeight, 16, 1);
+
+    stateEnable(GL_LIGHTING);
+    stateDisable(GL_BLEND);
+    glPopMatrix();
+}
+
+void drawLeaningBroom(int id) {
+    float handleLength = 2.0f;
+    GLfloat handleColor[] = {0.4f, 0.2f, 0.1f, 1.0f};
+    GLfloat bristleColor[] = {0.9f, 0.8f, 0.3f, 1.0f};
+    pushTransform(id + 1 + BROOM_STICK);
+    // bristle
+    stateMaterial(GL_AMBIENT_AND_DIFFUSE, bristleColor);
+    solidCylinder(0.15f, 0.05f, 0.3f, 16, 3);
+    // handle
+    stateMaterial(GL_AMBIENT_AND_DIFFUSE, handleColor);
+    solidCylinder(0.05f, 0.05f, handleLength, 12, 3);
+    glPopMatrix();
+}
+
+void drawCeilingLightFixture(int id) {
+    // Material properties
+    GLfloat whiteAmbientGlow[]  = {0.8f, 0.8f, 0.8f, 1.0f};
+    GLfloat whiteAmbientDull[]  = {0.2f, 0.2f, 0.2f, 1.0f};
+
+    GLfloat whiteDiffuseGlow[]  = {1.0f, 1.0f, 1.0f, 1.0f};
+    GLfloat whiteDiffuseDull[]  = {0.5f, 0.5f, 0.5f, 1.0f};
+
+    GLfloat whiteEmissionGlow[] = {0.7f, 0.7f, 0.7f, 1.0f};
+    GLfloat whiteEmissionDull[] = {0.0f, 0.0f, 0.0f, 1.0f};
+
+    GLfloat* whiteAmbient  = whiteGlowOn ? whiteAmbientGlow  : whiteAmbientDull;
+    GLfloat* whiteDiffuse  = whiteGlowOn ? whiteDiffuseGlow  : whiteDiffuseDull;
+    GLfloat* whiteEmission = whiteGlowOn ? whiteEmissionGlow : whiteEmissionDull;
+
+    // Green sphere
+    GLfloat greenAmbientGlow[]   = {0.0f, 0.3f, 0.0f, 1.0f};
+    GLfloat greenAmbientDark[]   = {0.0f, 0.2f, 0.0f, 1.0f};
+
+    GLfloat greenDiffuseGlow[]   = {0.2f, 0.8f, 0.2f, 1.0f};
+    GLfloat greenDiffuseDark[]   = {0.0f, 0.4f, 0.0f, 1.0f};
+
+    GLfloat greenEmissionGlow[]  = {0.0f, 0.6f, 0.0f, 1.0f};
+    GLfloat greenEmissionDark[]  = {0.0f, 0.0f, 0.0f, 1.0f};
+    
+    GLfloat* greenAmbient  = heelClicking ? greenAmbientDark  : greenAmbientGlow;
+    GLfloat* greenDiffuse  = heelClicking ? greenDiffuseDark  : greenDiffuseGlow;
+    GLfloat* greenEmission = heelClicking ? greenEmissionDark : greenEmissionGlow;
+
+    GLfloat noEmission[] = {0.0f, 0.0f, 0.0f, 1.0f};
+
+    // Draw string
+    stateDisable(GL_LIGHTING);
+    glColor3f(0.2f, 0.2f, 0.2f);
+    pushTransform(id);
+    glBegin(GL_LINES);
+    glVertex3f(0.0f, fixtureY + fixtureRadius + 0.1f, fixtureZ);
+    glVertex3f(0.0f, fixtureY, fixtureZ);
+    glEnd();
+    glPopMatrix();
+    stateEnable(GL_LIGHTING);
+
+    // Top white glowing sphere
+    stateMaterial(GL_AMBIENT, whiteAmbient);
+    stateMaterial(GL_DIFFUSE, whiteDiffuse);
+    stateMaterial(GL_EMISSION, whiteEmission);
+    pushTransform(id + 1 + FIXTURE_WHITE);
+    solidSphere(fixtureRadius, 20, 20);
+    glPopMatrix();
+
+    // Bottom green glowing sphere
+    stateMaterial(GL_AMBIENT, greenAmbient);
+    stateMaterial(GL_DIFFUSE, greenDiffuse);
+    stateMaterial(GL_EMISSION, greenEmission);
+    pushTransform(id + 1 + FIXTURE_GREEN);
+    solidSphere(fixtureRadius, 20, 20);
+    glPopMatrix();
+
+    // Bottom green sphere (Oz head)
+    if (heelClicking) {
+        GLfloat darkGreenAmbient[] = {0.0f, 0.2f, 0.0f, 1.0f};
+        GLfloat darkGreenDiffuse[] = {0.0f, 0.5f, 0.0f, 1.0f};
+        GLfloat noEmission[] = {0.0f, 0.0f, 0.0f, 1.0f};
+
+        stateMaterial(GL_AMBIENT, darkGreenAmbient);
+        stateMaterial(GL_DIFFUSE, darkGreenDiffuse);
+        stateMaterial(GL_EMISSION, noEmission);
+    } else {
+        // Glowing green
+        GLfloat greenAmbient[] = {0.0f, 0.3f, 0.0f, 1.0f};
+        GLfloat greenDiffuse[] = {0.2f, 0.8f, 0.2f, 1.0f};
+        GLfloat greenEmission[] = {0.0f, 0.6f, 0.0f, 1.0f};
+
+        stateMaterial(GL_AMBIENT, greenAmbient);
+        stateMaterial(GL_DIFFUSE, greenDiffuse);
+        stateMaterial(GL_EMISSION, greenEmission);
+    }
+
+    pushTransform(id + 1 + FIXTURE_GREEN);
+    solidSphere(fixtureRadius, 20, 20);
+    glPopMatrix();
+    
+    stateMaterial(GL_EMISSION, noEmission);
+  
+    if (greenMode) {
+        stateMaterial(GL_EMISSION, greenEmission);
+    } else {
+        stateMaterial(GL_EMISSION, noEmission);
+    }
+
+}
+
+void drawBubbles(int id) {
+    if (!bubblesActive) return;
+    pushTransform(id);
+    drawParticles(bubbles, renderAlpha);
+    glPopMatrix();
+}
+
+// clustered lights
+// Practical lights (the lamp, the fixture's glowing spheres and any extra
+// lights from --lights) are point or spot lights with a finite radius.
+// Each frame they are moved to view space and binned into the froxel grid:
+// every slice their sphere reaches is tested against its tiles' boxes four
+// at a time. The grid's light lists go to the lighting program through
+// texture buffers, so a fragment only loops over the lights of its own
+// cluster. Fixed-function lighting has no practical lights.
+#ifndef GL_TEXTURE_BUFFER
+#  define GL_TEXTURE_BUFFER 0x8C2A
+#  define GL_RGBA32F 0x8814
+#  define GL_RG32UI 0x823C
+#  define GL_R16UI 0x8234
+#endif
+
+typedef void (*TexBufferProc)(GLenum target, GLenum internalFormat, GLuint buffer);
+
+const int MAX_LIGHTS_PER_CLUSTER = 256;
+const int MAX_PRACTICAL_LIGHTS = 65535; // indices are 16-bit
+
+// one texel per line, see lightingFragmentShader
+struct PracticalLight {
+    float pos[3], radius;
+    float color[3], cosOuter;
+    float dir[3], cosInner;
+};
+
+// extra lights drift up and down around their base position
+struct ExtraLight {
+    PracticalLight light;
+    float phase, speed;
+};
+
+int numExtraLights = 0; // --lights
+vector<ExtraLight> extraLights;
+vector<PracticalLight> practicalLights; // world space, this frame
+vector<PracticalLight> viewLights;      // view space, as uploaded
+
+// cluster boxes in view space, one array per bound so four tiles load at once
+vector<float> clusterLo[3], clusterHi[3];
+float clusterGridAspect = 0.0f;
+vector<uint16_t> clusterSlots;   // MAX_LIGHTS_PER_CLUSTER per cluster
+vector<uint16_t> clusterCounts;
+vector<uint32_t> clusterRanges;  // offset, count per cluster
+vector<uint16_t> clusterIndices;
+long clusterOverflow = 0;        // light/cluster pairs dropped for a full cluster
+
+GLuint clusterBuffers[3], clusterTextures[3]; // light data, ranges, indices
+long clusterFrames = 0, clusterPairsTotal = 0, clusterLightsTotal = 0;
+double clusterBinMsTotal = 0.0;
+int clusterMaxCount = 0;
+
+float sliceDepth(int k) {
+    return Z_NEAR * pow(Z_FAR / Z_NEAR, (float)k / CLUSTER_Z);
+}
+
+int depthSlice(float depth) {
+    int k = (int)floor(log(depth / Z_NEAR) / log(Z_FAR / Z_NEAR) * CLUSTER_Z);
+    return max(0, min(CLUSTER_Z - 1, k));
+}
+
+// tile boxes follow the projection, so they are rebuilt when the aspect changes
+void buildClusterGrid(float aspect) {
+    float tanY = tan(FOVY * 0.5f * M_PI / 180.0f), tanX = tanY * aspect;
+    for (int a = 0; a < 3; a++) {
+        clusterLo[a].resize(NUM_CLUSTERS);
+        clusterHi[a].resize(NUM_CLUSTERS);
+    }
+    for (int k = 0; k < CLUSTER_Z; k++) {
+        float d0 = sliceDepth(k), d1 = sliceDepth(k + 1);
+        for (int j = 0; j < CLUSTER_Y; j++) {
+            float y0 = (-1.0f + 2.0f * j / CLUSTER_Y) * tanY, y1 = (-1.0f + 2.0f * (j + 1) / CLUSTER_Y) * tanY;
+            for (int i = 0; i < CLUSTER_X; i++) {
+                float x0 = (-1.0f + 2.0f * i / CLUSTER_X) * tanX, x1 = (-1.0f + 2.0f * (i + 1) / CLUSTER_X) * tanX;
+                int c = (k * CLUSTER_Y + j) * CLUSTER_X + i;
+                // x0 * d is smallest at d0 or d1 depending on its sign
+                clusterLo[0][c] = min(x0 * d0, x0 * d1);
+                clusterHi[0][c] = max(x1 * d0, x1 * d1);
+                clusterLo[1][c] = min(y0 * d0, y0 * d1);
+                clusterHi[1][c] = max(y1 * d0, y1 * d1);
+                clusterLo[2][c] = -d1;
+                clusterHi[2][c] = -d0;
+            }
+        }
+    }
+    clusterGridAspect = aspect;
+}
+
+void addToCluster(int c, int light) {
+    if (clusterCounts[c] == MAX_LIGHTS_PER_CLUSTER) {
+        clusterOverflow++;
+        return;
+    }
+    clusterSlots[c * MAX_LIGHTS_PER_CLUSTER + clusterCounts[c]++] = light;
+}
+
+// slices a light's sphere can reach; false if none
+bool lightSlices(const PracticalLight &l, int &k0, int &k1) {
+    float d0 = -l.pos[2] - l.radius, d1 = -l.pos[2] + l.radius;
+    if (d1 < Z_NEAR || d0 > Z_FAR) return false;
+    k0 = depthSlice(max(d0, Z_NEAR));
+    k1 = depthSlice(min(d1, Z_FAR));
+    return true;
+}
+
+// reference version, kept for the benchmark
+void binLightsScalar(const vector<PracticalLight> &lights) {
+    fill(clusterCounts.begin(), clusterCounts.end(), 0);
+    for (size_t n = 0; n < lights.size(); n++) {
+        const PracticalLight &l = lights[n];
+        int k0, k1;
+        if (!lightSlices(l, k0, k1)) continue;
+        for (int c = k0 * CLUSTER_TILES; c < (k1 + 1) * CLUSTER_TILES; c++) {
+            float d2 = 0.0f;
+            for (int a = 0; a < 3; a++) {
+                float d = max(max(clusterLo[a][c] - l.pos[a], l.pos[a] - clusterHi[a][c]), 0.0f);
+                d2 += d * d;
+            }
+            if (d2 <= l.radius * l.radius) addToCluster(c, n);
+        }
+    }
+}
+
+// sphere against four cluster boxes at a time
+void binLights(const vector<PracticalLight> &lights) {
+    fill(clusterCounts.begin(), clusterCounts.end(), 0);
+    f4 zero = f4_set1(0.0f);
+    for (size_t n = 0; n < lights.size(); n++) {
+        const PracticalLight &l = lights[n];
+        int k0, k1;
+        if (!lightSlices(l, k0, k1)) continue;
+        f4 p[3] = {f4_set1(l.pos[0]), f4_set1(l.pos[1]), f4_set1(l.pos[2])};
+        f4 r2 = f4_set1(l.radius * l.radius);
+        for (int c = k0 * CLUSTER_TILES; c < (k1 + 1) * CLUSTER_TILES; c += 4) {
+            f4 d2 = zero;
+            for (int a = 0; a < 3; a++) {
+                f4 lo = f4_load(&clusterLo[a][c]), hi = f4_load(&clusterHi[a][c]);
+                f4 d = f4_max(f4_max(f4_sub(lo, p[a]), f4_sub(p[a], hi)), zero);
+                d2 = f4_add(d2, f4_mul(d, d));
+            }
+            int mask = f4_mask_le(d2, r2);
+            for (int i = 0; i < 4; i++)
+                if (mask >> i & 1) addToCluster(c + i, n);
+        }
+    }
+}
+
+// per-cluster slots to offset/count ranges over one index list
+void compactClusters() {
+    clusterRanges.resize(2 * NUM_CLUSTERS);
+    clusterIndices.clear();
+    for (int c = 0; c < NUM_CLUSTERS; c++) {
+        clusterRanges[2 * c] = clusterIndices.size();
+        clusterRanges[2 * c + 1] = clusterCounts[c];
+        const uint16_t *slots = &clusterSlots[c * MAX_LIGHTS_PER_CLUSTER];
+        clusterIndices.insert(clusterIndices.end(), slots, slots + clusterCounts[c]);
+        clusterMaxCount = max(clusterMaxCount, (int)clusterCounts[c]);
+    }
+}
+
+void spawnExtraLights(int count) {
+    Pcg32 rng = pcgSeed(sceneSeed, 0x11647);
+    extraLights.resize(count);
+    for (int i = 0; i < count; i++) {
+        ExtraLight &e = extraLights[i];
+        PracticalLight &l = e.light;
+        l.pos[0] = roomX1 + 0.3f + pcgFloat(rng) * (roomX2 - roomX1 - 0.6f);
+        l.pos[1] = 0.5f + pcgFloat(rng) * (roomHeight - 1.0f);
+        l.pos[2] = roomZ1 + 0.3f + pcgFloat(rng) * (roomZ2 - roomZ1 - 0.6f);
+        l.radius = 1.0f + pcgFloat(rng) * 1.5f;
+        for (int c = 0; c < 3; c++) l.color[c] = 0.2f + pcgFloat(rng) * 0.6f;
+        // every fourth is a spot pointing down
+        bool spot = i % 4 == 3;
+        l.dir[0] = l.dir[2] = 0.0f;
+        l.dir[1] = -1.0f;
+        l.cosOuter = spot ? cos(35.0f * M_PI / 180.0f) : -2.0f;
+        l.cosInner = spot ? cos(25.0f * M_PI / 180.0f) : -1.0f;
+        e.phase = pcgFloat(rng) * 2.0f * M_PI;
+        e.speed = 0.5f + pcgFloat(rng);
+    }
+}
+
+PracticalLight pointLight(const float pos[3], float radius, float r, float g, float b) {
+    PracticalLight l = {{pos[0], pos[1], pos[2]}, radius, {r, g, b}, -2.0f, {0.0f, -1.0f, 0.0f}, -1.0f};
+    return l;
+}
+
+// where a prop part's origin is this frame, through the first node that draws it
+bool propPartOrigin(SceneProp prop, int part, float world[3]) {
+    for (uint32_t i = 0; i < scene.header->nodeCount; i++) {
+        const SceneNode &n = scene.nodes[i];
+        if (n.kind == NODE_PROP && n.mesh == (uint32_t)prop) {
+            memcpy(world, &transforms[itemTransforms[i] + 1 + part].world[12], 3 * sizeof(float));
+            return true;
+        }
+    }
+    return false;
+}
+
+// the props' lights follow the same switches as their glow materials
+void gatherPracticalLights() {
+    practicalLights.clear();
+    float world[3];
+    if (propPartOrigin(PROP_LAMP, LAMP_SHADE, world)) {
+        PracticalLight lamp = pointLight(world, 2.5f, 1.2f, 1.0f, 0.7f);
+        lamp.cosOuter = cos(55.0f * M_PI / 180.0f); // the drawn light cone
+        lamp.cosInner = cos(35.0f * M_PI / 180.0f);
+        practicalLights.push_back(lamp);
+    }
+    if (whiteGlowOn && propPartOrigin(PROP_FIXTURE, FIXTURE_WHITE, world))
+        practicalLights.push_back(pointLight(world, 3.5f, 0.6f, 0.6f, 0.6f));
+    if (!heelClicking && propPartOrigin(PROP_FIXTURE, FIXTURE_GREEN, world))
+        practicalLights.push_back(pointLight(world, 3.0f, 0.0f, 0.5f, 0.0f));
+    for (size_t i = 0; i < extraLights.size(); i++) {
+        PracticalLight l = extraLights[i].light;
+        l.pos[1] += 0.3f * sin(view.time * extraLights[i].speed + extraLights[i].phase);
+        practicalLights.push_back(l);
+    }
+    if (practicalLights.size() > (size_t)MAX_PRACTICAL_LIGHTS) practicalLights.resize(MAX_PRACTICAL_LIGHTS);
+}
+
+// same transform as the gluLookAt() in drawScene()
+void lightsToView(float eyeX, float eyeY, float eyeZ, float yaw) {
+    float f[3] = {sin(yaw), 0.0f, -cos(yaw)}, r[3] = {cos(yaw), 0.0f, sin(yaw)};
+    viewLights.resize(practicalLights.size());
+    for (size_t i = 0; i < practicalLights.size(); i++) {
+        const PracticalLight &w = practicalLights[i];
+        PracticalLight &v = viewLights[i];
+        v = w;
+        float d[3] = {w.pos[0] - eyeX, w.pos[1] - eyeY, w.pos[2] - eyeZ};
+        v.pos[0] = r[0] * d[0] + r[2] * d[2];
+        v.pos[1] = d[1];
+        v.pos[2] = -(f[0] * d[0] + f[2] * d[2]);
+        v.dir[0] = r[0] * w.dir[0] + r[2] * w.dir[2];
+        v.dir[1] = w.dir[1];
+        v.dir[2] = -(f[0] * w.dir[0] + f[2] * w.dir[2]);
+    }
+}
+
+bool initClusteredLights() {
+    TexBufferProc texBuffer = (TexBufferProc)glProc("glTexBuffer");
+    if (!shaderLighting || !texBuffer) return false;
+    clusterSlots.resize(NUM_CLUSTERS * MAX_LIGHTS_PER_CLUSTER);
+    clusterCounts.resize(NUM_CLUSTERS);
+    spawnExtraLights(numExtraLights);
+    const GLenum formats[3] = {GL_RGBA32F, GL_RG32UI, GL_R16UI};
+    glGenBuffers(3, clusterBuffers);
+    glGenTextures(3, clusterTextures);
+    for (int i = 0; i < 3; i++) {
+        glBindBuffer(GL_TEXTURE_BUFFER, clusterBuffers[i]);
+        glBufferData(GL_TEXTURE_BUFFER, 16, NULL, GL_STREAM_DRAW);
+        glActiveTexture(GL_TEXTURE0 + CLUSTER_TEXTURE_UNIT + i);
+        glBindTexture(GL_TEXTURE_BUFFER, clusterTextures[i]);
+        texBuffer(GL_TEXTURE_BUFFER, formats[i], clusterBuffers[i]);
+    }
+    glActiveTexture(GL_TEXTURE0);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    return true;
+}
+
+// re-specifying the store each frame lets the driver hand out a fresh one
+void uploadClusterBuffer(int i, const void *data, size_t size) {
+    glBindBuffer(GL_TEXTURE_BUFFER, clusterBuffers[i]);
+    glBufferData(GL_TEXTURE_BUFFER, max(size, (size_t)16), NULL, GL_STREAM_DRAW);
+    if (size) glBufferSubData(GL_TEXTURE_BUFFER, 0, size, data);
+}
+
+// before the first lit draw of a frame
+void updateClusteredLights(float eyeX, float eyeY, float eyeZ, float yaw) {
+    if (!clusterBuffers[0]) return;
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    if (clusterGridAspect != viewAspect) buildClusterGrid(viewAspect);
+    gatherPracticalLights();
+    lightsToView(eyeX, eyeY, eyeZ, yaw);
+    binLights(viewLights);
+    compactClusters();
+    clusterBinMsTotal += chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+    uploadClusterBuffer(0, viewLights.data(), viewLights.size() * sizeof(PracticalLight));
+    uploadClusterBuffer(1, clusterRanges.data(), clusterRanges.size() * sizeof(uint32_t));
+    uploadClusterBuffer(2, clusterIndices.data(), clusterIndices.size() * sizeof(uint16_t));
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    clusterFrames++;
+    clusterLightsTotal += viewLights.size();
+    clusterPairsTotal += clusterIndices.size();
+}
+
+// scene nodes
+// Drawn in file order. Static meshes share one buffer binding across
+// consecutive nodes; anything else unbinds it first.
+bool staticDrawBound = false;
+
+void bindStaticDraw(bool on) {
+    if (on == staticDrawBound) return;
+    if (on) beginStaticDraw();
+    else endStaticDraw();
+    staticDrawBound = on;
+}
+
+// green mode lights the nodes flagged green with a green ambient
+void applyGreenAmbient(bool green) {
+    GLfloat normalAmbient[] = {globalAmbientLevel, globalAmbientLevel, globalAmbientLevel, 1.0f};
+    GLfloat greenAmbient[] = {0.2f, 0.5f, 0.2f, 1.0f};
+    stateLightModelAmbient(green ? greenAmbient : normalAmbient);
+}
+
+void applySceneMaterial(const SceneMaterial &m) {
+    stateMaterial(GL_AMBIENT, m.ambient);
+    stateMaterial(GL_DIFFUSE, m.diffuse);
+    stateMaterial(GL_SPECULAR, m.specular);
+    stateMaterial(GL_EMISSION, m.emission);
+    stateMaterialf(GL_SHININESS, m.shininess);
+}
+
+// props place each part under its own world matrix
+void drawSceneProp(uint32_t prop, int id) {
+    switch (prop) {
+    case PROP_SLIPPERS: drawRubySlippers(id); break;
+    case PROP_LAMP: drawLampOnTable(id); break;
+    case PROP_BROOM: drawLeaningBroom(id); break;
+    case PROP_FIXTURE: drawCeilingLightFixture(id); break;
+    case PROP_BUBBLES: drawBubbles(id); break;
+    }
+}
+
+// the node's geometry under its world matrix, with whatever state is current
+void drawNodeShape(const SceneNode &n, int id) {
+    bindStaticDraw(n.kind == NODE_MESH);
+    if (n.kind == NODE_PROP) {
+        drawSceneProp(n.mesh, id);
+        return;
+    }
+    pushTransform(id);
+    switch (n.kind) {
+    case NODE_MESH: drawStaticMesh(*staticMeshes[n.mesh]); break;
+    case NODE_SPHERE: solidSphere(n.params[0], (int)n.params[1], (int)n.params[2]); break;
+    case NODE_CUBE: solidCube(n.params[0]); break;
+    case NODE_TEAPOT: solidTeapot(n.params[0]); break;
+    }
+    glPopMatrix();
+}
+
+// static batch
+// Lit scene nodes that never move (the room shell, the switch, the table,
+// the cube and teapot) are baked at init into one world-space vertex/index
+// arena whose vertices carry their material's slot in the material table.
+// Each frame the visible ones go out in one multi-draw per command group:
+// glMultiDrawElementsIndirect where the GL has it (4.3), glMultiDrawElements
+// otherwise. Adding furniture adds ranges, not draws or material switches.
+// Needs the lighting program; fixed-function lighting draws node by node.
+#ifndef GL_DRAW_INDIRECT_BUFFER
+#  define GL_DRAW_INDIRECT_BUFFER 0x8F3F
+#endif
+
+typedef void (*MultiDrawElementsIndirectProc)(GLenum mode, GLenum type, const void *indirect, GLsizei drawCount,
+                                              GLsizei stride);
+
+struct DrawElementsIndirect {
+    GLuint count, instanceCount, firstIndex, baseVertex, baseInstance;
+};
+
+const GLsizei BATCH_STRIDE = 7 * sizeof(GLfloat); // x,y,z, nx,ny,nz, material slot
+
+MultiDrawElementsIndirectProc pglMultiDrawElementsIndirect = NULL;
+GLuint batchVBO = 0, batchIBO = 0, batchIndirect = 0;
+vector<MeshRange> batchRanges;           // per scene node; count 0 when not batched
+vector<DrawElementsIndirect> batchDraws; // pending ranges
+vector<GLsizei> batchCounts;             // the same, for glMultiDrawElements
+vector<const GLvoid*> batchOffsets;
+long batchCalls = 0, batchedRanges = 0;  // stats
+
+void fillMaterialTable() {
+    for (uint32_t i = 0; i < scene.header->materialCount && i < (uint32_t)MAX_TABLE_MATERIALS; i++) {
+        const SceneMaterial &s = scene.materials[i];
+        MaterialBlock &m = materialTableBlock.materials[i];
+        memcpy(m.ambient, s.ambient, sizeof(m.ambient));
+        memcpy(m.diffuse, s.diffuse, sizeof(m.diffuse));
+        memcpy(m.specular, s.specular, sizeof(m.specular));
+        memcpy(m.emission, s.emission, sizeof(m.emission));
+        m.shininess = s.shininess;
+    }
+    lightingDirty[BLOCK_MATERIAL_TABLE] = true;
+}
+
+// spheres keep their level of detail, and whatever moves, blends, takes the
+// green light or is drawn unlit keeps its own draw
+bool batchable(const SceneNode &n) {
+    const uint32_t ownDraw = NODE_UNLIT | NODE_TEXTURED | NODE_GREEN | NODE_DOOR | NODE_BROOM;
+    return (n.kind == NODE_MESH || n.kind == NODE_CUBE || n.kind == NODE_TEAPOT) && !(n.flags & ownDraw) &&
+           n.material >= 0 && n.material < MAX_TABLE_MATERIALS;
+}
+
+// positions and normals (stride floats apart) under m, out as batch vertices
+void appendBatchVertices(const GLfloat *v, size_t count, int stride, const float m[16], float slot,
+                         vector<GLfloat> &out) {
+    // normals go through the cofactors of the upper 3x3, then get renormalised
+    const float *c0 = m, *c1 = m + 4, *c2 = m + 8;
+    float nm[9] = {c1[1] * c2[2] - c1[2] * c2[1], c1[2] * c2[0] - c1[0] * c2[2], c1[0] * c2[1] - c1[1] * c2[0],
+                   c2[1] * c0[2] - c2[2] * c0[1], c2[2] * c0[0] - c2[0] * c0[2], c2[0] * c0[1] - c2[1] * c0[0],
+                   c0[1] * c1[2] - c0[2] * c1[1], c0[2] * c1[0] - c0[0] * c1[2], c0[0] * c1[1] - c0[1] * c1[0]};
+    for (size_t i = 0; i < count; i++, v += stride) {
+        float p[4] = {v[0], v[1], v[2], 1.0f}, w[4], n[3];
+        mat4Apply(m, p, w);
+        for (int r = 0; r < 3; r++) n[r] = nm[r] * v[3] + nm[3 + r] * v[4] + nm[6 + r] * v[5];
+        float len = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+        GLfloat out7[] = {w[0], w[1], w[2], n[0] / len, n[1] / len, n[2] / len, slot};
+        out.insert(out.end(), out7, out7 + 7);
+    }
+}
+
+// after buildStaticGeometry(); the scene's first copy, at rest
+void buildStaticBatch() {
+    batchRanges.assign(scene.header->nodeCount, MeshRange());
+    if (!shaderLighting) return;
+    pglMultiDrawElementsIndirect = (MultiDrawElementsIndirectProc)glProc("glMultiDrawElementsIndirect");
+    fillMaterialTable();
+    vector<GLfloat> verts;
+    vector<GLuint> indices;
+    const float noOffset[3] = {0.0f, 0.0f, 0.0f};
+    for (uint32_t i = 0; i < scene.header->nodeCount; i++) {
+        const SceneNode &n = scene.nodes[i];
+        if (!batchable(n)) continue;
+        float m[16];
+        nodeTransform(n, noOffset, m);
+        GLuint base = verts.size() / 7;
+        MeshRange &r = batchRanges[i];
+        r.first = indices.size();
+        if (n.kind == NODE_MESH) {
+            // the mesh's index range, renumbered over the vertices it uses
+            const MeshRange &mesh = *staticMeshes[n.mesh];
+            map<GLuint, GLuint> renumber;
+            for (GLsizei k = 0; k < mesh.count; k++) {
+                GLuint v = staticIndices[mesh.first + k];
+                map<GLuint, GLuint>::iterator it = renumber.find(v);
+                if (it == renumber.end()) {
+                    it = renumber.insert(make_pair(v, base + (GLuint)renumber.size())).first;
+                    appendBatchVertices(&staticVerts[v * 8], 1, 8, m, n.material, verts);
+                }
+                indices.push_back(it->second);
+            }
+        }
+        else {
+            // solidCube() and solidTeapot()'s own placement on top of the node's
+            MeshBuilder shape;
+            if (n.kind == NODE_CUBE) {
+                buildCube(shape);
+                mat4Scale(m, n.params[0], n.params[0], n.params[0]);
+            }
+            else {
+                buildTeapot(shape);
+                mat4Rotate(m, 270.0f, 1.0f, 0.0f, 0.0f);
+                mat4Scale(m, 0.5f * n.params[0], 0.5f * n.params[0], 0.5f * n.params[0]);
+                mat4Translate(m, 0.0f, 0.0f, -1.5f);
+            }
+            appendBatchVertices(&shape.verts[0], shape.verts.size() / 6, 6, m, n.material, verts);
+            for (size_t k = 0; k < shape.indices.size(); k++) indices.push_back(base + shape.indices[k]);
+        }
+        r.count = indices.size() - r.first;
+    }
+    if (indices.empty()) return;
+    glGenBuffers(1, &batchVBO);
+    glBindBuffer(GL_ARRAY_BUFFER, batchVBO);
+    glBufferData(GL_ARRAY_BUFFER, verts.size() * sizeof(GLfloat), &verts[0], GL_STATIC_DRAW);
+    glGenBuffers(1, &batchIBO);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, batchIBO);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), &indices[0], GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    if (pglMultiDrawElementsIndirect) glGenBuffers(1, &batchIndirect);
+}
+
+// whether the command's node is drawn from the batch
+bool inStaticBatch(uint32_t node, int transform) {
+    return batchVBO && batchRanges[node].count > 0 && transform == itemTransforms[node];
+}
+
+void queueStaticBatch(uint32_t node) {
+    const MeshRange &r = batchRanges[node];
+    DrawElementsIndirect d = {(GLuint)r.count, 1, r.first, 0, 0};
+    batchDraws.push_back(d);
+    meshTrianglesDrawn += r.count / 3;
+}
+
+// one draw for everything queued since the last flush
+void flushStaticBatch() {
+    if (batchDraws.empty()) return;
+    ProfScope prof(PROF_ROOM);
+    bindStaticDraw(false);
+    stateEnable(GL_LIGHTING);
+    if (greenMode) applyGreenAmbient(false);
+    flushShaderLighting();
+    glBindBuffer(GL_ARRAY_BUFFER, batchVBO);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, batchIBO);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glEnableVertexAttribArray(MATERIAL_ATTRIB);
+    glVertexPointer(3, GL_FLOAT, BATCH_STRIDE, (const GLvoid*)0);
+    glNormalPointer(GL_FLOAT, BATCH_STRIDE, (const GLvoid*)(3 * sizeof(GLfloat)));
+    glVertexAttribPointer(MATERIAL_ATTRIB, 1, GL_FLOAT, GL_FALSE, BATCH_STRIDE, (const GLvoid*)(6 * sizeof(GLfloat)));
+    if (pglMultiDrawElementsIndirect) {
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, batchIndirect);
+        glBufferData(GL_DRAW_INDIRECT_BUFFER, batchDraws.size() * sizeof(DrawElementsIndirect), &batchDraws[0],
+                     GL_STREAM_DRAW);
+        pglMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (const GLvoid*)0, batchDraws.size(), 0);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    }
+    else {
+        batchCounts.clear();
+        batchOffsets.clear();
+        for (size_t k = 0; k < batchDraws.size(); k++) {
+            batchCounts.push_back(batchDraws[k].count);
+            batchOffsets.push_back((const GLvoid*)(batchDraws[k].firstIndex * sizeof(GLuint)));
+        }
+        glMultiDrawElements(GL_TRIANGLES, &batchCounts[0], GL_UNSIGNED_INT, &batchOffsets[0], batchDraws.size());
+    }
+    glDisableVertexAttribArray(MATERIAL_ATTRIB);
+    glVertexAttrib1f(MATERIAL_ATTRIB, -1.0f); // undefined once an array has fed it
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    batchCalls++;
+    batchedRanges += batchDraws.size();
+    batchDraws.clear();
+}
+
+// work-stealing pool
+// Each worker owns a deque of jobs, runs its own from the back and, when it
+// runs dry, steals from the front of the others'. The main thread is worker
+// 0 and works through a batch alongside the threads until it is done. A job
+// is a function over a range of items. The benchmark narrows a batch to
+// fewer workers than were started.
+const int MAX_WORKERS = 64;
+
+struct PoolJob {
+    void (*run)(int worker, int begin, int end);
+    int begin, end;
+};
+
+struct WorkerQueue {
+    mutex lock;
+    deque<PoolJob> jobs;
+};
+
+int poolThreadsWanted = 0; // --threads N, main thread included; 0: one per core
+int poolSize = 1;          // workers started
+int poolActive = 1;        // workers taking part in batches
+WorkerQueue poolQueues[MAX_WORKERS];
+vector<thread> poolThreads;
+atomic<int> poolPending{0};
+atomic<long> poolSteals{0};
+mutex poolWakeLock;
+condition_variable poolWake;
+unsigned poolBatch = 0; // bumped for each batch, under poolWakeLock
+bool poolQuit = false;
+
+bool poolRunOne(int self) {
+    PoolJob job;
+    bool found = false;
+    for (int k = 0; k < poolActive && !found; k++) {
+        WorkerQueue &q = poolQueues[(self + k) % poolActive];
+        lock_guard<mutex> hold(q.lock);
+        if (q.jobs.empty()) continue;
+        if (k == 0) {
+            job = q.jobs.back();
+            q.jobs.pop_back();
+        } else {
+            job = q.jobs.front();
+            q.jobs.pop_front();
+            poolSteals++;
+        }
+        found = true;
+    }
+    if (!found) return false;
+    job.run(self, job.begin, job.end);
+    poolPending--;
+    return true;
+}
+
+void poolWorkerLoop(int self) {
+    unsigned seen = 0;
+    for (;;) {
+        {
+            unique_lock<mutex> hold(poolWakeLock);
+            poolWake.wait(hold, [&] { return poolQuit || poolBatch != seen; });
+            if (poolQuit) return;
+            seen = poolBatch;
+        }
+        if (self >= poolActive) continue;
+        while (poolPending > 0)
+            if (!poolRunOne(self)) this_thread::yield();
+    }
+}
+
+void startPool() {
+    int workers = poolThreadsWanted > 0 ? poolThreadsWanted : (int)thread::hardware_concurrency();
+    poolSize = poolActive = max(1, min(workers, MAX_WORKERS));
+    for (int i = 1; i < poolSize; i++) poolThreads.push_back(thread(poolWorkerLoop, i));
+}
+
+void stopPoolAtExit() {
+    {
+        lock_guard<mutex> hold(poolWakeLock);
+        poolQuit = true;
+    }
+    poolWake.notify_all();
+    for (size_t i = 0; i < poolThreads.size(); i++) poolThreads[i].join();
+    poolThreads.clear();
+}
+
+// jobs of at most grain items each
+void splitJobs(void (*run)(int, int, int), int items, int grain, vector<PoolJob> &jobs) {
+    for (int begin = 0; begin < items; begin += grain) {
+        PoolJob job = {run, begin, min(items, begin + grain)};
+        jobs.push_back(job);
+    }
+}
+
+// Deals the jobs out round robin and returns once all have run. With one
+// worker, or one job, they run right here.
+void poolRun(const vector<PoolJob> &jobs) {
+    if (poolActive == 1 || jobs.size() <= 1) {
+        for (size_t j = 0; j < jobs.size(); j++) jobs[j].run(0, jobs[j].begin, jobs[j].end);
+        return;
+    }
+    poolPending += jobs.size();
+    for (size_t j = 0; j < jobs.size(); j++) {
+        WorkerQueue &q = poolQueues[j % poolActive];
+        lock_guard<mutex> hold(q.lock);
+        q.jobs.push_back(jobs[j]);
+    }
+    {
+        lock_guard<mutex> hold(poolWakeLock);
+        poolBatch++;
+    }
+    poolWake.notify_all();
+    while (poolPending > 0)
+        if (!poolRunOne(0)) this_thread::yield();
+}
+
+// draw command lists
+// Drawing a frame is split in two. Workers walk the scene nodes and, for
+// each one that survives culling, write a compact command (node, material,
+// mesh and the node's place in the transform hierarchy) into their own arena; one job also rolls the
+// sparkle pattern. The main thread then sorts the commands and submits them
+// to GL. The sort keeps the shell ahead of the room interior, where the
+// doorway occlusion query goes, groups the rest by material and mesh, and
+// leaves props, which set their own state and blend, last in file order.
+// Nodes in the static batch sort to the front of their group and go out
+// together in one draw. A command that would draw the same shape, material and world matrix as an
+// earlier one is dropped: it can only repaint the same pixels (the room has
+// two identical tables with their slippers, one of them only for green mode).
+struct DrawCommand {
+    uint64_t key;
+    int node;
+    int transform; // world matrix in transforms, parts after it for a prop
+};
+
+struct CommandArena {
+    vector<DrawCommand> commands;
+    int tested, rejected; // culling counters, folded in on the main thread
+};
+
+CommandArena commandArenas[MAX_WORKERS];
+vector<PoolJob> commandJobs;
+vector<DrawCommand> drawCommands; // this frame's, sorted
+unordered_map<uint64_t, int> drawnShapes; // shape hash to the command that draws it
+long commandsSubmitted = 0, duplicateDraws = 0; // stats
+int commandCopies = 1;            // scene copies, for the benchmark
+uint32_t firstInteriorNode = 0;
+const float COPY_SPACING = 12.0f;
+const int COMMAND_GRAIN = 16;     // nodes per job
+
+void copyOffset(int copy, float offset[3]) {
+    offset[0] = (copy % 16) * COPY_SPACING;
+    offset[1] = 0.0f;
+    offset[2] = -(copy / 16) * COPY_SPACING;
+}
+
+// items are copy * nodeCount + node
+void buildCommands(int worker, int begin, int end) {
+    CommandArena &arena = commandArenas[worker];
+    uint32_t nodes = scene.header->nodeCount;
+    for (int item = begin; item < end; item++) {
+        uint32_t i = item % nodes;
+        const SceneNode &n = scene.nodes[i];
+        if (n.kind == NODE_BOX) continue;
+        float offset[3];
+        copyOffset(item / nodes, offset);
+        Bounds b = sceneNodeBounds(i, view.doorOffset, view.broomOffsetY);
+        for (int a = 0; a < 3; a++) {
+            b.lo[a] += offset[a];
+            b.hi[a] += offset[a];
+        }
+        arena.tested++;
+        bool hidden = frustumRejects(b);
+        if (!hidden && (n.flags & (NODE_INTERIOR | NODE_EXTERIOR))) hidden = portalHides(b, n.flags & NODE_INTERIOR);
+        if (hidden) {
+            arena.rejected++;
+            continue;
+        }
+        DrawCommand c;
+        c.transform = itemTransforms[item];
+        uint64_t group = i < firstInteriorNode ? 0 : 1;
+        if (inStaticBatch(i, c.transform)) c.key = (group << 62) | (uint64_t)item; // ahead of the group's own draws
+        else if (n.kind == NODE_PROP) c.key = (group << 62) | (0xffffULL << 40) | (uint64_t)item;
+        else c.key = (group << 62) | ((uint64_t)(n.material + 1) << 40) | ((uint64_t)n.kind << 36) |
+                     ((uint64_t)(n.mesh & 0xffff) << 20) | (uint64_t)(item & 0xfffff);
+        c.node = i;
+        arena.commands.push_back(c);
+    }
+}
+
+void rollSparkles(int, int, int) {
+    generateSparkles();
+}
+
+// per copy a root at its offset, the nodes under it and the props' parts
+// under them; items are numbered as in buildCommands
+void buildSceneTransforms() {
+    clearTransforms();
+    itemTransforms.clear();
+    const float noOffset[3] = {0.0f, 0.0f, 0.0f};
+    float m[16], parts[MAX_PROP_PARTS][16];
+    for (int copy = 0; copy < commandCopies; copy++) {
+        float offset[3];
+        copyOffset(copy, offset);
+        mat4Identity(m);
+        mat4Translate(m, offset[0], offset[1], offset[2]);
+        int room = addTransform(-1, m);
+        for (uint32_t i = 0; i < scene.header->nodeCount; i++) {
+            const SceneNode &n = scene.nodes[i];
+            nodeTransform(n, noOffset, m);
+            int id = addTransform(room, m);
+            itemTransforms.push_back(id);
+            if (n.kind != NODE_PROP) continue;
+            int count = propParts(n.mesh, parts);
+            for (int p = 0; p < count; p++) addTransform(id, parts[p]);
+        }
+    }
+    transformCopies = commandCopies;
+}
+
+// this frame's pose: the door, the flying broom and the heel click; only
+// what moved is recomputed
+void updateSceneTransforms() {
+    if (transformCopies != commandCopies) buildSceneTransforms();
+    const float noOffset[3] = {0.0f, 0.0f, 0.0f};
+    float m[16], parts[MAX_PROP_PARTS][16];
+    uint32_t nodes = scene.header->nodeCount;
+    for (uint32_t i = 0; i < nodes; i++) {
+        const SceneNode &n = scene.nodes[i];
+        bool posed = n.flags & (NODE_DOOR | NODE_BROOM), slippers = n.kind == NODE_PROP && n.mesh == PROP_SLIPPERS;
+        if (!posed && !slippers) continue;
+        if (posed) nodeTransform(n, noOffset, m);
+        int count = slippers ? propParts(n.mesh, parts) : 0;
+        for (int copy = 0; copy < commandCopies; copy++) {
+            int id = itemTransforms[copy * nodes + i];
+            if (posed) setLocalTransform(id, m);
+            for (int p = 0; p < count; p++) setLocalTransform(id + 1 + p, parts[p]);
+        }
+    }
+    updateTransforms();
+}
+
+bool commandBefore(const DrawCommand &a, const DrawCommand &b) {
+    return a.key < b.key;
+}
+
+// what a command puts on screen, apart from the green ambient
+bool sameDraw(const DrawCommand &a, const DrawCommand &b) {
+    const SceneNode &m = scene.nodes[a.node], &n = scene.nodes[b.node];
+    const uint32_t drawFlags = NODE_UNLIT | NODE_TEXTURED;
+    return m.kind == n.kind && m.mesh == n.mesh && m.material == n.material &&
+           (m.flags & drawFlags) == (n.flags & drawFlags) && memcmp(m.params, n.params, sizeof(m.params)) == 0 &&
+           memcmp(transforms[a.transform].world, transforms[b.transform].world, 16 * sizeof(float)) == 0;
+}
+
+uint64_t drawHash(const DrawCommand &c) {
+    const SceneNode &n = scene.nodes[c.node];
+    uint64_t h = 14695981039346656037ULL; // FNV-1a
+    uint32_t fields[3] = {n.kind, n.mesh, (uint32_t)n.material};
+    const unsigned char *bytes[2] = {(const unsigned char*)fields, (const unsigned char*)transforms[c.transform].world};
+    const size_t sizes[2] = {sizeof(fields), 16 * sizeof(float)};
+    for (int k = 0; k < 2; k++)
+        for (size_t i = 0; i < sizes[k]; i++) h = (h ^ bytes[k][i]) * 1099511628211ULL;
+    return h;
+}
+
+// keeps the first of each set of identical draws, in submission order
+void dropDuplicateDraws() {
+    drawnShapes.clear();
+    size_t kept = 0;
+    for (size_t k = 0; k < drawCommands.size(); k++) {
+        const DrawCommand &c = drawCommands[k];
+        pair<unordered_map<uint64_t, int>::iterator, bool> seen = drawnShapes.insert(make_pair(drawHash(c), (int)kept));
+        if (!seen.second && sameDraw(drawCommands[seen.first->second], c)) {
+            duplicateDraws++;
+            continue;
+        }
+        drawCommands[kept++] = c;
+    }
+    drawCommands.resize(kept);
+    commandsSubmitted += kept;
+}
+
+void initCommandLists() {
+    firstInteriorNode = scene.header->nodeCount;
+    for (uint32_t i = 0; i < scene.header->nodeCount && firstInteriorNode == scene.header->nodeCount; i++)
+        if (scene.nodes[i].flags & NODE_INTERIOR) firstInteriorNode = i;
+}
+
+// fills drawCommands for this frame's view
+void buildCommandLists() {
+    for (int w = 0; w < poolActive; w++) {
+        commandArenas[w].commands.clear();
+        commandArenas[w].tested = commandArenas[w].rejected = 0;
+    }
+    commandJobs.clear();
+    PoolJob sparkles = {rollSparkles, 0, 1};
+    commandJobs.push_back(sparkles);
+    splitJobs(buildCommands, scene.header->nodeCount * commandCopies, COMMAND_GRAIN, commandJobs);
+    poolRun(commandJobs);
+    drawCommands.clear();
+    for (int w = 0; w < poolActive; w++) {
+        drawCommands.insert(drawCommands.end(), commandArenas[w].commands.begin(), commandArenas[w].commands.end());
+        cullTested += commandArenas[w].tested;
+        cullRejected += commandArenas[w].rejected;
+    }
+    sort(drawCommands.begin(), drawCommands.end(), commandBefore);
+    dropDuplicateDraws();
+}
+
+void submitCommand(const DrawCommand &c) {
+    const SceneNode &n = scene.nodes[c.node];
+    ProfScope prof((ProfPhase)n.phase);
+    if (greenMode) applyGreenAmbient(n.flags & NODE_GREEN);
+    const SceneMaterial *m = n.material >= 0 ? &scene.materials[n.material] : NULL;
+    if (n.flags & NODE_UNLIT) {
+        stateDisable(GL_LIGHTING);
+        if (m) glColor4fv(m->diffuse);
+    }
+    else if (m) applySceneMaterial(*m);
+    if (n.flags & NODE_TEXTURED) {
+        stateEnable(GL_TEXTURE_2D);
+        glBindTexture(GL_TEXTURE_2D, texture[0]);
+    }
+    drawNodeShape(n, c.transform);
+
+    if (n.flags & NODE_TEXTURED) stateDisable(GL_TEXTURE_2D);
+    if (n.flags & NODE_UNLIT) stateEnable(GL_LIGHTING);
+}
+
+// shadow maps
+// Lights flagged "shadows" in the scene each get a tile of one depth atlas:
+// an orthographic map around the room for a directional light, a wide
+// downward perspective map for a point light. Casters that never move are
+// drawn once into a cached copy of the atlas. Each frame, where a moving
+// caster (the door, the broom, the slippers) has changed pose since its map
+// was last drawn, the texels under its old and new boxes are restored from
+// the cache and just the moving casters are drawn again, scissored to that
+// rectangle. Light switches from the keyboard throw the cache away. GLSL
+// lighting path only.
+#ifndef GL_FRAMEBUFFER
+#  define GL_FRAMEBUFFER 0x8D40
+#  define GL_READ_FRAMEBUFFER 0x8CA8
+#  define GL_DRAW_FRAMEBUFFER 0x8CA9
+#  define GL_DEPTH_ATTACHMENT 0x8D00
+#  define GL_FRAMEBUFFER_COMPLETE 0x8CD5
+#endif
+#ifndef GL_COMPARE_REF_TO_TEXTURE
+#  define GL_COMPARE_REF_TO_TEXTURE 0x884E
+#endif
+
+typedef void (*GenFramebuffersProc)(GLsizei n, GLuint *framebuffers);
+typedef void (*BindFramebufferProc)(GLenum target, GLuint framebuffer);
+typedef void (*FramebufferTexture2DProc)(GLenum target, GLenum attachment, GLenum textarget, GLuint texture, GLint level);
+typedef GLenum (*CheckFramebufferStatusProc)(GLenum target);
+typedef void (*BlitFramebufferProc)(GLint srcX0, GLint srcY0, GLint srcX1, GLint srcY1, GLint dstX0, GLint dstY0,
+                                    GLint dstX1, GLint dstY1, GLbitfield mask, GLenum filter);
+
+const int SHADOW_TILE = 1024;
+const float SHADOW_SUN_EXTENT = 14.0f;  // half-width of a directional map, around the room
+const float SHADOW_POINT_FOV = 150.0f;
+const float SHADOW_SHELL_THICKNESS = 0.1f; // see drawShellThickness()
+
+struct ShadowMap {
+    int light;                  // index into scene.lights
+    float viewProj[16];         // world to the light's clip space
+    bool valid;                 // false: the cache needs redrawing too
+    vector<float> casterPose;   // per moving caster, as last drawn into this map
+};
+
+struct TexelRect {
+    int x0, y0, x1, y1; // empty when x0 >= x1
+};
+
+bool shadowCacheEnabled = true; // --no-shadow-cache redraws every map in full each frame
+vector<ShadowMap> shadowMaps;
+vector<int> staticCasters, movingCasters; // node indices
+vector<int> shellCasters; // the static ones that are neither indoors nor outdoors
+GLuint shadowAtlas, shadowCache;          // depth textures, the cache holds static casters only
+GLuint shadowFBO[2];                      // [0] draws into the atlas, [1] into the cache
+BindFramebufferProc pglBindFramebuffer;
+BlitFramebufferProc pglBlitFramebuffer;
+long shadowFullRedraws = 0, shadowRegionRedraws = 0, shadowTexelsRedrawn = 0;
+
+// what a moving caster's shadow depends on; NAN for casters that never move
+float casterPose(const SceneNode &n) {
+    if (n.flags & NODE_DOOR) return view.doorOffset;
+    if (n.flags & NODE_BROOM) return view.broomOffsetY;
+    if (n.kind == NODE_PROP && n.mesh == PROP_SLIPPERS) return view.heelOffset;
+    return NAN;
+}
+
+void invalidateShadowMaps() {
+    for (size_t m = 0; m < shadowMaps.size(); m++) shadowMaps[m].valid = false;
+}
+
+// the light's view and projection, read back from the matrix stack
+void buildShadowMatrix(ShadowMap &m) {
+    const SceneLight &l = scene.lights[m.light];
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    glLoadIdentity();
+    if (l.position[3] == 0.0f) {
+        float len = sqrt(l.position[0] * l.position[0] + l.position[1] * l.position[1] + l.position[2] * l.position[2]);
+        float d = 2.0f * SHADOW_SUN_EXTENT / len;
+        float cx = (roomX1 + roomX2) / 2, cy = roomHeight / 2, cz = (roomZ1 + roomZ2) / 2;
+        glOrtho(-SHADOW_SUN_EXTENT, SHADOW_SUN_EXTENT, -SHADOW_SUN_EXTENT, SHADOW_SUN_EXTENT, 0.0f, 4.0f * SHADOW_SUN_EXTENT);
+        gluLookAt(cx + l.position[0] * d, cy + l.position[1] * d, cz + l.position[2] * d, cx, cy, cz, 0.0f, 1.0f, 0.0f);
+    } else {
+        // A ceiling light, looking straight down. One above the room shines
+        // through the ceiling, as it does with fixed-function lighting, so
+        // its map starts just under the ceiling.
+        float x = l.position[0] / l.position[3], y = l.position[1] / l.position[3], z = l.position[2] / l.position[3];
+        float nearZ = max(0.1f, y - roomHeight + 0.05f);
+        gluPerspective(SHADOW_POINT_FOV, 1.0f, nearZ, y + 1.0f);
+        gluLookAt(x, y, z, x, y - 1.0f, z, 0.0f, 0.0f, -1.0f);
+    }
+    glGetFloatv(GL_MODELVIEW_MATRIX, m.viewProj);
+    glPopMatrix();
+}
+
+bool initShadowMaps() {
+    shadowMapsAvailable = false;
+    GenFramebuffersProc genFramebuffers = (GenFramebuffersProc)glProc("glGenFramebuffers");
+    FramebufferTexture2DProc framebufferTexture2D = (FramebufferTexture2DProc)glProc("glFramebufferTexture2D");
+    CheckFramebufferStatusProc checkFramebufferStatus = (CheckFramebufferStatusProc)glProc("glCheckFramebufferStatus");
+    pglBindFramebuffer = (BindFramebufferProc)glProc("glBindFramebuffer");
+    pglBlitFramebuffer = (BlitFramebufferProc)glProc("glBlitFramebuffer");
+    if (!shaderLighting || !genFramebuffers || !framebufferTexture2D || !checkFramebufferStatus ||
+        !pglBindFramebuffer || !pglBlitFramebuffer)
+        return false;
+
+    for (uint32_t i = 0; i < scene.header->lightCount; i++) {
+        if (!(scene.lights[i].flags & LIGHT_SHADOWS)) continue;
+        if (shadowMaps.size() == (size_t)MAX_SHADOW_LIGHTS) {
+            cerr << "warning: only " << MAX_SHADOW_LIGHTS << " lights can cast shadows\n";
+            break;
+        }
+        ShadowMap m = ShadowMap();
+        m.light = i;
+        shadowMaps.push_back(m);
+    }
+    if (shadowMaps.empty()) return false;
+    for (uint32_t i = 0; i < scene.header->nodeCount; i++) {
+        const SceneNode &n = scene.nodes[i];
+        if (!(n.flags & NODE_CASTER) || n.kind == NODE_BOX) continue;
+        if (isnan(casterPose(n))) staticCasters.push_back(i);
+        else movingCasters.push_back(i);
+        if (isnan(casterPose(n)) && !(n.flags & (NODE_INTERIOR | NODE_EXTERIOR))) shellCasters.push_back(i);
+    }
+
+    GLuint textures[2];
+    glGenTextures(2, textures);
+    shadowAtlas = textures[0];
+    shadowCache = textures[1];
+    genFramebuffers(2, shadowFBO);
+    for (int t = 0; t < 2; t++) {
+        glBindTexture(GL_TEXTURE_2D, textures[t]);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, SHADOW_TILE * MAX_SHADOW_LIGHTS, SHADOW_TILE, 0,
+                     GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, t == 0 ? GL_LINEAR : GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, t == 0 ? GL_LINEAR : GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        if (t == 0) {
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+        }
+        pglBindFramebuffer(GL_FRAMEBUFFER, shadowFBO[t]);
+        framebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, textures[t], 0);
+        glDrawBuffer(GL_NONE);
+        glReadBuffer(GL_NONE);
+        if (checkFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            pglBindFramebuffer(GL_FRAMEBUFFER, 0);
+            cerr << "warning: shadow map framebuffer incomplete, no shadows\n";
+            return false;
+        }
+    }
+    pglBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glActiveTexture(GL_TEXTURE0 + SHADOW_TEXTURE_UNIT);
+    glBindTexture(GL_TEXTURE_2D, shadowAtlas);
+    glActiveTexture(GL_TEXTURE0);
+    for (size_t m = 0; m < shadowMaps.size(); m++) buildShadowMatrix(shadowMaps[m]);
+    shadowMapsAvailable = true;
+    return true;
+}
+
+// texels of tile m under a world box, padded for the filter; the whole tile
+// when the box reaches behind a perspective light
+TexelRect shadowRect(int m, const Bounds &b) {
+    TexelRect whole = {m * SHADOW_TILE, 0, (m + 1) * SHADOW_TILE, SHADOW_TILE};
+    float lo[2] = {1.0f, 1.0f}, hi[2] = {-1.0f, -1.0f};
+    for (int c = 0; c < 8; c++) {
+        float p[4] = {c & 1 ? b.hi[0] : b.lo[0], c & 2 ? b.hi[1] : b.lo[1], c & 4 ? b.hi[2] : b.lo[2], 1.0f}, clip[4];
+        mat4Apply(shadowMaps[m].viewProj, p, clip);
+        if (clip[3] <= 1e-4f) return whole;
+        for (int a = 0; a < 2; a++) {
+            lo[a] = min(lo[a], clip[a] / clip[3]);
+            hi[a] = max(hi[a], clip[a] / clip[3]);
+        }
+    }
+    TexelRect r;
+    r.x0 = max(whole.x0, whole.x0 + (int)floor((lo[0] * 0.5f + 0.5f) * SHADOW_TILE) - 2);
+    r.x1 = min(whole.x1, whole.x0 + (int)ceil((hi[0] * 0.5f + 0.5f) * SHADOW_TILE) + 2);
+    r.y0 = max(0, (int)floor((lo[1] * 0.5f + 0.5f) * SHADOW_TILE) - 2);
+    r.y1 = min(SHADOW_TILE, (int)ceil((hi[1] * 0.5f + 0.5f) * SHADOW_TILE) + 2);
+    if (r.x0 >= r.x1 || r.y0 >= r.y1) r.x0 = r.x1 = 0;
+    return r;
+}
+
+TexelRect unionRect(const TexelRect &a, const TexelRect &b) {
+    if (a.x0 >= a.x1) return b;
+    if (b.x0 >= b.x1) return a;
+    TexelRect r = {min(a.x0, b.x0), min(a.y0, b.y0), max(a.x1, b.x1), max(a.y1, b.y1)};
+    return r;
+}
+
+// the first copy's, which is the scene itself
+void drawCasters(const vector<int> &casters) {
+    for (size_t i = 0; i < casters.size(); i++)
+        drawNodeShape(scene.nodes[casters[i]], itemTransforms[casters[i]]);
+}
+
+// The shell's walls and ceiling are single faces. Where a face meets a
+// caster at a seam, it lies within the depth bias of that caster, and sun
+// grazing the seam lights it from inside. A second copy of the shell, grown
+// on every side, gives the maps the thickness a real wall would have. The
+// ceiling light's map starts under the ceiling and sees the shell from
+// inside, so the copy stays behind what it sees.
+void drawShellThickness() {
+    const float t = SHADOW_SHELL_THICKNESS;
+    float cx = (roomX1 + roomX2) / 2, cy = roomHeight / 2, cz = (roomZ1 + roomZ2) / 2;
+    glPushMatrix();
+    glTranslatef(cx, cy, cz);
+    glScalef(1.0f + 2.0f * t / (roomX2 - roomX1), 1.0f + 2.0f * t / roomHeight, 1.0f + 2.0f * t / (roomZ2 - roomZ1));
+    glTranslatef(-cx, -cy, -cz);
+    drawCasters(shellCasters);
+    glPopMatrix();
+}
+
+// statics into the cache, then the cache and the moving casters into the atlas
+void redrawShadowMap(int m, const TexelRect &r, bool full) {
+    glViewport(m * SHADOW_TILE, 0, SHADOW_TILE, SHADOW_TILE);
+    glScissor(r.x0, r.y0, r.x1 - r.x0, r.y1 - r.y0);
+    glLoadMatrixf(shadowMaps[m].viewProj);
+    if (full) {
+        pglBindFramebuffer(GL_FRAMEBUFFER, shadowFBO[1]);
+        glClear(GL_DEPTH_BUFFER_BIT);
+        drawCasters(staticCasters);
+        drawShellThickness();
+    }
+    pglBindFramebuffer(GL_READ_FRAMEBUFFER, shadowFBO[1]);
+    pglBindFramebuffer(GL_DRAW_FRAMEBUFFER, shadowFBO[0]);
+    pglBlitFramebuffer(r.x0, r.y0, r.x1, r.y1, r.x0, r.y0, r.x1, r.y1, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+    pglBindFramebuffer(GL_FRAMEBUFFER, shadowFBO[0]);
+    drawCasters(movingCasters);
+    shadowTexelsRedrawn += (long)(r.x1 - r.x0) * (r.y1 - r.y0);
+}
+
+// before the scene is drawn, with the camera's view on the modelview stack
+void updateShadowMaps() {
+    if (!shadowMapsAvailable) return;
+    ProfScope prof(PROF_SHADOWS);
+    bool drawing = false;
+    GLint viewport[4];
+    for (size_t m = 0; m < shadowMaps.size(); m++) {
+        ShadowMap &map = shadowMaps[m];
+        const SceneLight &l = scene.lights[map.light];
+        GLfloat tile[4] = {(float)m / MAX_SHADOW_LIGHTS, 1.0f / MAX_SHADOW_LIGHTS, (float)l.index,
+                           l.flags & LIGHT_SHADOWED_ONLY ? 2.0f : 1.0f};
+        memcpy(shadowBlock.tile[m], tile, sizeof(tile));
+        // eye space to the tile's [0,1] range: bias * light view-projection * camera to world
+        const float bias[16] = {0.5f, 0, 0, 0, 0, 0.5f, 0, 0, 0, 0, 0.5f, 0, 0.5f, 0.5f, 0.5f, 1.0f};
+        mat4Mul(map.viewProj, cameraToWorld, shadowBlock.eyeToShadow[m]);
+        mat4Mul(bias, shadowBlock.eyeToShadow[m], shadowBlock.eyeToShadow[m]);
+        // a map whose light is off is left as it is; poses are compared when it comes back on
+        if (lightModeBlock.enabled[l.index] == 0.0f) continue;
+
+        bool full = !map.valid || !shadowCacheEnabled;
+        TexelRect dirty = {0, 0, 0, 0};
+        map.casterPose.resize(movingCasters.size(), NAN);
+        for (size_t c = 0; c < movingCasters.size(); c++) {
+            float pose = casterPose(scene.nodes[movingCasters[c]]);
+            if (pose == map.casterPose[c]) continue;
+            if (!isnan(map.casterPose[c]))
+                dirty = unionRect(dirty, shadowRect(m, sceneNodeBounds(movingCasters[c], map.casterPose[c], map.casterPose[c])));
+            dirty = unionRect(dirty, shadowRect(m, sceneNodeBounds(movingCasters[c], pose, pose)));
+            map.casterPose[c] = pose;
+        }
+        if (full) {
+            TexelRect whole = {(int)m * SHADOW_TILE, 0, ((int)m + 1) * SHADOW_TILE, SHADOW_TILE};
+            dirty = whole;
+        }
+        if (dirty.x0 >= dirty.x1) continue;
+
+        if (!drawing) {
+            glGetIntegerv(GL_VIEWPORT, viewport);
+            glMatrixMode(GL_PROJECTION);
+            glPushMatrix();
+            glLoadIdentity();
+            glMatrixMode(GL_MODELVIEW);
+            glPushMatrix();
+            glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+            glEnable(GL_SCISSOR_TEST);
+            glEnable(GL_POLYGON_OFFSET_FILL);
+            glPolygonOffset(2.0f, 4.0f);
+            // lit casters run the lighting program, which must not sample the atlas it is drawing into
+            glActiveTexture(GL_TEXTURE0 + SHADOW_TEXTURE_UNIT);
+            glBindTexture(GL_TEXTURE_2D, 0);
+            glActiveTexture(GL_TEXTURE0);
+            drawing = true;
+        }
+        redrawShadowMap(m, dirty, full);
+        if (full) shadowFullRedraws++;
+        else shadowRegionRedraws++;
+        map.valid = true;
+    }
+    lightingDirty[BLOCK_SHADOWS] = true;
+    if (!drawing) return;
+    pglBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glActiveTexture(GL_TEXTURE0 + SHADOW_TEXTURE_UNIT);
+    glBindTexture(GL_TEXTURE_2D, shadowAtlas);
+    glActiveTexture(GL_TEXTURE0);
+    glDisable(GL_POLYGON_OFFSET_FILL);
+    glDisable(GL_SCISSOR_TEST);
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    glPopMatrix();
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+}
+
+void drawScene() {
+    double cpuAtStart = cpuMsNow();
+    finishTextureLoad(grassLoad, false);
+    view = lerpSimState(simStates[0], simStates[1], renderAlpha);
+    stampInput(LATENCY_RENDERED);
+    sparklesShown = false;
+    profBeginFrame();
+    long issuedAtStart = stateCallsIssued, elidedAtStart = stateCallsElided;
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glLoadIdentity();
+    gluLookAt(camX, camY, camZ, camX + sin(angle), camY, camZ - cos(angle), 0.0f, 1.0f, 0.0f);
+    buildFrustum(camX, camY, camZ, angle);
+    updatePortal(camX, camY, camZ);
+    updateLighting();
+    updateSceneTransforms();
+    updateShadowMaps();
+    updateClusteredLights(camX, camY, camZ, angle);
+
+    buildCommandLists();
+    // the room query goes after the shell and before the first interior node
+    bool roomQueried = false;
+    for (size_t k = 0; k < drawCommands.size(); k++) {
+        const DrawCommand &c = drawCommands[k];
+        if (!roomQueried && (c.key >> 62)) {
+            flushStaticBatch();
+            bindStaticDraw(false);
+            queryRoomInterior();
+            roomQueried = true;
+        }
+        if (inStaticBatch(c.node, c.transform)) {
+            queueStaticBatch(c.node);
+            continue;
+        }
+        flushStaticBatch();
+        submitCommand(c);
+    }
+    flushStaticBatch();
+    bindStaticDraw(false);
+    if (!roomQueried) queryRoomInterior();
+
+    cullTestedTotal += cullTested;
+    cullRejectedTotal += cullRejected;
+    if (cullRejected == cullTested) cullEmptyFrames++;
+
+    frameStateIssued = stateCallsIssued - issuedAtStart;
+    frameStateElided = stateCallsElided - elidedAtStart;
+    drawProfilerOverlay();
+    presentFrame();
+    profEndFrame();
+    if (dirtyFrames > 0) dirtyFrames--;
+    framesDrawn++;
+    drawnCpuMs += cpuMsNow() - cpuAtStart;
+}
+
+// collision
+// Obstacles are boxes filed in a uniform grid over the floor plane, so a
+// move only looks at the boxes in the cells its path crosses. The mover is
+// a sphere stretched down to footY, which lets the table stop a camera whose
+// eye is above it. It is swept against each candidate box grown by its
+// extent (square corners), stops at the first hit and slides along that
+// face with the rest of the move. Moving obstacles are refiled only when
+// they cross a cell boundary.
+const float COLLISION_CELL = 1.0f;
+const float PLAYER_RADIUS = 0.25f;
+
+struct Collider {
+    Bounds box;
+    int cells[4];   // x0, z0, x1, z1 of the cells it is filed under
+    unsigned stamp; // last query that looked at it
+};
+
+struct CollisionWorld {
+    vector<Collider> colliders;
+    unordered_map<uint64_t, vector<int> > grid;
+    unsigned stamp = 0;
+    long queries = 0, boxTests = 0; // stats
+};
+
+CollisionWorld collisionWorld;
+
+// shifted unsigned, as cells left of or behind the origin are negative
+uint64_t cellKey(int cx, int cz) {
+    return ((uint64_t)(uint32_t)cx << 32) | (uint32_t)cz;
+}
+
+void cellRange(const Bounds &b, int cells[4]) {
+    cells[0] = (int)floor(b.lo[0] / COLLISION_CELL);
+    cells[1] = (int)floor(b.lo[2] / COLLISION_CELL);
+    cells[2] = (int)floor(b.hi[0] / COLLISION_CELL);
+    cells[3] = (int)floor(b.hi[2] / COLLISION_CELL);
+}
+
+void fileCollider(CollisionWorld &w, int id, bool add) {
+    const int *c = w.colliders[id].cells;
+    for (int cx = c[0]; cx <= c[2]; cx++) {
+        for (int cz = c[1]; cz <= c[3]; cz++) {
+            vector<int> &cell = w.grid[cellKey(cx, cz)];
+            if (add) {
+                cell.push_back(id);
+                continue;
+            }
+            vector<int>::iterator it = find(cell.begin(), cell.end(), id);
+            if (it != cell.end()) {
+                *it = cell.back();
+                cell.pop_back();
+            }
+        }
+    }
+}
+
+int addCollider(CollisionWorld &w, const Bounds &b) {
+    Collider c;
+    c.box = b;
+    cellRange(b, c.cells);
+    c.stamp = 0;
+    w.colliders.push_back(c);
+    fileCollider(w, w.colliders.size() - 1, true);
+    return w.colliders.size() - 1;
+}
+
+void moveCollider(CollisionWorld &w, int id, const Bounds &b) {
+    Collider &c = w.colliders[id];
+    c.box = b;
+    int cells[4];
+    cellRange(b, cells);
+    if (memcmp(cells, c.cells, sizeof(cells)) == 0) return;
+    fileCollider(w, id, false);
+    memcpy(c.cells, cells, sizeof(cells));
+    fileCollider(w, id, true);
+}
+
+// Slab test of the ray o + t*d, t in [0, 1], against a box. A ray that starts
+// inside (say caught by a closing door) hits at t = 0 on the nearest face
+// unless it heads out through that face or along it, so the move slides out
+// or stops rather than going deeper.
+bool rayHitsBox(const float o[3], const float d[3], const float lo[3], const float hi[3],
+                float &tHit, float normal[3]) {
+    int nearAxis = -1;
+    float nearDist = 0.0f, nearSide = 0.0f;
+    for (int a = 0; a < 3; a++) {
+        if (o[a] <= lo[a] || o[a] >= hi[a]) {
+            nearAxis = -1;
+            break;
+        }
+        float dist = min(o[a] - lo[a], hi[a] - o[a]);
+        if (nearAxis < 0 || dist < nearDist) {
+            nearAxis = a;
+            nearDist = dist;
+            nearSide = o[a] - lo[a] < hi[a] - o[a] ? -1.0f : 1.0f;
+        }
+    }
+    if (nearAxis >= 0) {
+        if (d[nearAxis] * nearSide >= 0.0f) return false;
+        normal[0] = normal[1] = normal[2] = 0.0f;
+        normal[nearAxis] = nearSide;
+        tHit = 0.0f;
+        return true;
+    }
+
+    float tEnter = -1.0f, tExit = 1.0f;
+    int axis = -1;
+    for (int a = 0; a < 3; a++) {
+        if (fabs(d[a]) < 1e-8f) {
+            if (o[a] <= lo[a] || o[a] >= hi[a]) return false;
+            continue;
+        }
+        float t0 = (lo[a] - o[a]) / d[a], t1 = (hi[a] - o[a]) / d[a];
+        if (t0 > t1) swap(t0, t1);
+        if (t0 > tEnter) {
+            tEnter = t0;
+            axis = a;
+        }
+        tExit = min(tExit, t1);
+        if (tEnter > tExit) return false;
+    }
+    if (axis < 0 || tEnter < 0.0f || tEnter > 1.0f) return false;
+    normal[0] = normal[1] = normal[2] = 0.0f;
+    normal[axis] = d[axis] > 0.0f ? -1.0f : 1.0f;
+    tHit = tEnter;
+    return true;
+}
+
+void testCollider(CollisionWorld &w, int id, const float pos[3], const float d[3], float radius, float footY,
+                  float &tFirst, float normal[3]) {
+    const Bounds &b = w.colliders[id].box;
+    float lo[3] = {b.lo[0] - radius, b.lo[1] - radius, b.lo[2] - radius};
+    float hi[3] = {b.hi[0] + radius, b.hi[1] + (pos[1] - footY), b.hi[2] + radius};
+    float t, n[3];
+    w.boxTests++;
+    if (rayHitsBox(pos, d, lo, hi, t, n) && t < tFirst) {
+        tFirst = t;
+        memcpy(normal, n, sizeof(n));
+    }
+}
+
+// Fraction of d the mover covers before its first hit (1 if none). The
+// brute-force path tests every collider and exists for the benchmark.
+float sweepSphere(CollisionWorld &w, const float pos[3], const float d[3], float radius, float footY,
+                  float normal[3], bool useGrid = true) {
+    w.queries++;
+    float tFirst = 1.0f;
+    if (!useGrid) {
+        for (size_t i = 0; i < w.colliders.size(); i++) testCollider(w, i, pos, d, radius, footY, tFirst, normal);
+        return tFirst;
+    }
+    Bounds path = makeBounds(min(pos[0], pos[0] + d[0]) - radius, 0.0f, min(pos[2], pos[2] + d[2]) - radius,
+                             max(pos[0], pos[0] + d[0]) + radius, 0.0f, max(pos[2], pos[2] + d[2]) + radius);
+    int cells[4];
+    cellRange(path, cells);
+    w.stamp++;
+    for (int cx = cells[0]; cx <= cells[2]; cx++) {
+        for (int cz = cells[1]; cz <= cells[3]; cz++) {
+            unordered_map<uint64_t, vector<int> >::const_iterator it = w.grid.find(cellKey(cx, cz));
+            if (it == w.grid.end()) continue;
+            for (size_t i = 0; i < it->second.size(); i++) {
+                int id = it->second[i];
+                if (w.colliders[id].stamp == w.stamp) continue; // already seen in another cell
+                w.colliders[id].stamp = w.stamp;
+                testCollider(w, id, pos, d, radius, footY, tFirst, normal);
+            }
+        }
+    }
+    return tFirst;
+}
+
+// move pos by delta, sliding along up to three surfaces
+void slideSphere(CollisionWorld &w, float pos[3], const float delta[3], float radius, float footY,
+                 bool useGrid = true) {
+    const float skin = 0.001f;
+    float d[3] = {delta[0], delta[1], delta[2]};
+    for (int iter = 0; iter < 3; iter++) {
+        float len = sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+        if (len < 1e-6f) return;
+        float n[3];
+        float t = sweepSphere(w, pos, d, radius, footY, n, useGrid);
+        if (t >= 1.0f) {
+            for (int a = 0; a < 3; a++) pos[a] += d[a];
+            return;
+        }
+        float move = max(0.0f, t - skin / len);
+        for (int a = 0; a < 3; a++) {
+            pos[a] += d[a] * move;
+            d[a] *= 1.0f - move;
+        }
+        float into = d[0] * n[0] + d[1] * n[1] + d[2] * n[2];
+        for (int a = 0; a < 3; a++) d[a] -= n[a] * into;
+    }
+}
+
+// Colliders come from the scene's collider nodes. The front wall is given
+// as boxes around the doorway so it stays open; the floor, ceiling and
+// anything out of reach overhead are left out.
+void buildColliders() {
+    for (uint32_t i = 0; i < scene.header->nodeCount; i++) {
+        if (scene.nodes[i].flags & NODE_COLLIDER)
+            scene.colliders[i] = addCollider(collisionWorld, sceneNodeBounds(i, doorOffset, broomOffsetY));
+    }
+}
+
+void updateMovingColliders() {
+    for (uint32_t i = 0; i < scene.header->nodeCount; i++) {
+        if (scene.colliders[i] >= 0 && (scene.nodes[i].flags & (NODE_DOOR | NODE_BROOM)))
+            moveCollider(collisionWorld, scene.colliders[i], sceneNodeBounds(i, doorOffset, broomOffsetY));
+    }
+}
+
+//movement
+void moveCamera(int key) {
+    float newX = camX;
+    float newZ = camZ;
+    
+    if (key == GLUT_KEY_LEFT) angle -= turnSpeed;
+    if (key == GLUT_KEY_RIGHT) angle += turnSpeed;
+    if (key == GLUT_KEY_UP) {
+        newX += moveSpeed * sin(angle);
+        newZ -= moveSpeed * cos(angle);
+    }
+    if (key == GLUT_KEY_DOWN) {
+        newX -= moveSpeed * sin(angle);
+        newZ += moveSpeed * cos(angle);
+    }
+    
+    float pos[3] = {camX, camY, camZ};
+    float delta[3] = {newX - camX, 0.0f, newZ - camZ};
+    slideSphere(collisionWorld, pos, delta, PLAYER_RADIUS, 0.0f);
+    camX = pos[0];
+    camZ = pos[2];
+    markDirty();
+}
+void mouseClick(int button, int state, int x, int y) {
 
-    if (key == 'b') {
-        if (!broomFlying && broomOffsetY == 0.0f) {
-            broomFlying = true;
-            broomDir = 1.0f;
         }
+
+void handleKey(unsigned char key) {
+    markDirty();
+    playClips(key);
+    // light switches change what the shadow maps should hold
+    if (key == 'g' || key == 'l') invalidateShadowMaps();
+    if (key == 'g') {
+        greenMode = !greenMode;
+        whiteGlowOn = !whiteGlowOn;
+        greenLightOn = greenMode;
     }
+
     if (key == 'l') ceilingLightOn = !ceilingLightOn;
     if (key == 'r') {
         heelClicking = !heelClicking;
         bubblesActive = heelClicking;
     }
 
+    if (key == 'p') {
+        setProfilerEnabled(!profilerEnabled);
+        profilerOverlay = profilerEnabled;
+    }
+
     if (key == 'a') {
        globalAmbientLevel += 0.25f;
        if (globalAmbientLevel > 1.0f) globalAmbientLevel = 1.0f;
@@ -759,114 +5097,278 @@ void keyboard(unsigned char key, int, int) {
        globalAmbientLevel -= 0.25f;
        if (globalAmbientLevel < 0.0f) globalAmbientLevel = 0.0f;
     }
-    glutPostRedisplay();
 }
-void update(int value) {
-    if (doorOpening && doorOffset < maxDoorSlide) {
-        doorOffset += 0.1f;
-        if (doorOffset >= maxDoorSlide) {
-            doorOffset = maxDoorSlide;
-            doorOpening = false;
+
+// Whether the next frame can differ from the last one drawn. Time alone
+// moves the bubbles, the extra lights and any sparkles on screen; frames
+// between two ticks with different poses are blends of the two.
+bool sceneAnimating() {
+    const SimState &a = simStates[0], &b = simStates[1];
+    if (a.doorOffset != b.doorOffset || a.heelOffset != b.heelOffset || a.broomOffsetY != b.broomOffsetY) return true;
+    if (bubblesActive || !extraLights.empty() || profilerOverlay) return true;
+    return sparklesShown && (long)floor(simTime * sparkleHz) != sparkleGeneration;
+}
+
+// one 16 ms animation tick
+void stepAnimation() {
+    ProfScope prof(PROF_UPDATE);
+    simTime += TICK_SECONDS;
+    evaluateAnimator(sceneAnimator, simTime);
+    applySceneAnimation();
+    if (bubblesActive) integrateParticles(bubbles, 1.0f);
+    updateMovingColliders();
+
+    simStates[0] = simStates[1];
+    simStates[1] = captureSimState();
+}
+
+// simulation clock
+// Ticks are fixed at TICK_SECONDS of simulated time however long frames take.
+// Elapsed real time accumulates; each frame runs as many whole ticks as fit,
+// at most MAX_CATCHUP_TICKS so a long stall does not snowball, and the
+// remainder becomes renderAlpha.
+const int MAX_CATCHUP_TICKS = 8;
+double simAccumulator = 0.0;
+long simTicksRun = 0, simTicksDropped = 0;
+chrono::steady_clock::time_point simClockLast;
+
+void advanceSimulation(double seconds) {
+    simAccumulator += seconds;
+    int ticks = 0;
+    while (simAccumulator >= TICK_SECONDS) {
+        if (ticks == MAX_CATCHUP_TICKS) {
+            long behind = (long)(simAccumulator / TICK_SECONDS);
+            simTicksDropped += behind;
+            simAccumulator -= behind * (double)TICK_SECONDS;
+            break;
         }
+        stepAnimation();
+        simAccumulator -= TICK_SECONDS;
+        ticks++;
     }
-    if (doorClosing && doorOffset > 0.0f) {
-        doorOffset -= 0.1f;
-        if (doorOffset <= 0.0f) {
-            doorOffset = 0.0f;
-            doorClosing = false;
-        }
+    simTicksRun += ticks;
+    renderAlpha = simAccumulator / TICK_SECONDS;
+}
+
+// input recording
+// --record FILE logs each key and arrow press of a windowed session with the
+// number of ticks simulated before it, plus the seed. --replay FILE feeds
+// them back on a fixed clock of one tick per frame, windowed or headless, so
+// the same session can be timed against another build. The file is a
+// header followed by the events.
+const uint32_t RECORDING_MAGIC = 0x45525a4f; // "OZRE"
+const uint32_t RECORDING_VERSION = 1;
+
+struct RecordingHeader {
+    uint32_t magic, version;
+    uint64_t seed;
+    uint32_t eventCount;
+    uint32_t ticks; // length of the session
+};
+
+struct InputEvent {
+    uint32_t tick;
+    uint16_t kind; // InputKind
+    uint16_t key;  // ASCII, or GLUT_KEY_* for arrows
+};
+
+string recordPath;
+vector<InputEvent> recordedEvents;
+MappedFile replayFile;
+const RecordingHeader *replayHeader = NULL; // set while replaying
+const InputEvent *replayEvents = NULL;
+uint32_t replayNext = 0;
+chrono::steady_clock::time_point replayStart;
+
+void recordInput(InputKind kind, int key) {
+    if (recordPath.empty()) return;
+    InputEvent e = {(uint32_t)simTicksRun, (uint16_t)kind, (uint16_t)key};
+    recordedEvents.push_back(e);
+}
+
+void writeRecordingAtExit() {
+    if (recordPath.empty()) return;
+    RecordingHeader h = {RECORDING_MAGIC, RECORDING_VERSION, sceneSeed, (uint32_t)recordedEvents.size(),
+                         (uint32_t)simTicksRun};
+    vector<unsigned char> image((const unsigned char*)&h, (const unsigned char*)(&h + 1));
+    const unsigned char *events = (const unsigned char*)recordedEvents.data();
+    image.insert(image.end(), events, events + recordedEvents.size() * sizeof(InputEvent));
+    if (!writeFileAtomically(recordPath, image.data(), image.size()))
+        cerr << "error: cannot write " << recordPath << "\n";
+    else
+        cout << "recorded " << h.eventCount << " events over " << h.ticks << " ticks to " << recordPath << "\n";
+}
+
+// maps a recording and takes its seed
+bool openRecording(const string &path) {
+    if (!mapFile(path, replayFile)) {
+        cerr << "error: cannot map recording " << path << "\n";
+        return false;
     }
-    glutPostRedisplay();
-    glutTimerFunc(16, update, 0);
-    
-    if (heelClicking) {
-        heelOffset += heelDir * 0.01f;
-        if (heelOffset > 0.1f || heelOffset < -0.1f) {
-            heelDir = -heelDir;
-        }
+    const RecordingHeader *h = (const RecordingHeader*)replayFile.data;
+    const char *problem = NULL;
+    if (replayFile.size < sizeof(RecordingHeader)) problem = "truncated header";
+    else if (h->magic != RECORDING_MAGIC) problem = "not a recording";
+    else if (h->version != RECORDING_VERSION) problem = "unsupported version";
+    else if (replayFile.size != sizeof(RecordingHeader) + (size_t)h->eventCount * sizeof(InputEvent))
+        problem = "size does not match the event count";
+    if (problem) {
+        unmapFile(replayFile);
+        cerr << "error: " << path << ": " << problem << "\n";
+        return false;
     }
-    
-    if (broomFlying) {
-        broomOffsetY += broomDir * 0.01f;
-        if (broomOffsetY > 1.0f) broomDir = -1.0f;
-        if (broomOffsetY < 0.0f) {
-            broomDir = 1.0f;
-            broomOffsetY = 0.0f;
-            broomFlying = false;
-        }
+    replayHeader = h;
+    replayEvents = (const InputEvent*)(h + 1);
+    sceneSeed = h->seed;
+    return true;
+}
+
+// applies the events due before the next tick; false once the session is over
+bool feedReplay() {
+    while (replayNext < replayHeader->eventCount && replayEvents[replayNext].tick <= simTicksRun) {
+        const InputEvent &e = replayEvents[replayNext++];
+        queueInput((InputKind)e.kind, e.key);
     }
-    
-    if (bubblesActive) {
-        for (int i = 0; i < NUM_BUBBLES; i++) {
-            bubbleY[i] += bubbleSpeed[i];
-            if (bubbleY[i] > 5.0f) bubbleY[i] = 0.5f;
-        }
+    return simTicksRun < replayHeader->ticks;
+}
+
+// applies and records everything queued since the last frame
+void drainInput() {
+    for (size_t i = 0; i < inputQueue.size(); i++) {
+        const QueuedInput &e = inputQueue[i];
+        recordInput(e.kind, e.key);
+        if (e.kind == INPUT_ARROW) moveCamera(e.key);
+        else handleKey((unsigned char)e.key);
+        InputTrace t = {e.arrived, LATENCY_DRAINED};
+        inputInFlight.push_back(t);
+    }
+    inputQueue.clear();
+    stampInput(LATENCY_DRAINED);
+}
+
+// the frame's update: queued input first, then the ticks that are due
+void simulateFrame(double seconds) {
+    drainInput();
+    advanceSimulation(seconds);
+    stampInput(LATENCY_SIMULATED);
+}
+
+void printInputLatencyAtExit() {
+    const LatencyHistogram &h = inputLatency[LATENCY_PRESENTED];
+    if (headlessMode || h.samples.empty()) return;
+    vector<double> sorted = h.samples;
+    sort(sorted.begin(), sorted.end());
+    printf("input to present: %zu events, median %.1f ms, p99 %.1f ms, max %.1f ms\n", sorted.size(),
+           percentile(sorted, 0.5), percentile(sorted, 0.99), sorted.back());
+}
+
+// GLUT callbacks
+// Nothing here touches GL; idle() drains the queue straight away.
+void handleArrowKeys(int key, int, int) {
+    queueInput(INPUT_ARROW, key);
+}
+
+void keyboard(unsigned char key, int, int) {
+    queueInput(INPUT_KEY, (unsigned char)key);
+}
+
+// windowed replay: one tick per frame however long frames take, then exit
+void replayIdle() {
+    if (!feedReplay()) {
+        double sec = chrono::duration<double>(chrono::steady_clock::now() - replayStart).count();
+        printf("replayed %u ticks in %.2f s (%.3f ms per tick)\n", replayHeader->ticks, sec,
+               1000.0 * sec / max(1u, replayHeader->ticks));
+        exit(0);
     }
+    simulateFrame(TICK_SECONDS);
+    if (sceneAnimating()) markDirty();
+    if (frameDirty()) glutPostRedisplay();
+    else framesSkipped++;
+}
+
+// Windowed: simulate up to now and draw again as soon as GLUT is idle, or,
+// when nothing has changed, skip the frame and sleep until the next tick,
+// in slices of at most INPUT_POLL_SECONDS so a key is not left waiting.
+const double INPUT_POLL_SECONDS = 0.002;
+long skippedTick = -1; // tick of the last frame counted as skipped
+
+void idle() {
+    if (replayHeader) {
+        replayIdle();
+        return;
+    }
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    simulateFrame(chrono::duration<double>(now - simClockLast).count());
+    simClockLast = now;
+    if (sceneAnimating() || (grassLoad.done && !grassLoad.uploaded)) markDirty();
+    if (frameDirty()) {
+        glutPostRedisplay();
+        return;
+    }
+    // one skipped frame per tick, however many slices it was slept in
+    if (simTicksRun != skippedTick) framesSkipped++;
+    skippedTick = simTicksRun;
+    this_thread::sleep_for(chrono::duration<double>(min(INPUT_POLL_SECONDS, TICK_SECONDS - simAccumulator)));
+}
+
+// CPU a skipped frame would have cost, at the average of the drawn ones
+double skippedCpuMs() {
+    return framesDrawn ? framesSkipped * drawnCpuMs / framesDrawn : 0.0;
+}
 
+void printDamageStatsAtExit() {
+    if (headlessMode || !framesDrawn) return;
+    long frames = framesDrawn + framesSkipped;
+    printf("frames drawn %ld, skipped %ld (%.1f%%), about %.1f s of CPU saved\n", framesDrawn, framesSkipped,
+           100.0 * framesSkipped / frames, skippedCpuMs() / 1000.0);
 }
 
+double initMs = 0.0;
+
 void init() {
-    glEnable(GL_DEPTH_TEST);
-    glEnable(GL_LIGHTING);
-    glEnable(GL_LIGHT0);
-    glEnable(GL_NORMALIZE);
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    invalidateStateCache();
+    initShaderLighting();
+    initInstancing();
+    initClusteredLights();
+    initShadowMaps();
+    initCommandLists();
+    startPool();
+    stateEnable(GL_DEPTH_TEST);
+    stateEnable(GL_LIGHTING);
+    stateEnable(GL_NORMALIZE);
     //glEnable(GL_COLOR_MATERIAL);
- 
-    GLfloat lightPos[] = {0.0f, 5.0f, 10.0f, 1.0f};
-    GLfloat ambientLight[] = {0.3f, 0.3f, 0.3f, 1.0f};
-    GLfloat diffuseLight[] = {1.0f, 1.0f, 1.0f, 1.0f};
-    glLightfv(GL_LIGHT0, GL_POSITION, lightPos);
-    glLightfv(GL_LIGHT0, GL_AMBIENT, ambientLight);
-    glLightfv(GL_LIGHT0, GL_DIFFUSE, diffuseLight);
+    initProfiler();
+
+    applySceneLights();
     glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
     glClearColor(0.6f, 0.85f, 1.0f, 1.0f);
     glGenTextures(1, texture);
     
     GLfloat ambient[] = {globalAmbientLevel, globalAmbientLevel, globalAmbientLevel, 1.0f};
-    glLightModelfv(GL_LIGHT_MODEL_AMBIENT, ambient);
-
-    GLfloat ceilingPos[] = {0.0f, 10.0f, -5.0f, 1.0f};
-
-    GLfloat whiteDiffuse[]  = {1.0f, 1.0f, 1.0f, 1.0f};
-    GLfloat whiteSpecular[] = {1.0f, 1.0f, 1.0f, 1.0f};
-    GLfloat whiteAmbient[]  = {0.2f, 0.2f, 0.2f, 1.0f};
-    
-    GLfloat greenLightDiffuse[] = {0.2f, 0.6f, 0.2f, 1.0f};
-    GLfloat greenLightAmbient[] = {0.1f, 0.4f, 0.1f, 1.0f};
-    GLfloat greenLightPos[]     = {0.0f, 5.0f, -5.0f, 1.0f};
-
-    glLightfv(GL_LIGHT3, GL_POSITION, greenLightPos);
-    glLightfv(GL_LIGHT3, GL_DIFFUSE, greenLightDiffuse);
-    glLightfv(GL_LIGHT3, GL_AMBIENT, greenLightAmbient);
-    glLightfv(GL_LIGHT3, GL_SPECULAR, greenLightDiffuse);
-    glEnable(GL_LIGHT3);
-
-    glLightfv(GL_LIGHT1, GL_POSITION, ceilingPos);
-    glLightfv(GL_LIGHT1, GL_AMBIENT, whiteAmbient);
-    glLightfv(GL_LIGHT1, GL_DIFFUSE, whiteDiffuse);
-    glLightfv(GL_LIGHT1, GL_SPECULAR, whiteSpecular);
-
-    glEnable(GL_LIGHT1);
-    glClearColor(0.6f, 0.85f, 1.0f, 1.0f);
-    
-    spotlightCone = gluNewQuadric();
-    
-    loadGrassTexture();
-    for (int i = 0; i < NUM_BUBBLES; i++) {
-        bubbleX[i] = ((rand() % 100) / 10.0f) - 5.0f;   // between -5 and 5
-        bubbleY[i] = 0.5f + ((rand() % 50) / 10.0f);     // between 0.5 and 5.5
-        bubbleZ[i] = -8.0f + ((rand() % 100) / 20.0f);   // between -10 and 0
-        bubbleSpeed[i] = 0.005f + ((rand() % 10) / 1000.0f);
-    }
+    stateLightModelAmbient(ambient);
 
+    startTextureLoad(grassLoad, "Textures/grass.bmp", texture[0]);
+    buildStaticGeometry();
+    placeSceneNodes();
+    buildStaticBatch();
+    initSceneAnimation();
+    buildColliders();
+    spawnBubbles(bubbles, numBubbles);
+    buildSpriteTexture();
+    simStates[0] = simStates[1] = view = captureSimState();
+    initMs = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
 }
 void reshape(int w, int h) {
+    markDirty();
     if (h == 0) h = 1;
-    float aspect = (float)w / h;
+    viewportHeight = h;
+    viewAspect = (float)w / h;
     glViewport(0, 0, w, h);
+    shaderViewport(w, h);
     glMatrixMode(GL_PROJECTION);
     glLoadIdentity();
-    gluPerspective(60.0, aspect, 1.0, 100.0);
+    gluPerspective(FOVY, viewAspect, Z_NEAR, Z_FAR);
     glMatrixMode(GL_MODELVIEW);
     glLoadIdentity();
 }
@@ -881,11 +5383,921 @@ void interaction() {
     cout << "b - Make Broom Fly (bobs up and down)\n";
     cout << "a - Increase Ambient Light\n";
     cout << "Shift + A - Decrease Ambient Light\n";
+    cout << "p - Toggle Profiler Overlay\n";
     cout << "Arrow Keys - Move and Turn Camera\n";
     cout << "===============================\n";
 }
 
+// headless benchmark
+bool scriptStill = false; // the script moves nothing (--still)
+
+struct RunOptions {
+    bool headless = false;
+    int frames = 300;
+    int width = 800, height = 600;
+    string outPath;
+    bool profile = false;
+    string tracePath;
+    bool benchParticles = false;
+    bool benchCollision = false;
+    bool benchTransforms = false;
+    bool benchAnimation = false;
+    bool benchLights = false;
+    bool benchCommands = false;
+    double frameDt = TICK_SECONDS; // simulated seconds between headless frames
+    string convertIn, convertOut;
+    string replayPath;
+    bool check = false, checkRecord = false;
+    string checkDir; // empty for the committed references
+};
+
+bool parseArgs(int argc, char** argv, RunOptions &opt) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--headless") opt.headless = true;
+        else if (arg == "--frames" && hasValue) opt.frames = atoi(argv[++i]);
+        else if (arg == "--size" && hasValue) {
+            if (sscanf(argv[++i], "%dx%d", &opt.width, &opt.height) != 2) return false;
+        }
+        else if (arg == "--out" && hasValue) opt.outPath = argv[++i];
+        else if (arg == "--profile") opt.profile = true;
+        else if (arg == "--bubbles" && hasValue) numBubbles = max(0, atoi(argv[++i]));
+        else if (arg == "--bench-particles") opt.benchParticles = opt.headless = true;
+        else if (arg == "--bench-collision") opt.benchCollision = true;
+        else if (arg == "--bench-transforms") opt.benchTransforms = true;
+        else if (arg == "--bench-animation") opt.benchAnimation = true;
+        else if (arg == "--bench-lights") opt.benchLights = opt.headless = true;
+        else if (arg == "--lights" && hasValue) numExtraLights = max(0, min(MAX_PRACTICAL_LIGHTS - 3, atoi(argv[++i])));
+        else if (arg == "--sparkles" && hasValue) sparklesPerShoe = max(0, atoi(argv[++i]));
+        else if (arg == "--sparkle-hz" && hasValue) sparkleHz = max(0.0, atof(argv[++i]));
+        else if (arg == "--seed" && hasValue) sceneSeed = strtoull(argv[++i], NULL, 10);
+        else if (arg == "--no-lod") lodEnabled = false;
+        else if (arg == "--no-cull") cullingEnabled = false;
+        else if (arg == "--no-portal") portalCullingEnabled = false;
+        else if (arg == "--frame-dt" && hasValue) opt.frameDt = atof(argv[++i]);
+        else if (arg == "--scene" && hasValue) scenePath = argv[++i];
+        else if (arg == "--fixed-function") shaderLightingAllowed = false;
+        else if (arg == "--no-shadow-cache") shadowCacheEnabled = false;
+        else if (arg == "--no-damage") damageTracking = false;
+        else if (arg == "--still") scriptStill = true;
+        else if (arg == "--threads" && hasValue) poolThreadsWanted = max(1, atoi(argv[++i]));
+        else if (arg == "--bench-commands") opt.benchCommands = opt.headless = true;
+        else if (arg == "--record" && hasValue) recordPath = argv[++i];
+        else if (arg == "--replay" && hasValue) opt.replayPath = argv[++i];
+        else if (arg == "--check" || arg == "--check-record") {
+            opt.check = true;
+            opt.checkRecord = arg == "--check-record";
+            if (hasValue && argv[i + 1][0] != '-') opt.checkDir = argv[++i];
+        }
+        else if (arg == "--convert-scene" && i + 2 < argc) {
+            opt.convertIn = argv[++i];
+            opt.convertOut = argv[++i];
+        }
+        else if (arg == "--trace" && hasValue) {
+            opt.profile = true;
+            opt.tracePath = argv[++i];
+        }
+        else if (arg.compare(0, 2, "--") == 0) return false;
+        // anything else is left for glutInit (-display, -geometry, ...)
+    }
+    return opt.frames > 0 && opt.width > 0 && opt.height > 0 && opt.frameDt >= 0.0;
+}
+
+#ifndef __APPLE__
+EGLDisplay eglDpy = EGL_NO_DISPLAY;
+
+// Offscreen GL context on a pbuffer. Prefers Mesa's surfaceless platform so
+// no X server or GPU is needed (llvmpipe).
+bool createHeadlessContext(int width, int height) {
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay)
+        eglDpy = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if (eglDpy == EGL_NO_DISPLAY) eglDpy = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    EGLint major, minor;
+    if (eglDpy == EGL_NO_DISPLAY || !eglInitialize(eglDpy, &major, &minor)) return false;
+
+    const EGLint configAttribs[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8,
+        EGL_DEPTH_SIZE, 24,
+        EGL_NONE
+    };
+    EGLConfig config;
+    EGLint numConfigs = 0;
+    if (!eglChooseConfig(eglDpy, configAttribs, &config, 1, &numConfigs) || numConfigs < 1) return false;
+    const EGLint pbufferAttribs[] = {EGL_WIDTH, width, EGL_HEIGHT, height, EGL_NONE};
+    EGLSurface surface = eglCreatePbufferSurface(eglDpy, config, pbufferAttribs);
+    if (surface == EGL_NO_SURFACE) return false;
+    eglBindAPI(EGL_OPENGL_API);
+    EGLContext context = eglCreateContext(eglDpy, config, EGL_NO_CONTEXT, NULL);
+    if (context == EGL_NO_CONTEXT) return false;
+    return eglMakeCurrent(eglDpy, surface, surface, context);
+}
+#else
+bool createHeadlessContext(int, int) {
+    return false; // no EGL on macOS
+}
+#endif
+
+// Scripted fly-through: approach the house, walk through the door, then
+// turn around once inside. Scene events fire at fixed fractions of the run.
+// scriptStill leaves the camera at the starting pose outside and the scene
+// untouched: an idle session.
+void scriptFrame(int frame, int frames) {
+    float t = frames > 1 && !scriptStill ? (float)frame / (frames - 1) : 0.0f;
+    float lastCam[4] = {camX, camY, camZ, angle};
+    camX = 0.0f;
+    camY = 2.0f;
+    if (t < 0.4f) {
+        camZ = 15.0f - 14.0f * (t / 0.4f);
+        angle = 0.0f;
+    } else if (t < 0.7f) {
+        camZ = 1.0f - 4.0f * ((t - 0.4f) / 0.3f);
+        angle = 0.0f;
+    } else {
+        camZ = -3.0f;
+        angle = 2.0f * M_PI * (t - 0.7f) / 0.3f;
+    }
+    if (camX != lastCam[0] || camY != lastCam[1] || camZ != lastCam[2] || angle != lastCam[3]) markDirty();
+    if (scriptStill) return;
+    if (frame == 0) queueInput(INPUT_KEY, 'd');
+    if (frame == frames / 4) queueInput(INPUT_KEY, 'r');
+    if (frame == frames / 2) queueInput(INPUT_KEY, 'b');
+    if (frame == frames * 3 / 5) queueInput(INPUT_KEY, 'g');
+    if (frame == frames * 4 / 5) queueInput(INPUT_KEY, 'g');
+}
+
+bool startHeadless(const RunOptions &opt) {
+    if (!createHeadlessContext(opt.width, opt.height)) {
+        cerr << "error: could not create a headless EGL context\n";
+        return false;
+    }
+    headlessMode = true;
+    init();
+    reshape(opt.width, opt.height);
+    // runs are compared frame by frame, so the texture must not arrive mid-run
+    finishTextureLoad(grassLoad, true);
+    return true;
+}
+
+FILE *openReport(const RunOptions &opt) {
+    FILE *out = opt.outPath.empty() ? stdout : fopen(opt.outPath.c_str(), "w");
+    if (!out) cerr << "error: cannot write " << opt.outPath << "\n";
+    return out;
+}
+
+double msSince(chrono::steady_clock::time_point t0) {
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+}
+
+// particle update (scalar vs SIMD) and draw cost against particle count
+int runParticleBenchmark(const RunOptions &opt) {
+    if (!startHeadless(opt)) return 1;
+    camX = 0.0f; camY = 2.0f; camZ = -1.0f; angle = 0.0f;
+    const int counts[] = {1000, 10000, 100000, 1000000};
+    const int iterations = 20, drawIterations = 5;
+    FILE *out = openReport(opt);
+    if (!out) return 1;
+    fprintf(out, "{\n  \"renderer\": \"%s\",\n  \"particles\": [", (const char*)glGetString(GL_RENDERER));
+    for (int c = 0; c < 4; c++) {
+        ParticleSystem ps;
+        spawnBubbles(ps, counts[c]);
+        chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++) integrateParticlesScalar(ps, 1.0f);
+        double scalarMs = msSince(t0) / iterations;
+        t0 = chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++) integrateParticles(ps, 1.0f);
+        double simdMs = msSince(t0) / iterations;
+        drawParticles(ps); // first upload allocates the buffer
+        glFinish();
+        t0 = chrono::steady_clock::now();
+        for (int i = 0; i < drawIterations; i++) {
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            glLoadIdentity();
+            gluLookAt(camX, camY, camZ, camX + sin(angle), camY, camZ - cos(angle), 0.0f, 1.0f, 0.0f);
+            drawParticles(ps);
+            glFinish();
+        }
+        double drawMs = msSince(t0) / drawIterations;
+        glDeleteBuffers(1, &ps.vbo);
+        fprintf(out, "%s\n    {\"count\": %d, \"update_scalar_ms\": %.4f, \"update_simd_ms\": %.4f, \"draw_ms\": %.4f}",
+                c ? "," : "", counts[c], scalarMs, simdMs, drawMs);
+    }
+    fprintf(out, "\n  ]\n}\n");
+    if (out != stdout) fclose(out);
+    return 0;
+}
+
+// Light binning (scalar vs SIMD) and frame cost against practical light
+// count, from inside the room looking at the table.
+int runLightBenchmark(const RunOptions &opt) {
+    if (!startHeadless(opt)) return 1;
+    if (!clusterBuffers[0]) {
+        cerr << "error: clustered lights need the GLSL 3.3 lighting path\n";
+        return 1;
+    }
+    camX = 0.0f; camY = 2.0f; camZ = -1.0f; angle = 0.0f;
+    const int counts[] = {0, 16, 64, 256, 1024, 4096};
+    const int iterations = 20, drawIterations = 10;
+    FILE *out = openReport(opt);
+    if (!out) return 1;
+    fprintf(out, "{\n  \"renderer\": \"%s\",\n  \"clusters\": [%d, %d, %d],\n  \"lights\": [",
+            (const char*)glGetString(GL_RENDERER), CLUSTER_X, CLUSTER_Y, CLUSTER_Z);
+    for (int c = 0; c < 6; c++) {
+        spawnExtraLights(counts[c]);
+        drawScene(); // builds the grid and sizes the buffers
+        glFinish();
+        chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++) binLightsScalar(viewLights);
+        double scalarMs = msSince(t0) / iterations;
+        vector<uint16_t> scalarSlots = clusterSlots, scalarCounts = clusterCounts;
+        t0 = chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++) binLights(viewLights);
+        double simdMs = msSince(t0) / iterations;
+        bool match = scalarCounts == clusterCounts;
+        for (int k = 0; match && k < NUM_CLUSTERS; k++)
+            match = equal(&clusterSlots[k * MAX_LIGHTS_PER_CLUSTER], &clusterSlots[k * MAX_LIGHTS_PER_CLUSTER] + clusterCounts[k],
+                          &scalarSlots[k * MAX_LIGHTS_PER_CLUSTER]);
+        clusterMaxCount = 0;
+        compactClusters();
+        long overflowAtStart = clusterOverflow;
+        t0 = chrono::steady_clock::now();
+        for (int i = 0; i < drawIterations; i++) {
+            drawScene();
+            glFinish();
+        }
+        double frameMs = msSince(t0) / drawIterations;
+        fprintf(out, "%s\n    {\"count\": %d, \"bin_scalar_ms\": %.4f, \"bin_simd_ms\": %.4f, \"match\": %s, "
+                "\"frame_ms\": %.4f, \"indices\": %d, \"avg_per_cluster\": %.2f, \"max_per_cluster\": %d, \"overflow\": %ld}",
+                c ? "," : "", counts[c], scalarMs, simdMs, match ? "true" : "false", frameMs,
+                (int)clusterIndices.size(), (double)clusterIndices.size() / NUM_CLUSTERS, clusterMaxCount,
+                (clusterOverflow - overflowAtStart) / drawIterations);
+    }
+    fprintf(out, "\n  ]\n}\n");
+    if (out != stdout) fclose(out);
+    return 0;
+}
+
+// Draw command building against scene size and worker count. The scene is
+// repeated on a grid in front of the camera; only building and sorting the
+// commands is timed, not submitting them.
+int runCommandBenchmark(const RunOptions &opt) {
+    if (!startHeadless(opt)) return 1;
+    camX = 0.0f; camY = 2.0f; camZ = 15.0f; angle = 0.0f;
+    const int copies[] = {1, 16, 256, 4096};
+    const int iterations = 20;
+    FILE *out = openReport(opt);
+    if (!out) return 1;
+    fprintf(out, "{\n  \"renderer\": \"%s\",\n  \"workers\": %d,\n  \"commands\": [",
+            (const char*)glGetString(GL_RENDERER), poolSize);
+    for (int c = 0; c < 4; c++) {
+        commandCopies = copies[c];
+        double oneMs = 0.0;
+        for (int workers = 1; workers <= poolSize; workers *= 2) {
+            poolActive = workers;
+            long stealsAtStart = poolSteals;
+            buildFrustum(camX, camY, camZ, angle);
+            updateSceneTransforms();
+            buildCommandLists(); // sizes the arenas
+            chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+            for (int i = 0; i < iterations; i++) {
+                cullTested = cullRejected = 0;
+                buildCommandLists();
+            }
+            double ms = msSince(t0) / iterations;
+            if (workers == 1) oneMs = ms;
+            fprintf(out, "%s\n    {\"copies\": %d, \"nodes\": %u, \"workers\": %d, \"build_ms\": %.4f, "
+                    "\"speedup\": %.2f, \"commands\": %d, \"steals\": %ld}",
+                    c || workers > 1 ? "," : "", copies[c], copies[c] * scene.header->nodeCount, workers, ms,
+                    oneMs / ms, (int)drawCommands.size(), (poolSteals - stealsAtStart) / (iterations + 1));
+            if (workers < poolSize && workers * 2 > poolSize) workers = poolSize / 2; // end on all of them
+        }
+    }
+    fprintf(out, "\n  ]\n}\n");
+    if (out != stdout) fclose(out);
+    commandCopies = 1;
+    poolActive = poolSize;
+    return 0;
+}
+
+// Sliding-move cost against obstacle count. Boxes are scattered over a fixed
+// 200x200 area, so density grows with count the way a cluttered scene would.
+// No GL needed.
+int runCollisionBenchmark(const RunOptions &opt) {
+    const int counts[] = {100, 1000, 10000, 100000};
+    const int moves = 20000;
+    FILE *out = openReport(opt);
+    if (!out) return 1;
+    fprintf(out, "{\n  \"collision\": [");
+    for (int c = 0; c < 4; c++) {
+        CollisionWorld w;
+        Pcg32 rng = pcgSeed(sceneSeed, c);
+        for (int i = 0; i < counts[c]; i++) {
+            float x = pcgFloat(rng) * 200.0f - 100.0f, z = pcgFloat(rng) * 200.0f - 100.0f;
+            float sx = 0.1f + pcgFloat(rng) * 0.5f, sz = 0.1f + pcgFloat(rng) * 0.5f;
+            addCollider(w, makeBounds(x, 0.0f, z, x + sx, 1.0f + pcgFloat(rng), z + sz));
+        }
+        vector<float> starts(moves * 3), deltas(moves * 3);
+        for (int i = 0; i < moves; i++) {
+            float a = pcgFloat(rng) * 2.0f * M_PI;
+            starts[i * 3] = pcgFloat(rng) * 200.0f - 100.0f;
+            starts[i * 3 + 1] = 2.0f;
+            starts[i * 3 + 2] = pcgFloat(rng) * 200.0f - 100.0f;
+            deltas[i * 3] = moveSpeed * sin(a);
+            deltas[i * 3 + 1] = 0.0f;
+            deltas[i * 3 + 2] = moveSpeed * cos(a);
+        }
+        double us[2], tests[2];
+        float checksum[2] = {0.0f, 0.0f};
+        int bruteMoves = min(moves, 2000000 / counts[c]); // brute force gets slow
+        for (int grid = 1; grid >= 0; grid--) {
+            int n = grid ? moves : bruteMoves;
+            w.queries = w.boxTests = 0;
+            chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+            for (int i = 0; i < n; i++) {
+                float pos[3] = {starts[i * 3], starts[i * 3 + 1], starts[i * 3 + 2]};
+                slideSphere(w, pos, &deltas[i * 3], PLAYER_RADIUS, 0.0f, grid != 0);
+                if (i < bruteMoves) checksum[grid] += pos[0] + pos[2];
+            }
+            us[grid] = msSince(t0) * 1000.0 / n;
+            tests[grid] = (double)w.boxTests / max(1L, w.queries);
+        }
+        if (fabs(checksum[0] - checksum[1]) > 1e-2f)
+            cerr << "warning: grid and brute-force moves disagree at " << counts[c] << " obstacles\n";
+        fprintf(out, "%s\n    {\"obstacles\": %d, \"grid_us_per_move\": %.3f, \"brute_us_per_move\": %.3f, "
+                "\"grid_boxes_per_sweep\": %.2f, \"brute_boxes_per_sweep\": %.0f}",
+                c ? "," : "", counts[c], us[1], us[0], tests[1], tests[0]);
+    }
+    fprintf(out, "\n  ]\n}\n");
+    if (out != stdout) fclose(out);
+    return 0;
+}
+
+// Transform hierarchy updates for 1k..100k nodes in a binary tree: every
+// world matrix with the scalar multiply, every one with the SIMD multiply,
+// and dirty-only passes where 1% of the locals change each time (an
+// animated subtree's worth). No GL needed.
+int runTransformBenchmark(const RunOptions &opt) {
+    const int counts[] = {1000, 10000, 100000};
+    const int iterations = 20;
+    FILE *out = openReport(opt);
+    if (!out) return 1;
+    fprintf(out, "{\n  \"transforms\": [");
+    for (int c = 0; c < 3; c++) {
+        clearTransforms();
+        Pcg32 rng = pcgSeed(sceneSeed, 0x7f0 + c);
+        vector<int> depth(counts[c], 0);
+        int maxDepth = 0;
+        for (int i = 0; i < counts[c]; i++) {
+            float m[16];
+            mat4Identity(m);
+            mat4Translate(m, pcgFloat(rng) - 0.5f, 1.0f, pcgFloat(rng) - 0.5f);
+            mat4Rotate(m, pcgFloat(rng) * 360.0f, 0.0f, 1.0f, 0.0f);
+            int parent = i ? (i - 1) / 2 : -1;
+            if (i) maxDepth = max(maxDepth, depth[i] = depth[parent] + 1);
+            addTransform(parent, m);
+        }
+        chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++) updateTransformsScalar();
+        double scalarMs = msSince(t0) / iterations;
+        vector<float> scalarWorld(counts[c] * 16);
+        for (int i = 0; i < counts[c]; i++) memcpy(&scalarWorld[i * 16], transforms[i].world, 16 * sizeof(float));
+        t0 = chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++) {
+            fill(transformDirty.begin(), transformDirty.end(), 1);
+            updateTransforms();
+        }
+        double simdMs = msSince(t0) / iterations;
+        float worst = 0.0f;
+        for (int i = 0; i < counts[c]; i++)
+            for (int k = 0; k < 16; k++) worst = max(worst, fabs(scalarWorld[i * 16 + k] - transforms[i].world[k]));
+        int touched = max(1, counts[c] / 100);
+        long recomputed = 0;
+        double dirtyMs = 0.0;
+        for (int i = 0; i < iterations; i++) {
+            for (int k = 0; k < touched; k++) {
+                int id = pcgNext(rng) % counts[c];
+                float m[16];
+                memcpy(m, transforms[id].local, sizeof(m));
+                mat4Rotate(m, 1.0f, 0.0f, 1.0f, 0.0f);
+                setLocalTransform(id, m);
+            }
+            t0 = chrono::steady_clock::now(); // only the pass, not the posing
+            recomputed += updateTransforms();
+            dirtyMs += msSince(t0);
+        }
+        fprintf(out, "%s\n    {\"nodes\": %d, \"depth\": %d, \"full_scalar_ms\": %.4f, \"full_simd_ms\": %.4f, "
+                "\"max_error\": %.2g, \"dirty_locals\": %d, \"dirty_ms\": %.4f, \"recomputed_per_pass\": %.1f}",
+                c ? "," : "", counts[c], maxDepth, scalarMs, simdMs, worst, touched, dirtyMs / iterations,
+                (double)recomputed / iterations);
+    }
+    fprintf(out, "\n  ]\n}\n");
+    if (out != stdout) fclose(out);
+    clearTransforms();
+    return 0;
+}
+
+// Keyframe evaluation for 1k..100k channels, each looping one of 16 random
+// tracks (2..8 keys, mixed easings) from a random phase, ticked at 16 ms:
+// one channel at a time against four at a time. No GL needed.
+int runAnimationBenchmark(const RunOptions &opt) {
+    const int counts[] = {1000, 10000, 100000};
+    const int numTracks = 16, iterations = 100;
+    Pcg32 rng = pcgSeed(sceneSeed, 0xa41);
+    vector<SceneTrack> tracks;
+    vector<SceneKeyframe> keys;
+    for (int t = 0; t < numTracks; t++) {
+        SceneTrack track = {0, 0, TRACK_LOOP, (uint32_t)keys.size(), 2 + pcgNext(rng) % 7};
+        float time = 0.0f;
+        for (uint32_t k = 0; k < track.keyCount; k++) {
+            SceneKeyframe key = {time, pcgFloat(rng) * 2.0f - 1.0f, pcgNext(rng) % EASING_COUNT};
+            keys.push_back(key);
+            time += 0.05f + pcgFloat(rng) * 0.45f;
+        }
+        tracks.push_back(track);
+    }
+    FILE *out = openReport(opt);
+    if (!out) return 1;
+    fprintf(out, "{\n  \"animation\": [");
+    for (int c = 0; c < 3; c++) {
+        Animator scalar, simd;
+        initAnimator(scalar, counts[c], &tracks[0], &keys[0]);
+        for (int i = 0; i < counts[c]; i++) playTrack(scalar, i, i % numTracks, -pcgFloat(rng) * 4.0f, false);
+        simd = scalar;
+        chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        for (int i = 1; i <= iterations; i++) evaluateAnimatorScalar(scalar, i * TICK_SECONDS);
+        double scalarMs = msSince(t0) / iterations;
+        long segmentsAtStart = simd.segmentsEntered;
+        t0 = chrono::steady_clock::now();
+        for (int i = 1; i <= iterations; i++) evaluateAnimator(simd, i * TICK_SECONDS);
+        double simdMs = msSince(t0) / iterations;
+        float worst = 0.0f;
+        for (int i = 0; i < counts[c]; i++) worst = max(worst, fabs(scalar.value[i] - simd.value[i]));
+        fprintf(out, "%s\n    {\"channels\": %d, \"tracks\": %d, \"scalar_ms\": %.4f, \"simd_ms\": %.4f, "
+                "\"max_error\": %.2g, \"segments_per_tick\": %.1f}",
+                c ? "," : "", counts[c], numTracks, scalarMs, simdMs, worst,
+                (double)(simd.segmentsEntered - segmentsAtStart) / iterations);
+    }
+    fprintf(out, "\n  ]\n}\n");
+    if (out != stdout) fclose(out);
+    return 0;
+}
+
+// headless frames are rendered (by llvmpipe, on the CPU) during glFinish()
+void finishHeadlessFrame() {
+    double cpuAtStart = cpuMsNow();
+    glFinish();
+    stampInput(LATENCY_PRESENTED);
+    drawnCpuMs += cpuMsNow() - cpuAtStart;
+}
+
+int runHeadless(const RunOptions &opt) {
+    if (!startHeadless(opt)) return 1;
+
+    const int warmupFrames = 5;
+    for (int i = 0; i < warmupFrames; i++) {
+        drawScene();
+        finishHeadlessFrame();
+    }
+
+    vector<double> frameMs;
+    frameMs.reserve(opt.frames);
+    long issuedAtStart = stateCallsIssued, elidedAtStart = stateCallsElided;
+    long trianglesAtStart = meshTrianglesDrawn;
+    long testedAtStart = cullTestedTotal, rejectedAtStart = cullRejectedTotal, emptyAtStart = cullEmptyFrames;
+    long portalHiddenAtStart = portalHiddenFrames, roomQueriesAtStart = roomQueryFrames;
+    long ticksAtStart = simTicksRun, droppedAtStart = simTicksDropped;
+    long uploadsAtStart = lightingUploads;
+    long clusterFramesAtStart = clusterFrames, clusterLightsAtStart = clusterLightsTotal;
+    long clusterPairsAtStart = clusterPairsTotal, overflowAtStart = clusterOverflow;
+    double binMsAtStart = clusterBinMsTotal;
+    long fullRedrawsAtStart = shadowFullRedraws, regionRedrawsAtStart = shadowRegionRedraws;
+    long texelsAtStart = shadowTexelsRedrawn;
+    long drawnAtStart = framesDrawn, skippedAtStart = framesSkipped;
+    long recomputedAtStart = transformsRecomputed, passesAtStart = transformPassesRun;
+    long submittedAtStart = commandsSubmitted, duplicatesAtStart = duplicateDraws;
+    long instancedAtStart = instancedDraws, instancesAtStart = instancesDrawn;
+    long batchCallsAtStart = batchCalls, batchedRangesAtStart = batchedRanges;
+    double drawnCpuAtStart = drawnCpuMs;
+    resetInputLatency();
+    markDirty(); // even an idle run draws its first frames
+    chrono::steady_clock::time_point runStart = chrono::steady_clock::now();
+    for (int i = 0; i < opt.frames; i++) {
+        chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        if (replayHeader) feedReplay();
+        else scriptFrame(i, opt.frames);
+        simulateFrame(opt.frameDt);
+        if (sceneAnimating()) markDirty();
+        if (!frameDirty()) {
+            framesSkipped++;
+            continue;
+        }
+        drawScene();
+        finishHeadlessFrame();
+        chrono::steady_clock::time_point t1 = chrono::steady_clock::now();
+        frameMs.push_back(chrono::duration<double, milli>(t1 - t0).count());
+    }
+    double totalSec = chrono::duration<double>(chrono::steady_clock::now() - runStart).count();
+    profFlushGpu();
+
+    vector<double> sorted = frameMs;
+    sort(sorted.begin(), sorted.end());
+    double sum = 0.0;
+    for (size_t i = 0; i < frameMs.size(); i++) sum += frameMs[i];
+
+    FILE *out = openReport(opt);
+    if (!out) return 1;
+    fprintf(out, "{\n");
+    fprintf(out, "  \"renderer\": \"%s\",\n", (const char*)glGetString(GL_RENDERER));
+    fprintf(out, "  \"width\": %d,\n  \"height\": %d,\n  \"frames\": %d,\n", opt.width, opt.height, opt.frames);
+    fprintf(out, "  \"frame_ms\": {\"min\": %.4f, \"median\": %.4f, \"p99\": %.4f, \"mean\": %.4f, \"max\": %.4f},\n",
+            sorted.front(), percentile(sorted, 0.5), percentile(sorted, 0.99),
+            sum / frameMs.size(), sorted.back());
+    fprintf(out, "  \"fps\": %.2f,\n", opt.frames / totalSec);
+    fprintf(out, "  \"gl_state_calls_per_frame\": {\"issued\": %.1f, \"elided\": %.1f}",
+            (double)(stateCallsIssued - issuedAtStart) / opt.frames,
+            (double)(stateCallsElided - elidedAtStart) / opt.frames);
+    fprintf(out, ",\n  \"meshes\": {\"cached\": %d, \"lod\": %s, \"triangles_per_frame\": %.1f}",
+            (int)meshCache.size(), lodEnabled ? "true" : "false",
+            (double)(meshTrianglesDrawn - trianglesAtStart) / opt.frames);
+    fprintf(out, ",\n  \"culling\": {\"enabled\": %s, \"tested_per_frame\": %.1f, \"culled_per_frame\": %.1f, \"empty_frames\": %ld}",
+            cullingEnabled ? "true" : "false",
+            (double)(cullTestedTotal - testedAtStart) / opt.frames,
+            (double)(cullRejectedTotal - rejectedAtStart) / opt.frames,
+            cullEmptyFrames - emptyAtStart);
+    fprintf(out, ",\n  \"portal\": {\"enabled\": %s, \"interior_hidden_frames\": %ld, \"occlusion_queries\": %ld}",
+            portalCullingEnabled ? "true" : "false",
+            portalHiddenFrames - portalHiddenAtStart, roomQueryFrames - roomQueriesAtStart);
+    fprintf(out, ",\n  \"lighting\": {\"path\": \"%s\", \"ubo_uploads_per_frame\": %.1f}",
+            shaderLighting ? "glsl" : "fixed-function", (double)(lightingUploads - uploadsAtStart) / opt.frames);
+    long clustered = max(1L, clusterFrames - clusterFramesAtStart);
+    fprintf(out, ",\n  \"clustered_lights\": {\"enabled\": %s, \"lights\": %.1f, \"indices_per_frame\": %.1f, "
+            "\"max_per_cluster\": %d, \"overflow\": %ld, \"bin_ms\": %.4f}",
+            clusterBuffers[0] ? "true" : "false",
+            (double)(clusterLightsTotal - clusterLightsAtStart) / clustered,
+            (double)(clusterPairsTotal - clusterPairsAtStart) / clustered, clusterMaxCount,
+            clusterOverflow - overflowAtStart, (clusterBinMsTotal - binMsAtStart) / clustered);
+    fprintf(out, ",\n  \"shadows\": {\"maps\": %d, \"cache\": %s, \"full_redraws\": %ld, \"region_redraws\": %ld, "
+            "\"texels_per_frame\": %.1f}",
+            shadowMapsAvailable ? (int)shadowMaps.size() : 0, shadowCacheEnabled ? "true" : "false",
+            shadowFullRedraws - fullRedrawsAtStart, shadowRegionRedraws - regionRedrawsAtStart,
+            (double)(shadowTexelsRedrawn - texelsAtStart) / opt.frames);
+    long drawn = framesDrawn - drawnAtStart, skipped = framesSkipped - skippedAtStart;
+    double cpuPerDrawn = drawn ? (drawnCpuMs - drawnCpuAtStart) / drawn : 0.0;
+    fprintf(out, ",\n  \"damage\": {\"enabled\": %s, \"drawn\": %ld, \"skipped\": %ld, \"skipped_fraction\": %.3f, "
+            "\"cpu_ms_per_drawn\": %.4f, \"cpu_ms_saved\": %.1f}",
+            damageTracking ? "true" : "false", drawn, skipped, (double)skipped / opt.frames, cpuPerDrawn,
+            skipped * cpuPerDrawn);
+    fprintf(out, ",\n  \"transforms\": {\"nodes\": %d, \"recomputed_per_frame\": %.2f}",
+            (int)transforms.size(),
+            (double)(transformsRecomputed - recomputedAtStart) / max(1L, transformPassesRun - passesAtStart));
+    fprintf(out, ",\n  \"submission\": {\"commands_per_frame\": %.2f, \"duplicates_dropped_per_frame\": %.2f, "
+            "\"instanced_draws_per_frame\": %.2f, \"instances_per_frame\": %.2f}",
+            (double)(commandsSubmitted - submittedAtStart) / max(1L, drawn),
+            (double)(duplicateDraws - duplicatesAtStart) / max(1L, drawn),
+            (double)(instancedDraws - instancedAtStart) / max(1L, drawn),
+            (double)(instancesDrawn - instancesAtStart) / max(1L, drawn));
+    fprintf(out, ",\n  \"static_batch\": {\"path\": \"%s\", \"draws_per_frame\": %.2f, \"nodes_per_frame\": %.2f}",
+            !batchVBO ? "off" : pglMultiDrawElementsIndirect ? "multi-draw-indirect" : "multi-draw",
+            (double)(batchCalls - batchCallsAtStart) / max(1L, drawn),
+            (double)(batchedRanges - batchedRangesAtStart) / max(1L, drawn));
+    fprintf(out, ",\n  \"startup\": {\"scene\": \"%s\", \"nodes\": %u, \"convert_ms\": %.3f, \"load_ms\": %.3f, \"init_ms\": %.3f}",
+            scene.path.c_str(), scene.header->nodeCount, sceneConvertMs, sceneLoadMs, initMs);
+    fprintf(out, ",\n  \"textures\": {\"grass\": \"%s\", \"levels\": %u, \"decode_ms\": %.3f, \"upload_ms\": %.3f}",
+            grassLoad.source, grassLoad.mips.levels,
+            grassLoad.decodeMs, grassLoad.uploadMs);
+    fprintf(out, ",\n  \"input\": {\"source\": \"%s\", \"events\": %zu, \"latency_ms\": {\"buckets\": [",
+            replayHeader ? opt.replayPath.c_str() : (scriptStill ? "still" : "script"),
+            inputLatency[LATENCY_DRAINED].samples.size());
+    for (int b = 0; b < NUM_LATENCY_BUCKETS - 1; b++) fprintf(out, "%s%g", b ? ", " : "", latencyBucketMs[b]);
+    fprintf(out, "]");
+    // time from arrival to each stage; counts per bucket, the last one open-ended
+    for (int st = 0; st < LATENCY_STAGE_COUNT; st++) {
+        const LatencyHistogram &h = inputLatency[st];
+        vector<double> sorted = h.samples;
+        sort(sorted.begin(), sorted.end());
+        fprintf(out, ",\n    \"%s\": {\"median\": %.3f, \"p99\": %.3f, \"max\": %.3f, \"counts\": [",
+                latencyStageNames[st], sorted.empty() ? 0.0 : percentile(sorted, 0.5),
+                sorted.empty() ? 0.0 : percentile(sorted, 0.99), sorted.empty() ? 0.0 : sorted.back());
+        for (int b = 0; b < NUM_LATENCY_BUCKETS; b++) fprintf(out, "%s%ld", b ? ", " : "", h.counts[b]);
+        fprintf(out, "]}");
+    }
+    fprintf(out, "}}");
+    fprintf(out, ",\n  \"simulation\": {\"tick_ms\": %.1f, \"frame_dt_ms\": %.3f, \"ticks\": %ld, \"dropped_ticks\": %ld}",
+            TICK_SECONDS * 1000.0, opt.frameDt * 1000.0,
+            simTicksRun - ticksAtStart, simTicksDropped - droppedAtStart);
+    if (profilerEnabled) {
+        double cpuMs[PROF_COUNT], gpuMs[PROF_COUNT];
+        profAverages(opt.frames, cpuMs, gpuMs);
+        fprintf(out, ",\n  \"phases_ms\": {");
+        for (int p = 0; p < PROF_COUNT; p++)
+            fprintf(out, "%s\n    \"%s\": {\"cpu\": %.4f, \"gpu\": %.4f}", p ? "," : "",
+                    profPhaseNames[p], cpuMs[p], gpuMs[p]);
+        fprintf(out, "\n  }");
+    }
+    fprintf(out, "\n");
+    fprintf(out, "}\n");
+    if (out != stdout) fclose(out);
+    return 0;
+}
+
+// regression checks
+// --check-record DIR renders a fixed set of camera poses and scene states
+// offscreen and stores each picture with its frame time, GL state calls and
+// triangles as the budget; --check DIR renders them again and fails when a
+// picture differs visibly or a count goes over budget. Pictures are
+// compared in CIELAB: a pixel counts as changed past a colour difference
+// clearly above what rasterisation noise produces, and a small share of
+// changed pixels is allowed for edges. References belong to the renderer
+// that recorded them; the ones under checks/ were recorded with llvmpipe,
+// one set per lighting path, and are re-recorded with --check-record when
+// a change to the picture or the budget is intended. frame_ms is an
+// absolute time and only holds on the host that recorded it; elsewhere a
+// time failure says nothing until the references are re-recorded there.
+const int CHECK_WIDTH = 400, CHECK_HEIGHT = 300;
+const int CHECK_FRAMES = 10;             // drawn per case: the best time and the last picture count
+const float CHECK_DELTA_E = 8.0f;        // per pixel
+const float CHECK_CHANGED_SHARE = 0.005f;
+const float CHECK_TIME_SLACK = 1.5f;     // frame time over the best recorded,
+const float CHECK_TIME_MARGIN_MS = 2.0f; // plus this much for scheduling noise
+const float CHECK_COUNT_SLACK = 1.05f;   // state calls and triangles
+
+struct CheckCase {
+    const char *name;
+    float cam[4];    // x, y, z, angle
+    const char *keys;
+    int ticks;       // simulated after the keys
+};
+
+const CheckCase checkCases[] = {
+    {"door-closed",  {0.0f, 2.0f, 15.0f, 0.0f},  "",  0},
+    {"door-open",    {0.0f, 2.0f, 15.0f, 0.0f},  "d", 30},
+    {"room",         {0.0f, 2.0f, -1.0f, 0.0f},  "",  0},
+    {"green-mode",   {0.0f, 2.0f, -1.0f, 0.0f},  "g", 0},
+    {"ceiling-off",  {0.0f, 2.0f, -1.0f, 0.0f},  "l", 0},
+    {"bubbles",      {0.0f, 2.0f, -1.0f, 0.0f},  "r", 60},
+    {"broom-flight", {2.0f, 3.0f, -1.5f, -0.6f}, "b", 50},
+};
+const int NUM_CHECK_CASES = sizeof(checkCases) / sizeof(checkCases[0]);
+
+struct CheckBudget {
+    double frameMs;
+    long stateCalls, triangles;
+};
+
+// back to the state init() leaves, so each case starts from the same place
+void resetSceneState() {
+    initSceneAnimation();
+    applySceneAnimation();
+    ceilingLightOn = true;
+    globalAmbientLevel = 0.3f;
+    heelClicking = false;
+    greenMode = false;
+    whiteGlowOn = true;
+    greenLightOn = true;
+    bubblesActive = false;
+    spawnBubbles(bubbles, numBubbles);
+    simTime = 0.0;
+    simAccumulator = 0.0;
+    renderAlpha = 1.0f;
+    updateMovingColliders();
+    simStates[0] = simStates[1] = view = captureSimState();
+    glLoadIdentity(); // eye-space light positions are taken under the modelview
+    applySceneLights();
+    invalidateShadowMaps();
+}
+
+bool writePpm(const string &path, int w, int h, const vector<unsigned char> &rgb) {
+    FILE *out = fopen(path.c_str(), "wb");
+    if (!out) return false;
+    fprintf(out, "P6\n%d %d\n255\n", w, h);
+    bool ok = fwrite(rgb.data(), 1, rgb.size(), out) == rgb.size();
+    return fclose(out) == 0 && ok;
+}
+
+bool readPpm(const string &path, int w, int h, vector<unsigned char> &rgb) {
+    FILE *in = fopen(path.c_str(), "rb");
+    if (!in) return false;
+    int fw = 0, fh = 0, maxval = 0;
+    bool ok = fscanf(in, "P6 %d %d %d", &fw, &fh, &maxval) == 3 && fgetc(in) != EOF &&
+              fw == w && fh == h && maxval == 255;
+    rgb.resize(w * h * 3);
+    ok = ok && fread(rgb.data(), 1, rgb.size(), in) == rgb.size();
+    fclose(in);
+    return ok;
+}
+
+// the back buffer, top row first
+void readFrame(vector<unsigned char> &rgb) {
+    rgb.resize(CHECK_WIDTH * CHECK_HEIGHT * 3);
+    vector<unsigned char> rows(rgb.size());
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, CHECK_WIDTH, CHECK_HEIGHT, GL_RGB, GL_UNSIGNED_BYTE, rows.data());
+    int stride = CHECK_WIDTH * 3;
+    for (int y = 0; y < CHECK_HEIGHT; y++)
+        memcpy(&rgb[y * stride], &rows[(CHECK_HEIGHT - 1 - y) * stride], stride);
+}
+
+void srgbToLab(const unsigned char *c, float lab[3]) {
+    float lin[3];
+    for (int i = 0; i < 3; i++) {
+        float v = c[i] / 255.0f;
+        lin[i] = v <= 0.04045f ? v / 12.92f : pow((v + 0.055f) / 1.055f, 2.4f);
+    }
+    // D65 white
+    float xyz[3] = {(0.4124f * lin[0] + 0.3576f * lin[1] + 0.1805f * lin[2]) / 0.95047f,
+                    0.2126f * lin[0] + 0.7152f * lin[1] + 0.0722f * lin[2],
+                    (0.0193f * lin[0] + 0.1192f * lin[1] + 0.9505f * lin[2]) / 1.08883f};
+    float f[3];
+    for (int i = 0; i < 3; i++)
+        f[i] = xyz[i] > 0.008856f ? cbrt(xyz[i]) : 7.787f * xyz[i] + 16.0f / 116.0f;
+    lab[0] = 116.0f * f[1] - 16.0f;
+    lab[1] = 500.0f * (f[0] - f[1]);
+    lab[2] = 200.0f * (f[1] - f[2]);
+}
+
+// mean CIE76 difference, and the share of pixels past CHECK_DELTA_E
+void compareImages(const vector<unsigned char> &a, const vector<unsigned char> &b, double &meanDeltaE,
+                   double &changedShare) {
+    size_t pixels = a.size() / 3, changed = 0;
+    double sum = 0.0;
+    for (size_t i = 0; i < pixels; i++) {
+        if (a[i * 3] == b[i * 3] && a[i * 3 + 1] == b[i * 3 + 1] && a[i * 3 + 2] == b[i * 3 + 2]) continue;
+        float la[3], lb[3];
+        srgbToLab(&a[i * 3], la);
+        srgbToLab(&b[i * 3], lb);
+        float d = sqrt((la[0] - lb[0]) * (la[0] - lb[0]) + (la[1] - lb[1]) * (la[1] - lb[1]) +
+                       (la[2] - lb[2]) * (la[2] - lb[2]));
+        sum += d;
+        if (d > CHECK_DELTA_E) changed++;
+    }
+    meanDeltaE = sum / pixels;
+    changedShare = (double)changed / pixels;
+}
+
+bool readBudgets(const string &path, map<string, CheckBudget> &budgets) {
+    ifstream in(path.c_str());
+    if (!in) return false;
+    string line;
+    while (getline(in, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        istringstream fields(line);
+        string name;
+        CheckBudget b;
+        if (fields >> name >> b.frameMs >> b.stateCalls >> b.triangles) budgets[name] = b;
+    }
+    return true;
+}
+
+// the best frame time of a round, and the last frame's counts
+void drawCheckFrames(CheckBudget &got) {
+    for (int f = 0; f < CHECK_FRAMES; f++) {
+        long trianglesAtStart = meshTrianglesDrawn;
+        chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        drawScene();
+        glFinish();
+        got.frameMs = min(got.frameMs, msSince(t0));
+        got.stateCalls = frameStateIssued;
+        got.triangles = meshTrianglesDrawn - trianglesAtStart;
+    }
+}
+
+// renders every case; record stores the results as the new references
+int runChecks(RunOptions opt, string dir, bool record) {
+    opt.width = CHECK_WIDTH;
+    opt.height = CHECK_HEIGHT;
+    if (!startHeadless(opt)) return 1;
+    if (dir.empty()) dir = shaderLighting ? "checks/glsl" : "checks/fixed-function";
+    string renderer = (const char*)glGetString(GL_RENDERER);
+    map<string, CheckBudget> budgets;
+    if (record) {
+        for (size_t slash = dir.find('/', 1); slash != string::npos; slash = dir.find('/', slash + 1))
+            mkdir(dir.substr(0, slash).c_str(), 0755);
+        mkdir(dir.c_str(), 0755);
+    }
+    else if (!readBudgets(dir + "/budget.txt", budgets)) {
+        cerr << "error: no " << dir << "/budget.txt, record references with --check-record first\n";
+        return 1;
+    }
+    bool damage = damageTracking;
+    damageTracking = false;
+    FILE *out = openReport(opt);
+    if (!out) return 1;
+    ostringstream budgetFile;
+    budgetFile << "# " << renderer << ", " << CHECK_WIDTH << "x" << CHECK_HEIGHT << "\n"
+               << "# frame_ms holds only on the host that recorded it\n"
+               << "# case frame_ms state_calls triangles\n";
+    fprintf(out, "{\n  \"renderer\": \"%s\",\n  \"mode\": \"%s\",\n  \"cases\": [", renderer.c_str(),
+            record ? "record" : "check");
+    bool allPassed = true;
+    for (int c = 0; c < NUM_CHECK_CASES; c++) {
+        const CheckCase &k = checkCases[c];
+        resetSceneState();
+        camX = k.cam[0]; camY = k.cam[1]; camZ = k.cam[2]; angle = k.cam[3];
+        for (const char *key = k.keys; *key; key++) queueInput(INPUT_KEY, (unsigned char)*key);
+        simulateFrame(0.0);
+        for (int t = 0; t < k.ticks; t++) advanceSimulation(TICK_SECONDS);
+        CheckBudget got = {1e9, 0, 0};
+        drawCheckFrames(got);
+        vector<unsigned char> image, reference;
+        readFrame(image);
+        string imagePath = dir + "/" + k.name + ".ppm";
+        fprintf(out, "%s\n    {\"name\": \"%s\"", c ? "," : "", k.name);
+        if (record) {
+            if (!writePpm(imagePath, CHECK_WIDTH, CHECK_HEIGHT, image)) {
+                cerr << "error: cannot write " << imagePath << "\n";
+                allPassed = false;
+            }
+            budgetFile << k.name << " " << got.frameMs << " " << got.stateCalls << " " << got.triangles << "\n";
+            fprintf(out, ", \"frame_ms\": %.3f, \"state_calls\": %ld, \"triangles\": %ld}",
+                    got.frameMs, got.stateCalls, got.triangles);
+            continue;
+        }
+        vector<string> failures;
+        double meanDeltaE = 0.0, changedShare = 1.0;
+        if (!readPpm(imagePath, CHECK_WIDTH, CHECK_HEIGHT, reference)) failures.push_back("no reference image");
+        else {
+            compareImages(image, reference, meanDeltaE, changedShare);
+            if (changedShare > CHECK_CHANGED_SHARE) failures.push_back("picture changed");
+        }
+        map<string, CheckBudget>::const_iterator b = budgets.find(k.name);
+        if (b == budgets.end()) failures.push_back("no budget");
+        else {
+            double timeBudget = b->second.frameMs * CHECK_TIME_SLACK + CHECK_TIME_MARGIN_MS;
+            if (got.frameMs > timeBudget) drawCheckFrames(got); // a second round before calling it slow
+            if (got.frameMs > timeBudget) failures.push_back("frame time over budget");
+            if (got.stateCalls > b->second.stateCalls * CHECK_COUNT_SLACK) failures.push_back("state calls over budget");
+            if (got.triangles > b->second.triangles * CHECK_COUNT_SLACK) failures.push_back("triangles over budget");
+            fprintf(out, ", \"frame_ms\": %.3f, \"state_calls\": %ld, \"triangles\": %ld",
+                    got.frameMs, got.stateCalls, got.triangles);
+            fprintf(out, ", \"budget\": {\"frame_ms\": %.3f, \"state_calls\": %ld, \"triangles\": %ld}",
+                    b->second.frameMs, b->second.stateCalls, b->second.triangles);
+        }
+        fprintf(out, ", \"mean_delta_e\": %.3f, \"changed_share\": %.5f, \"passed\": %s",
+                meanDeltaE, changedShare, failures.empty() ? "true" : "false");
+        if (!failures.empty()) {
+            // keep what was drawn next to the reference for a look
+            writePpm(dir + "/" + k.name + ".actual.ppm", CHECK_WIDTH, CHECK_HEIGHT, image);
+            allPassed = false;
+            fprintf(out, ", \"failures\": [");
+            for (size_t i = 0; i < failures.size(); i++) {
+                fprintf(out, "%s\"%s\"", i ? ", " : "", failures[i].c_str());
+                cerr << "FAIL " << k.name << ": " << failures[i] << "\n";
+            }
+            fprintf(out, "]");
+        }
+        fprintf(out, "}");
+    }
+    fprintf(out, "\n  ],\n  \"passed\": %s\n}\n", allPassed ? "true" : "false");
+    if (out != stdout) fclose(out);
+    if (record && !writeFileAtomically(dir + "/budget.txt", budgetFile.str().data(), budgetFile.str().size())) {
+        cerr << "error: cannot write " << dir << "/budget.txt\n";
+        allPassed = false;
+    }
+    damageTracking = damage;
+    return allPassed ? 0 : 1;
+}
+
 int main(int argc, char** argv) {
+    RunOptions opt;
+    if (!parseArgs(argc, argv, opt)) {
+        cerr << "usage: " << argv[0] << " [--headless] [--frames N] [--size WxH] [--out FILE] [--profile] [--trace FILE]\n"
+             << "       [--bubbles N] [--bench-particles] [--bench-collision] [--sparkles N] [--sparkle-hz F] [--seed N]\n"
+             << "       [--no-lod] [--no-cull] [--no-portal] [--frame-dt S] [--scene FILE] [--fixed-function]\n"
+             << "       [--lights N] [--bench-lights] [--no-shadow-cache] [--no-damage] [--still]\n"
+             << "       [--record FILE] [--replay FILE] [--check [DIR]] [--check-record [DIR]]\n"
+             << "       [--threads N] [--bench-commands] [--bench-transforms] [--bench-animation]\n"
+             << "       " << argv[0] << " --convert-scene IN.txt OUT.ozb\n";
+        return 1;
+    }
+    profilerEnabled = opt.profile;
+    traceOutPath = opt.tracePath;
+    atexit(writeTraceAtExit);
+    atexit(joinTextureLoadsAtExit);
+    atexit(printDamageStatsAtExit);
+    atexit(printInputLatencyAtExit);
+    atexit(writeRecordingAtExit);
+    atexit(stopPoolAtExit);
+    if (!opt.convertIn.empty()) return convertScene(opt.convertIn, opt.convertOut) ? 0 : 1;
+    if (opt.benchCollision) return runCollisionBenchmark(opt);
+    if (opt.benchTransforms) return runTransformBenchmark(opt);
+    if (opt.benchAnimation) return runAnimationBenchmark(opt);
+    if (!opt.replayPath.empty()) {
+        if (!openRecording(opt.replayPath)) return 1;
+        // one frame per recorded tick
+        opt.frames = max(1u, replayHeader->ticks);
+        opt.frameDt = TICK_SECONDS;
+    }
+    if (!openScene(scenePath)) return 1;
+    if (opt.benchParticles) return runParticleBenchmark(opt);
+    if (opt.benchLights) return runLightBenchmark(opt);
+    if (opt.benchCommands) return runCommandBenchmark(opt);
+    if (opt.check) return runChecks(opt, opt.checkDir, opt.checkRecord);
+    if (opt.headless) return runHeadless(opt);
+
     glutInit(&argc, argv);
     glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
     glutInitWindowSize(800, 600);
@@ -897,7 +6309,8 @@ int main(int argc, char** argv) {
     glutKeyboardFunc(keyboard);
     glutMouseFunc(mouseClick);
     interaction();
-    glutTimerFunc(16, update, 0);
+    simClockLast = replayStart = chrono::steady_clock::now();
+    glutIdleFunc(idle);
     glutMainLoop();
     return 0;
 }